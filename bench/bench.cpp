@@ -0,0 +1,455 @@
+// Offline replay benchmark: a local H.264/H.265 file through the real
+// ingest → pacer → (transcoder) → fan-out → sender path into N synthetic
+// viewers whose packets go to a null sink. No network, no browser.
+//
+//   rtsp2webrtc_bench <file> [--viewers=1,10,100,1000] [--loops=N]
+//                     [--realtime] [--ladder=...] [--trace-sample=N]
+//                     [--udp=host:port] [--hevc-viewers=N] [--max-drift-ms=N]
+//   rtsp2webrtc_bench <file> --nal-scan[=passes]
+//
+// --udp sends every viewer's packets as plain RTP through UdpEgress
+// (sendmmsg + GSO) instead of dropping them, to measure syscalls per frame.
+// --hevc-viewers: the first N viewers of each run accept H.265, so an H.265
+// file is passed through to them; with all viewers accepting it the
+// transcoder never starts.
+// With --realtime, ts_drift_ms compares viewer 0's RTP clock with the
+// arrival times of its frames over the whole replay: what the browser's
+// jitter buffer would have to absorb (sources at any or variable frame rate
+// should stay near 0; transcoding latency is constant, not drift).
+// --max-drift-ms turns that into a regression check: it implies --realtime
+// and the exit status is 1 if any run's |ts_drift_ms| exceeds the bound (or
+// viewer 0 received no frames to measure).
+// --nal-scan only times Annex-B NAL splitting over the file's frames: the
+// byte loop the reader used to have, then each NAL scanner kernel this CPU
+// runs.
+#include "egress.h"
+#include "nal_scanner.h"
+#include "relay.h"
+#include "stream_manager.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <new>
+#include <sstream>
+#include <streambuf>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+
+// ==== Allocation counting ====
+// Every C++ heap allocation in the process; FFmpeg's av_malloc is not
+// included (it goes straight to malloc)
+static std::atomic<uint64_t> g_allocs{0};
+
+void *operator new(size_t size) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    if (void *p = std::malloc(size ? size : 1))
+        return p;
+    throw std::bad_alloc();
+}
+
+void *operator new(size_t size, std::align_val_t align) {
+    g_allocs.fetch_add(1, std::memory_order_relaxed);
+    size_t a = static_cast<size_t>(align);
+    if (void *p = std::aligned_alloc(a, (size + a - 1) / a * a))
+        return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void *p) noexcept { std::free(p); }
+void operator delete(void *p, size_t) noexcept { std::free(p); }
+void operator delete(void *p, std::align_val_t) noexcept { std::free(p); }
+void operator delete(void *p, size_t, std::align_val_t) noexcept {
+    std::free(p);
+}
+
+// ==== Null sink ====
+// One per viewer, on its own cache line: sender threads never share them
+struct alignas(64) SinkStats {
+    std::atomic<uint64_t> packets{0};
+    std::atomic<uint64_t> bytes{0};
+    std::atomic<uint64_t> frames{0}; // RTP marker bit: last packet of a frame
+    std::unique_ptr<UdpEgress> egress; // --udp, one socket per viewer
+    // Timeline of frame ends, sender thread: RTP clock vs arrival
+    bool timed = false;
+    uint32_t last_ts = 0;
+    int64_t rtp_ticks = 0; // unwrapped, first frame to last
+    std::chrono::steady_clock::time_point first_at, last_at;
+
+    // RTP timestamp elapsed minus wall time elapsed, ms
+    double driftMs() const {
+        if (!timed)
+            return 0;
+        return rtp_ticks / 90.0 -
+               std::chrono::duration<double, std::milli>(last_at - first_at)
+                   .count();
+    }
+};
+
+static double cpuSeconds() {
+    rusage ru{};
+    getrusage(RUSAGE_SELF, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_stime.tv_sec +
+           (ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) / 1e6;
+}
+
+// Video frames in one pass over the file
+static uint64_t countFrames(const std::string &path) {
+    AVFormatContext *fmt = nullptr;
+    if (avformat_open_input(&fmt, path.c_str(), nullptr, nullptr) < 0)
+        return 0;
+    uint64_t frames = 0;
+    if (avformat_find_stream_info(fmt, nullptr) >= 0) {
+        int video = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                        nullptr, 0);
+        AVPacket *pkt = av_packet_alloc();
+        while (video >= 0 && av_read_frame(fmt, pkt) >= 0) {
+            if (pkt->stream_index == video)
+                frames++;
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+    }
+    avformat_close_input(&fmt);
+    return frames;
+}
+
+// ==== NAL scan microbenchmark ====
+// RTSPReader::parseAnnexB before the NAL scanner: byte by byte, 3- and
+// 4-byte start codes tested at every position
+static size_t bytewiseNals(const uint8_t *data, size_t size) {
+    size_t count = 0, i = 0;
+    while (i < size) {
+        size_t sc_len = 0;
+        if (i + 3 <= size && data[i] == 0 && data[i + 1] == 0 &&
+            data[i + 2] == 1) {
+            sc_len = 3;
+        } else if (i + 4 <= size && data[i] == 0 && data[i + 1] == 0 &&
+                   data[i + 2] == 0 && data[i + 3] == 1) {
+            sc_len = 4;
+        } else {
+            i++;
+            continue;
+        }
+        size_t nal_start = i + sc_len;
+        size_t nal_end = size;
+        for (size_t j = nal_start + 1; j + 2 < size; j++) {
+            if (data[j] == 0 && data[j + 1] == 0 &&
+                (data[j + 2] == 1 ||
+                 (j + 3 < size && data[j + 2] == 0 && data[j + 3] == 1))) {
+                nal_end = j;
+                break;
+            }
+        }
+        if (nal_end > nal_start)
+            count++;
+        i = nal_end;
+    }
+    return count;
+}
+
+static int nalScanBench(const std::string &path, int passes) {
+    std::vector<std::vector<uint8_t>> frames;
+    bool hevc = false;
+    AVFormatContext *fmt = nullptr;
+    if (avformat_open_input(&fmt, path.c_str(), nullptr, nullptr) < 0)
+        return 1;
+    if (avformat_find_stream_info(fmt, nullptr) >= 0) {
+        int video = av_find_best_stream(fmt, AVMEDIA_TYPE_VIDEO, -1, -1,
+                                        nullptr, 0);
+        if (video >= 0)
+            hevc = fmt->streams[video]->codecpar->codec_id == AV_CODEC_ID_HEVC;
+        AVPacket *pkt = av_packet_alloc();
+        while (video >= 0 && av_read_frame(fmt, pkt) >= 0) {
+            if (pkt->stream_index == video)
+                frames.emplace_back(pkt->data, pkt->data + pkt->size);
+            av_packet_unref(pkt);
+        }
+        av_packet_free(&pkt);
+    }
+    avformat_close_input(&fmt);
+    size_t total = 0, largest = 0;
+    for (const auto &f : frames) {
+        total += f.size();
+        largest = std::max(largest, f.size());
+    }
+    if (total == 0) {
+        std::cerr << "No video frames in " << path << "\n";
+        return 1;
+    }
+    std::cerr << path << ": " << frames.size() << " frames, " << total
+              << " bytes (largest " << largest << "), " << passes
+              << " passes, default kernel " << nalKernelName(nalKernel())
+              << "\n";
+
+    // MB/s over every frame; nals must match across kernels
+    auto time = [&](const char *name, auto &&scan) {
+        size_t nals = 0;
+        auto start = std::chrono::steady_clock::now();
+        for (int p = 0; p < passes; p++)
+            for (const auto &f : frames)
+                nals += scan(f);
+        double secs = std::chrono::duration<double>(
+                          std::chrono::steady_clock::now() - start)
+                          .count();
+        printf("%10s %12.1f %12.1f %12zu\n", name,
+               secs > 0 ? total * passes / secs / 1e6 : 0,
+               secs * 1e6 / (frames.size() * passes), nals / passes);
+    };
+    printf("%10s %12s %12s %12s\n", "kernel", "MB/s", "us/frame", "nals");
+    time("bytewise", [](const std::vector<uint8_t> &f) {
+        return bytewiseNals(f.data(), f.size());
+    });
+    NalKernel saved = nalKernel();
+    NalList nals;
+    for (NalKernel k : {NalKernel::Scalar, NalKernel::Sse2, NalKernel::Avx2}) {
+        if (!setNalKernel(k))
+            continue;
+        time(nalKernelName(k), [&](const std::vector<uint8_t> &f) {
+            nals.clear();
+            scanNals(f.data(), f.size(), hevc, nals);
+            return nals.size();
+        });
+    }
+    setNalKernel(saved);
+    return 0;
+}
+
+struct Result {
+    size_t viewers = 0;
+    double wall = 0;       // s, first session attached → last packet out
+    double cpu = 0;        // s, process user + system
+    uint64_t allocs = 0;
+    uint64_t sent_frames = 0; // summed over viewers
+    uint64_t packets = 0;
+    uint64_t bytes = 0;
+    uint64_t syscalls = 0; // --udp only
+    double drift_ms = 0;   // viewer 0, see ts_drift_ms
+    bool drift_timed = false; // viewer 0 received frames
+};
+
+static Result run(const std::string &path, size_t viewers, int loops,
+                  bool realtime, const TranscoderOptions &transcode,
+                  const RelayEndpoint *udp, size_t hevc_viewers) {
+    Result r;
+    r.viewers = viewers;
+    std::vector<SinkStats> sinks(viewers);
+    if (udp) {
+        for (auto &s : sinks)
+            s.egress = std::make_unique<UdpEgress>(udp->host, udp->port);
+    }
+    {
+        StreamManager manager;
+        PacerOptions pacing;
+        pacing.realtime = realtime;
+        manager.setPacing(1, pacing);
+        manager.setTranscodeDefaults(transcode);
+        manager.setInputLoops(loops);
+
+        // Sessions are built up front so attaching them is quick
+        std::vector<std::shared_ptr<WebRTCSession>> sessions;
+        for (size_t i = 0; i < viewers; i++) {
+            auto session = std::make_shared<WebRTCSession>();
+            SinkStats *stats = &sinks[i];
+            session->setSink([stats](const PacketBatch &batch) {
+                size_t sent = stats->egress ? stats->egress->send(batch)
+                                            : batch.count();
+                stats->packets.fetch_add(sent, std::memory_order_relaxed);
+                stats->bytes.fetch_add(batch.bytes(),
+                                       std::memory_order_relaxed);
+                for (size_t i = 0; i < sent; i++) {
+                    if (batch.size(i) < 12 || !(batch.data(i)[1] & 0x80))
+                        continue;
+                    stats->frames.fetch_add(1, std::memory_order_relaxed);
+                    const uint8_t *h = batch.data(i);
+                    uint32_t ts = uint32_t(h[4]) << 24 | uint32_t(h[5]) << 16 |
+                                  uint32_t(h[6]) << 8 | h[7];
+                    auto now = std::chrono::steady_clock::now();
+                    if (!stats->timed) {
+                        stats->timed = true;
+                        stats->first_at = now;
+                    } else {
+                        stats->rtp_ticks +=
+                            static_cast<int32_t>(ts - stats->last_ts);
+                    }
+                    stats->last_ts = ts;
+                    stats->last_at = now;
+                }
+                return sent;
+            }, i < hevc_viewers);
+            sessions.push_back(std::move(session));
+        }
+
+        uint64_t allocs0 = g_allocs.load();
+        double cpu0 = cpuSeconds();
+        auto start = std::chrono::steady_clock::now();
+        for (const auto &session : sessions)
+            manager.attachSession(path, session);
+
+        // Done once the reader hit EOF and the senders went quiet
+        auto last_change = std::chrono::steady_clock::now();
+        uint64_t last_packets = 0;
+        for (;;) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(20));
+            uint64_t packets = 0;
+            for (const auto &s : sinks)
+                packets += s.packets.load(std::memory_order_relaxed);
+            auto now = std::chrono::steady_clock::now();
+            if (packets != last_packets) {
+                last_packets = packets;
+                last_change = now;
+            } else if (!manager.sourceRunning(path) &&
+                       now - last_change > std::chrono::milliseconds(300)) {
+                break;
+            }
+        }
+        r.wall = std::chrono::duration<double>(last_change - start).count();
+        r.cpu = cpuSeconds() - cpu0;
+        r.allocs = g_allocs.load() - allocs0;
+    }
+    for (const auto &s : sinks) {
+        r.sent_frames += s.frames.load();
+        r.packets += s.packets.load();
+        r.bytes += s.bytes.load();
+        if (s.egress)
+            r.syscalls += s.egress->syscalls();
+    }
+    if (!sinks.empty()) {
+        r.drift_ms = sinks[0].driftMs();
+        r.drift_timed = sinks[0].timed;
+    }
+    return r;
+}
+
+int main(int argc, char *argv[]) {
+    std::string path;
+    std::map<std::string, std::string> opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) == 0) {
+            size_t eq = arg.find('=');
+            opts[arg.substr(2, eq == std::string::npos ? eq : eq - 2)] =
+                eq == std::string::npos ? "1" : arg.substr(eq + 1);
+        } else {
+            path = arg;
+        }
+    }
+    auto opt = [&opts](const std::string &name, const std::string &def) {
+        auto it = opts.find(name);
+        return it == opts.end() ? def : it->second;
+    };
+    if (path.empty()) {
+        std::cerr << "Usage: " << argv[0]
+                  << " <file.h264|file.h265|file.ts> [--viewers=1,10,100,1000]"
+                     " [--loops=N] [--realtime] [--ladder=...]"
+                     " [--trace-sample=N] [--udp=host:port]"
+                     " [--hevc-viewers=N] [--max-drift-ms=N]"
+                     " [--nal-scan[=passes]]\n";
+        return 1;
+    }
+    if (opts.count("nal-scan")) {
+        int passes = std::stoi(opt("nal-scan", "1"));
+        return nalScanBench(path, passes > 1 ? passes : 20);
+    }
+
+    std::vector<size_t> viewer_counts;
+    std::stringstream list(opt("viewers", "1,10,100,1000"));
+    for (std::string item; std::getline(list, item, ',');)
+        viewer_counts.push_back(std::stoul(item));
+    int loops = std::stoi(opt("loops", "0"));
+    bool realtime = opt("realtime", "0") != "0";
+    // Negative: no drift check
+    double max_drift_ms = std::stod(opt("max-drift-ms", "-1"));
+    if (max_drift_ms >= 0)
+        realtime = true; // drift only means something on the PTS schedule
+    TranscoderOptions transcode;
+    transcode.ladder = parseLadder(opt("ladder", "0"));
+    Tracer::global().setSampleEvery(std::stoul(opt("trace-sample", "0")));
+    size_t hevc_viewers = std::stoul(opt("hevc-viewers", "0"));
+    RelayEndpoint udp;
+    std::string udp_spec = opt("udp", "");
+    if (!udp_spec.empty() && !RelayEndpoint::parse(udp_spec, udp)) {
+        std::cerr << "Invalid --udp=" << udp_spec << "\n";
+        return 1;
+    }
+
+    uint64_t per_pass = countFrames(path);
+    if (per_pass == 0) {
+        std::cerr << "No video frames in " << path << "\n";
+        return 1;
+    }
+    uint64_t input_frames = per_pass * static_cast<uint64_t>(loops + 1);
+    std::cerr << path << ": " << per_pass << " frames x " << (loops + 1)
+              << " pass(es), " << (realtime ? "real time" : "unpaced")
+              << "\n";
+
+    // The pipeline logs per frame from many threads; keep the report
+    // readable. A bufferless streambuf has no state to race on.
+    struct NullBuf : std::streambuf {
+        int overflow(int c) override { return c; }
+    } null_buf;
+    auto *saved = std::cout.rdbuf(&null_buf);
+    std::vector<Result> results;
+    for (size_t n : viewer_counts)
+        results.push_back(run(path, n, loops, realtime, transcode,
+                              udp_spec.empty() ? nullptr : &udp,
+                              hevc_viewers));
+    std::cout.rdbuf(saved);
+
+    // fps: input frames through the pipeline per second. cpu µs/frame:
+    // process CPU per input frame, its growth with viewers is the fan-out
+    // cost. CPU/viewer: share of one core per viewer
+    // at the source's 30 fps. delivered: frames that reached the sinks
+    // (viewers join a few ms apart and start on a keyframe; unpaced runs
+    // also drop when senders fall behind). pkts/v-frm is what per-packet
+    // sends would cost in syscalls; sys/v-frm is what --udp egress took.
+    printf("%8s %10s %10s %14s %14s %14s %12s %10s %10s %10s %12s\n",
+           "viewers", "fps", "Mbit/s", "cpu_us/frm", "allocs/frm",
+           "allocs/v-frm", "cpu%/viewer", "delivered", "pkts/v-frm",
+           "sys/v-frm", "ts_drift_ms");
+    for (const auto &r : results) {
+        double fps = r.wall > 0 ? input_frames / r.wall : 0;
+        double vf = static_cast<double>(r.sent_frames);
+        double cpu_us_per_vframe = vf > 0 ? r.cpu * 1e6 / vf : 0;
+        char drift[32] = "-";
+        if (realtime)
+            snprintf(drift, sizeof(drift), "%.1f", r.drift_ms);
+        printf("%8zu %10.1f %10.1f %14.1f %14.1f %14.2f %12.3f %9.1f%% "
+               "%10.1f %10.2f %12s\n",
+               r.viewers, fps,
+               r.wall > 0 ? r.bytes * 8 / r.wall / 1e6 : 0,
+               r.cpu * 1e6 / input_frames,
+               static_cast<double>(r.allocs) / input_frames,
+               vf > 0 ? r.allocs / vf : 0, cpu_us_per_vframe * 30 / 1e4,
+               100.0 * vf / (input_frames * r.viewers),
+               vf > 0 ? r.packets / vf : 0, vf > 0 ? r.syscalls / vf : 0,
+               drift);
+    }
+    if (Tracer::global().sampleEvery() > 0)
+        std::cout << Tracer::global().stageSummary() << "\n";
+
+    int status = 0;
+    if (max_drift_ms >= 0) {
+        for (const auto &r : results) {
+            if (r.drift_timed && std::abs(r.drift_ms) <= max_drift_ms)
+                continue;
+            std::cerr << "FAIL: " << r.viewers << " viewer(s): ";
+            if (r.drift_timed)
+                std::cerr << "ts_drift_ms " << r.drift_ms << " exceeds "
+                          << max_drift_ms << "\n";
+            else
+                std::cerr << "no frames delivered to measure drift\n";
+            status = 1;
+        }
+        if (status == 0)
+            std::cerr << "Drift within " << max_drift_ms << " ms\n";
+    }
+    return status;
+}
@@ -0,0 +1,188 @@
+#include "audio_transcoder.h"
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+
+extern "C" {
+#include <libavutil/channel_layout.h>
+}
+
+// G.711: 8kHz mono, 20 ms per RTP packet (the WebRTC default ptime)
+static constexpr int kSampleRate = 8000;
+static constexpr int kFrameSamples = 160;
+static constexpr int64_t kTicksPerSecond = 90000;
+static constexpr int64_t kFrameTicks =
+    kFrameSamples * kTicksPerSecond / kSampleRate; // 1800
+// Input further than this from where the output timeline expects it
+// (loss, reconnect, a loop of a file) restarts the timeline there
+static constexpr int64_t kMaxSkew = kTicksPerSecond / 10;
+
+AudioTranscoder::AudioTranscoder(AVCodecID target, const std::string &source)
+    : target_(target) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{{"source", source}};
+    frames_metric_ = registry.counter("audio_transcode_frames_total",
+                                      "G.711 frames produced from the "
+                                      "camera's audio",
+                                      labels);
+    errors_metric_ = registry.counter(
+        "audio_transcode_errors_total",
+        "Audio frames that failed to decode or encode", labels);
+    pkt_ = av_packet_alloc();
+    decoded_ = av_frame_alloc();
+    pcm_ = av_frame_alloc();
+}
+
+AudioTranscoder::~AudioTranscoder() {
+    if (dec_ctx_)
+        avcodec_free_context(&dec_ctx_);
+    if (enc_ctx_)
+        avcodec_free_context(&enc_ctx_);
+    if (swr_)
+        swr_free(&swr_);
+    av_packet_free(&pkt_);
+    av_frame_free(&decoded_);
+    av_frame_free(&pcm_);
+}
+
+bool AudioTranscoder::init(const AudioInfo &input) {
+    const AVCodec *decoder = avcodec_find_decoder(input.codec_id);
+    const AVCodec *encoder = avcodec_find_encoder(target_);
+    if (!decoder || !encoder) {
+        std::cerr << "[AudioTranscoder] No "
+                  << (decoder ? "encoder" : "decoder") << " for "
+                  << avcodec_get_name(decoder ? target_ : input.codec_id)
+                  << "\n";
+        return false;
+    }
+
+    dec_ctx_ = avcodec_alloc_context3(decoder);
+    dec_ctx_->sample_rate = input.sample_rate;
+    if (input.channels > 0)
+        av_channel_layout_default(&dec_ctx_->ch_layout, input.channels);
+    if (!input.extradata.empty()) {
+        dec_ctx_->extradata = static_cast<uint8_t *>(av_mallocz(
+            input.extradata.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+        memcpy(dec_ctx_->extradata, input.extradata.data(),
+               input.extradata.size());
+        dec_ctx_->extradata_size = static_cast<int>(input.extradata.size());
+    }
+    dec_ctx_->pkt_timebase = {1, static_cast<int>(kTicksPerSecond)};
+    if (avcodec_open2(dec_ctx_, decoder, nullptr) < 0) {
+        std::cerr << "[AudioTranscoder] Failed to open "
+                  << avcodec_get_name(input.codec_id) << " decoder\n";
+        return false;
+    }
+
+    enc_ctx_ = avcodec_alloc_context3(encoder);
+    enc_ctx_->sample_fmt = AV_SAMPLE_FMT_S16;
+    enc_ctx_->sample_rate = kSampleRate;
+    av_channel_layout_default(&enc_ctx_->ch_layout, 1);
+    enc_ctx_->time_base = {1, kSampleRate};
+    if (avcodec_open2(enc_ctx_, encoder, nullptr) < 0) {
+        std::cerr << "[AudioTranscoder] Failed to open "
+                  << avcodec_get_name(target_) << " encoder\n";
+        return false;
+    }
+
+    pcm_->format = AV_SAMPLE_FMT_S16;
+    pcm_->sample_rate = kSampleRate;
+    pcm_->nb_samples = kFrameSamples;
+    av_channel_layout_default(&pcm_->ch_layout, 1);
+    if (av_frame_get_buffer(pcm_, 0) < 0)
+        return false;
+
+    input_ = input.codec_id;
+    std::cout << "[AudioTranscoder] " << avcodec_get_name(input.codec_id)
+              << " " << input.sample_rate << "Hz -> "
+              << avcodec_get_name(target_) << "\n";
+    return true;
+}
+
+// The decoder's output format is only certain once it produced a frame
+bool AudioTranscoder::openResampler(const AVFrame *frame) {
+    AVChannelLayout mono;
+    av_channel_layout_default(&mono, 1);
+    int ret = swr_alloc_set_opts2(
+        &swr_, &mono, AV_SAMPLE_FMT_S16, kSampleRate, &frame->ch_layout,
+        static_cast<AVSampleFormat>(frame->format), frame->sample_rate, 0,
+        nullptr);
+    if (ret < 0 || swr_init(swr_) < 0) {
+        std::cerr << "[AudioTranscoder] Failed to set up resampler\n";
+        swr_free(&swr_);
+        return false;
+    }
+    return true;
+}
+
+void AudioTranscoder::transcode(const FramePtr &frame,
+                                std::vector<FramePtr> &out) {
+    if (!dec_ctx_ || !enc_ctx_ || !frame->toPacket(pkt_))
+        return;
+    pkt_->pts = frame->pts() >= 0 ? frame->pts() : AV_NOPTS_VALUE;
+    int ret = avcodec_send_packet(dec_ctx_, pkt_);
+    av_packet_unref(pkt_);
+    if (ret < 0) {
+        errors_metric_->add();
+        return;
+    }
+
+    while (avcodec_receive_frame(dec_ctx_, decoded_) >= 0) {
+        if (!swr_ && !openResampler(decoded_)) {
+            av_frame_unref(decoded_);
+            return;
+        }
+        int64_t pts = decoded_->best_effort_timestamp;
+        if (pts != AV_NOPTS_VALUE) {
+            int64_t expected =
+                next_pts_ + static_cast<int64_t>(pending_.size()) *
+                                kTicksPerSecond / kSampleRate;
+            if (next_pts_ < 0 || std::llabs(pts - expected) > kMaxSkew) {
+                pending_.clear();
+                next_pts_ = pts;
+            }
+        } else if (next_pts_ < 0) {
+            next_pts_ = 0;
+        }
+
+        int room = swr_get_out_samples(swr_, decoded_->nb_samples);
+        size_t have = pending_.size();
+        pending_.resize(have + static_cast<size_t>(std::max(room, 0)));
+        auto *dst = reinterpret_cast<uint8_t *>(pending_.data() + have);
+        int n = swr_convert(
+            swr_, &dst, room,
+            const_cast<const uint8_t **>(decoded_->extended_data),
+            decoded_->nb_samples);
+        pending_.resize(have + static_cast<size_t>(std::max(n, 0)));
+        av_frame_unref(decoded_);
+    }
+    encodePending(out);
+}
+
+void AudioTranscoder::encodePending(std::vector<FramePtr> &out) {
+    size_t used = 0;
+    while (pending_.size() - used >= kFrameSamples) {
+        if (av_frame_make_writable(pcm_) < 0)
+            break;
+        memcpy(pcm_->data[0], pending_.data() + used,
+               kFrameSamples * sizeof(int16_t));
+        used += kFrameSamples;
+        pcm_->pts = next_pts_ * kSampleRate / kTicksPerSecond;
+        if (avcodec_send_frame(enc_ctx_, pcm_) < 0) {
+            errors_metric_->add();
+        } else {
+            while (avcodec_receive_packet(enc_ctx_, pkt_) >= 0) {
+                if (auto g711 = MediaFrame::fromPacket(pkt_, target_, false,
+                                                       next_pts_)) {
+                    out.push_back(std::move(g711));
+                    frames_metric_->add();
+                }
+                av_packet_unref(pkt_);
+            }
+        }
+        next_pts_ += kFrameTicks;
+    }
+    pending_.erase(pending_.begin(),
+                   pending_.begin() + static_cast<std::ptrdiff_t>(used));
+}
@@ -0,0 +1,52 @@
+#pragma once
+#include "media_frame.h"
+#include "metrics.h"
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+#include <libswresample/swresample.h>
+}
+
+// Audio for viewers that cannot take the camera's codec as is (AAC, or an
+// offer without it): decode → swresample to 8kHz mono → G.711 in 20 ms
+// frames. A few microseconds per frame, so it runs inline on the pacer
+// thread, and only while such a viewer is attached.
+class AudioTranscoder {
+public:
+    // target: AV_CODEC_ID_PCM_MULAW or AV_CODEC_ID_PCM_ALAW.
+    // source: label for the metrics (camera URL without credentials)
+    explicit AudioTranscoder(AVCodecID target, const std::string &source = "");
+    ~AudioTranscoder();
+    AudioTranscoder(const AudioTranscoder &) = delete;
+    AudioTranscoder &operator=(const AudioTranscoder &) = delete;
+
+    bool init(const AudioInfo &input);
+    AVCodecID target() const { return target_; }
+    AVCodecID input() const { return input_; }
+
+    // One input frame (90kHz PTS) → zero or more G.711 frames appended to
+    // out, timed on the same clock. Gaps in the input restart the timeline.
+    void transcode(const FramePtr &frame, std::vector<FramePtr> &out);
+
+private:
+    bool openResampler(const AVFrame *frame);
+    void encodePending(std::vector<FramePtr> &out);
+
+    AVCodecID target_;
+    AVCodecID input_ = AV_CODEC_ID_NONE;
+    AVCodecContext *dec_ctx_ = nullptr;
+    AVCodecContext *enc_ctx_ = nullptr;
+    SwrContext *swr_ = nullptr;
+    AVPacket *pkt_ = nullptr;
+    AVFrame *decoded_ = nullptr;
+    AVFrame *pcm_ = nullptr;       // one output frame, reused
+    std::vector<int16_t> pending_; // resampled, not yet encoded
+    int64_t next_pts_ = -1;        // PTS of pending_'s first sample
+
+    std::shared_ptr<Counter> frames_metric_;
+    std::shared_ptr<Counter> errors_metric_;
+};
@@ -0,0 +1,47 @@
+#pragma once
+#include <algorithm>
+#include <chrono>
+#include <cstddef>
+#include <random>
+
+struct ReconnectOptions {
+    bool enabled = true;
+    std::chrono::milliseconds initial{500};
+    std::chrono::milliseconds max{30000};
+    // Each delay is spread by ±jitter, so sources that lost the same
+    // network do not retry in lockstep
+    double jitter = 0.3;
+    size_t max_attempts = 0; // consecutive failures before giving up, 0: never
+};
+
+// Exponential reconnect delays: initial, 2x, 4x ... up to max, jittered.
+// Not thread-safe; owned by the thread (or loop) doing the reconnecting.
+class Backoff {
+public:
+    explicit Backoff(const ReconnectOptions &options = {})
+        : options_(options), rng_(std::random_device{}()) {}
+
+    // Delay before the next attempt; negative once max_attempts is spent
+    std::chrono::milliseconds next() {
+        if (!options_.enabled || (options_.max_attempts &&
+                                  attempts_ >= options_.max_attempts))
+            return std::chrono::milliseconds(-1);
+        double base = static_cast<double>(options_.initial.count());
+        for (size_t i = 0; i < attempts_ && base < options_.max.count(); i++)
+            base *= 2;
+        base = std::min(base, static_cast<double>(options_.max.count()));
+        attempts_++;
+        std::uniform_real_distribution<double> spread(-options_.jitter,
+                                                      options_.jitter);
+        return std::chrono::milliseconds(
+            static_cast<long long>(std::max(base * (1 + spread(rng_)), 1.0)));
+    }
+    // Connection healthy again (first frame received)
+    void reset() { attempts_ = 0; }
+    size_t attempts() const { return attempts_; }
+
+private:
+    ReconnectOptions options_;
+    size_t attempts_ = 0;
+    std::mt19937 rng_;
+};
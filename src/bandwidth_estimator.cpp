@@ -0,0 +1,27 @@
+#include "bandwidth_estimator.h"
+#include <algorithm>
+
+BandwidthEstimator::BandwidthEstimator(int initial_kbps, int min_kbps,
+                                       int max_kbps)
+    : min_kbps_(min_kbps), max_kbps_(max_kbps), loss_kbps_(initial_kbps) {}
+
+void BandwidthEstimator::onLoss(double fraction_lost, int media_kbps) {
+    loss_ = loss_ * 0.7 + fraction_lost * 0.3;
+    if (fraction_lost > 0.10) {
+        loss_kbps_ *= 1 - 0.5 * fraction_lost;
+    } else if (fraction_lost < 0.02) {
+        double cap = std::max(1.5 * media_kbps, double(min_kbps_));
+        if (loss_kbps_ < cap)
+            loss_kbps_ = std::min(loss_kbps_ * 1.08, cap);
+    }
+    loss_kbps_ = std::clamp(loss_kbps_, double(min_kbps_), double(max_kbps_));
+}
+
+void BandwidthEstimator::onRemb(int kbps) { remb_kbps_ = kbps; }
+
+int BandwidthEstimator::estimateKbps() const {
+    int loss_based = static_cast<int>(loss_kbps_);
+    if (remb_kbps_ <= 0)
+        return loss_based;
+    return std::max(min_kbps_, std::min(loss_based, remb_kbps_));
+}
@@ -0,0 +1,26 @@
+#pragma once
+#include <cstdint>
+
+// Per-viewer send-side estimate in the spirit of GCC's loss-based
+// controller: back off under heavy loss, probe up slowly when clean, and
+// never exceed the receiver's own REMB. Not thread-safe.
+class BandwidthEstimator {
+public:
+    BandwidthEstimator(int initial_kbps = 4000, int min_kbps = 100,
+                       int max_kbps = 20000);
+
+    // From a receiver report. media_kbps: what the viewer is actually being
+    // fed; probing stops well above it so an idle estimate cannot run off.
+    void onLoss(double fraction_lost, int media_kbps);
+    void onRemb(int kbps);
+
+    int estimateKbps() const;
+    double loss() const { return loss_; } // smoothed fraction lost
+
+private:
+    int min_kbps_;
+    int max_kbps_;
+    double loss_kbps_;
+    int remb_kbps_ = 0; // 0: no REMB seen
+    double loss_ = 0;
+};
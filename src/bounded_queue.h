@@ -0,0 +1,69 @@
+#pragma once
+#include "buffer_pool.h"
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+
+// Bounded blocking MPMC queue for pipeline stages. push() waits while full
+// (backpressure), tryPush() never does. close() drops whatever is queued
+// and wakes everyone up.
+template <typename T> class BoundedQueue {
+public:
+    explicit BoundedQueue(size_t capacity) : capacity_(capacity) {}
+
+    // Returns false if the queue was closed
+    bool push(T value) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        not_full_.wait(lock,
+                       [this] { return closed_ || items_.size() < capacity_; });
+        if (closed_)
+            return false;
+        items_.push_back(std::move(value));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Returns false when full or closed
+    bool tryPush(T value) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (closed_ || items_.size() >= capacity_)
+            return false;
+        items_.push_back(std::move(value));
+        not_empty_.notify_one();
+        return true;
+    }
+
+    // Waits for an item. Returns false once closed.
+    bool pop(T &out) {
+        std::unique_lock<std::mutex> lock(mtx_);
+        not_empty_.wait(lock, [this] { return closed_ || !items_.empty(); });
+        if (closed_)
+            return false;
+        out = std::move(items_.front());
+        items_.pop_front();
+        not_full_.notify_one();
+        return true;
+    }
+
+    void close() {
+        std::lock_guard<std::mutex> lock(mtx_);
+        closed_ = true;
+        items_.clear();
+        not_full_.notify_all();
+        not_empty_.notify_all();
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mtx_);
+        return items_.size();
+    }
+
+private:
+    const size_t capacity_;
+    std::deque<T, PoolAllocator<T>> items_; // chunks recycled, not malloc'd
+    mutable std::mutex mtx_;
+    std::condition_variable not_full_;
+    std::condition_variable not_empty_;
+    bool closed_ = false;
+};
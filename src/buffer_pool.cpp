@@ -0,0 +1,187 @@
+#include "buffer_pool.h"
+#include <algorithm>
+#include <cstdlib>
+#include <new>
+
+// In front of every block: its size class (kClasses: system allocation)
+struct alignas(16) BlockHeader {
+    uint32_t cls;
+};
+static constexpr size_t kHeader = sizeof(BlockHeader);
+
+// Per thread and class: up to ~1 MB or 64 blocks, at least 2
+static constexpr size_t kCacheBytes = 1 << 20;
+static constexpr size_t kMaxCached = 64;
+// Idle blocks kept in the depot across all classes; beyond that frees go
+// back to the system
+static constexpr size_t kMaxDepotBytes = 64 << 20;
+
+static size_t cacheLimit(size_t cls) {
+    return std::clamp<size_t>(kCacheBytes / BufferPool::classSize(cls), 2,
+                              kMaxCached);
+}
+
+static void *systemAlloc(size_t size) {
+    // aligned_alloc wants a multiple of the alignment
+    void *p = std::aligned_alloc(64, (size + 63) & ~size_t(63));
+    if (!p)
+        throw std::bad_alloc();
+    return p;
+}
+
+struct PoolThreadCache {
+    struct Bin {
+        void *blocks[kMaxCached];
+        size_t count = 0;
+    };
+    std::array<Bin, BufferPool::kClasses> bins;
+
+    ~PoolThreadCache();
+};
+
+// Set once this thread's cache is gone (frames freed during thread or
+// static teardown go straight to the depot). Trivially destructible, so
+// still readable then.
+static thread_local bool t_cache_dead = false;
+static thread_local PoolThreadCache t_cache;
+
+PoolThreadCache::~PoolThreadCache() {
+    t_cache_dead = true;
+    for (size_t cls = 0; cls < bins.size(); cls++) {
+        if (bins[cls].count)
+            BufferPool::global().release(cls, bins[cls].blocks,
+                                         bins[cls].count);
+        bins[cls].count = 0;
+    }
+}
+
+BufferPool &BufferPool::global() {
+    // Never destroyed: frames may still be freed during static teardown
+    static BufferPool *pool = new BufferPool();
+    return *pool;
+}
+
+BufferPool::BufferPool() {
+    auto &registry = MetricsRegistry::global();
+    hits_ = registry.counter("buffer_pool_hits_total",
+                             "Pooled allocations served from a cache", {});
+    misses_ = registry.counter(
+        "buffer_pool_misses_total",
+        "Pooled allocations that went to the system allocator", {});
+    depot_metric_ = registry.gauge("buffer_pool_depot_bytes",
+                                   "Idle bytes in the shared depot", {});
+}
+
+size_t BufferPool::classOf(size_t size) {
+    if (size <= 64)
+        return 0;
+    size_t v = size - 1;
+    size_t bits = 63 - static_cast<size_t>(__builtin_clzll(v));
+    size_t mantissa = (v >> (bits - 2)) & 3;
+    return std::min((bits - 6) * 4 + mantissa + 1, kClasses);
+}
+
+size_t BufferPool::classSize(size_t cls) {
+    return size_t(4 + cls % 4) << (cls / 4 + 4);
+}
+
+void *BufferPool::allocate(size_t size) {
+    size_t cls = classOf(size + kHeader);
+    if (cls >= kClasses) {
+        misses_->add();
+        auto *hdr = new (systemAlloc(size + kHeader)) BlockHeader{kClasses};
+        return hdr + 1;
+    }
+    if (!t_cache_dead) {
+        auto &bin = t_cache.bins[cls];
+        if (bin.count == 0)
+            bin.count = refill(cls, bin.blocks, cacheLimit(cls) / 2);
+        if (bin.count) {
+            hits_->add();
+            return static_cast<BlockHeader *>(bin.blocks[--bin.count]) + 1;
+        }
+    } else {
+        void *block = nullptr;
+        if (refill(cls, &block, 1)) {
+            hits_->add();
+            return static_cast<BlockHeader *>(block) + 1;
+        }
+    }
+    return allocateSlow(cls);
+}
+
+void *BufferPool::allocateSlow(size_t cls) {
+    misses_->add();
+    auto *hdr = new (systemAlloc(classSize(cls)))
+        BlockHeader{static_cast<uint32_t>(cls)};
+    return hdr + 1;
+}
+
+void BufferPool::deallocate(void *p) {
+    if (!p)
+        return;
+    auto *hdr = static_cast<BlockHeader *>(p) - 1;
+    size_t cls = hdr->cls;
+    if (cls >= kClasses) {
+        std::free(hdr);
+        return;
+    }
+    void *block = hdr;
+    if (t_cache_dead) {
+        release(cls, &block, 1);
+        return;
+    }
+    // Full: hand the older half to the depot for the threads allocating
+    auto &bin = t_cache.bins[cls];
+    size_t limit = cacheLimit(cls);
+    if (bin.count >= limit) {
+        size_t half = limit / 2;
+        release(cls, bin.blocks, half);
+        std::move(bin.blocks + half, bin.blocks + bin.count, bin.blocks);
+        bin.count -= half;
+    }
+    bin.blocks[bin.count++] = block;
+}
+
+void BufferPool::release(size_t cls, void **blocks, size_t count) {
+    size_t size = classSize(cls);
+    Depot &depot = depots_[cls];
+    std::lock_guard<std::mutex> lock(depot.mtx);
+    for (size_t i = 0; i < count; i++) {
+        if (depot_bytes_.load(std::memory_order_relaxed) + size >
+            kMaxDepotBytes) {
+            std::free(blocks[i]);
+            continue;
+        }
+        depot.blocks.push_back(blocks[i]);
+        depot_bytes_.fetch_add(size, std::memory_order_relaxed);
+    }
+    depot_metric_->set(
+        static_cast<double>(depot_bytes_.load(std::memory_order_relaxed)));
+}
+
+size_t BufferPool::refill(size_t cls, void **blocks, size_t max) {
+    Depot &depot = depots_[cls];
+    std::lock_guard<std::mutex> lock(depot.mtx);
+    size_t n = std::min(std::max<size_t>(max, 1), depot.blocks.size());
+    std::copy(depot.blocks.end() - n, depot.blocks.end(), blocks);
+    depot.blocks.resize(depot.blocks.size() - n);
+    if (n) {
+        depot_bytes_.fetch_sub(n * classSize(cls), std::memory_order_relaxed);
+        depot_metric_->set(static_cast<double>(
+            depot_bytes_.load(std::memory_order_relaxed)));
+    }
+    return n;
+}
+
+PoolBuffer *PoolBuffer::create(size_t size) {
+    void *p = BufferPool::global().allocate(sizeof(PoolBuffer) + size);
+    return new (p) PoolBuffer(size);
+}
+
+void PoolBuffer::unref() {
+    if (refs_.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        this->~PoolBuffer();
+        BufferPool::global().deallocate(this);
+    }
+}
@@ -0,0 +1,91 @@
+#pragma once
+#include "metrics.h"
+#include <array>
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// Size-class slab pool for the buffers that come and go at frame rate
+// (frame payloads, MediaFrame/RtpFrame objects, RTP packet storage).
+// Each thread keeps a small cache per size class; blocks freed on another
+// thread (reader allocates, sender frees) land in that thread's cache and
+// flow back through a shared depot in batches, so steady streaming never
+// reaches malloc. Classes are 4 per power of two from 64 B to 4 MB (at
+// most 25% slack); larger requests go straight to the system.
+class BufferPool {
+public:
+    static BufferPool &global();
+
+    // At least `size` bytes, 16-byte aligned. Any thread may free it.
+    void *allocate(size_t size);
+    void deallocate(void *p);
+
+    static constexpr size_t kClasses = 65;
+    static size_t classOf(size_t size);
+    static size_t classSize(size_t cls);
+
+private:
+    friend struct PoolThreadCache;
+    BufferPool();
+
+    void *allocateSlow(size_t cls);
+    // Thread cache ↔ depot, in batches
+    void release(size_t cls, void **blocks, size_t count);
+    size_t refill(size_t cls, void **blocks, size_t max);
+
+    struct Depot {
+        std::mutex mtx;
+        std::vector<void *> blocks;
+    };
+    std::array<Depot, kClasses> depots_;
+    std::atomic<size_t> depot_bytes_{0};
+
+    std::shared_ptr<Counter> hits_;
+    std::shared_ptr<Counter> misses_;
+    std::shared_ptr<Gauge> depot_metric_;
+};
+
+// std allocator over the pool (containers, shared_ptr control blocks)
+template <typename T> struct PoolAllocator {
+    using value_type = T;
+
+    PoolAllocator() = default;
+    template <typename U> PoolAllocator(const PoolAllocator<U> &) {}
+
+    T *allocate(size_t n) {
+        return static_cast<T *>(BufferPool::global().allocate(n * sizeof(T)));
+    }
+    void deallocate(T *p, size_t) { BufferPool::global().deallocate(p); }
+
+    template <typename U> bool operator==(const PoolAllocator<U> &) const {
+        return true;
+    }
+    template <typename U> bool operator!=(const PoolAllocator<U> &) const {
+        return false;
+    }
+};
+
+// Refcounted pooled bytes: payload of the frames this process builds
+// itself (depacketized, relayed, SPS/PPS-prefixed keyframes)
+class alignas(16) PoolBuffer {
+public:
+    static PoolBuffer *create(size_t size);
+
+    PoolBuffer *ref() {
+        refs_.fetch_add(1, std::memory_order_relaxed);
+        return this;
+    }
+    void unref();
+
+    uint8_t *data() { return reinterpret_cast<uint8_t *>(this + 1); }
+    size_t size() const { return size_; }
+
+private:
+    explicit PoolBuffer(size_t size) : size_(size) {}
+
+    std::atomic<uint32_t> refs_{1};
+    size_t size_;
+};
@@ -0,0 +1,149 @@
+#include "egress.h"
+#include <cerrno>
+#include <cstring>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+
+// Kernel limits for one GSO send (UDP_MAX_SEGMENTS is 64 before 5.x, the
+// payload must fit one IP datagram)
+static constexpr size_t kMaxSegments = 64;
+static constexpr size_t kMaxGsoBytes = 65000;
+// UIO_MAXIOV: messages per sendmmsg
+static constexpr size_t kMaxMessages = 1024;
+static constexpr size_t kControlSize = CMSG_SPACE(sizeof(uint16_t));
+
+uint8_t *PacketBatch::append(const void *data, size_t size) {
+    size_t offset = buf_.size();
+    buf_.resize(offset + size);
+    memcpy(buf_.data() + offset, data, size);
+    spans_.emplace_back(offset, size);
+    return buf_.data() + offset;
+}
+
+UdpEgress::UdpEgress(const std::string &host, uint16_t port) {
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    std::string service = std::to_string(port);
+    if (getaddrinfo(host.c_str(), service.c_str(), &hints, &res) != 0 ||
+        !res) {
+        std::cerr << "[Egress] Cannot resolve " << host << "\n";
+        return;
+    }
+    // Unconnected: ICMP errors from an absent receiver are not reported
+    // back as failed sends
+    fd_ = socket(res->ai_family, SOCK_DGRAM | SOCK_CLOEXEC, 0);
+    memcpy(&addr_, res->ai_addr, res->ai_addrlen);
+    addr_len_ = res->ai_addrlen;
+    freeaddrinfo(res);
+    if (fd_ < 0)
+        std::cerr << "[Egress] socket: " << strerror(errno) << "\n";
+}
+
+UdpEgress::~UdpEgress() {
+    if (fd_ >= 0)
+        close(fd_);
+}
+
+size_t UdpEgress::sendEach(const PacketBatch &batch, size_t from) {
+    size_t sent = 0;
+    for (size_t i = from; i < batch.count(); i++) {
+        syscalls_++;
+        if (sendto(fd_, batch.data(i), batch.size(i), MSG_NOSIGNAL,
+                   reinterpret_cast<const sockaddr *>(&addr_),
+                   addr_len_) >= 0)
+            sent++;
+    }
+    return sent;
+}
+
+size_t UdpEgress::send(const PacketBatch &batch) {
+    if (fd_ < 0)
+        return 0;
+    size_t sent = 0;
+    size_t next = 0; // first packet not yet handed to the kernel
+    while (next < batch.count()) {
+        if (!mmsg_)
+            return sent + sendEach(batch, next);
+
+        // Packets are contiguous in the batch, so a run of equal sizes
+        // (optionally ending in one shorter packet) is a single iovec
+        datagrams_.clear();
+        for (size_t i = next; i < batch.count() &&
+                              datagrams_.size() < kMaxMessages;) {
+            size_t seg = batch.size(i), j = i + 1, bytes = seg;
+            if (gso_) {
+                while (j < batch.count() && batch.size(j) == seg &&
+                       j - i < kMaxSegments && bytes + seg <= kMaxGsoBytes) {
+                    bytes += seg;
+                    j++;
+                }
+                if (j < batch.count() && batch.size(j) < seg &&
+                    j - i < kMaxSegments &&
+                    bytes + batch.size(j) <= kMaxGsoBytes) {
+                    bytes += batch.size(j);
+                    j++;
+                }
+            }
+            datagrams_.push_back({i, j - i, bytes,
+                                  uint16_t(j - i > 1 ? seg : 0)});
+            i = j;
+        }
+
+        size_t n = datagrams_.size();
+        msgs_.assign(n, mmsghdr{});
+        iovs_.resize(n);
+        control_.assign(n * kControlSize, 0);
+        for (size_t k = 0; k < n; k++) {
+            const auto &d = datagrams_[k];
+            iovs_[k].iov_base = const_cast<uint8_t *>(batch.data(d.first));
+            iovs_[k].iov_len = d.bytes;
+            msghdr &msg = msgs_[k].msg_hdr;
+            msg.msg_name = &addr_;
+            msg.msg_namelen = addr_len_;
+            msg.msg_iov = &iovs_[k];
+            msg.msg_iovlen = 1;
+            if (d.segment) {
+                msg.msg_control = control_.data() + k * kControlSize;
+                msg.msg_controllen = kControlSize;
+                cmsghdr *cm = CMSG_FIRSTHDR(&msg);
+                cm->cmsg_level = SOL_UDP;
+                cm->cmsg_type = UDP_SEGMENT;
+                cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+                memcpy(CMSG_DATA(cm), &d.segment, sizeof(uint16_t));
+            }
+        }
+
+        syscalls_++;
+        int r = sendmmsg(fd_, msgs_.data(), static_cast<unsigned>(n),
+                         MSG_NOSIGNAL);
+        if (r < 0) {
+            if (errno == EINTR)
+                continue;
+            if (gso_ && (errno == EIO || errno == EINVAL ||
+                         errno == ENOPROTOOPT || errno == EOPNOTSUPP)) {
+                std::cerr << "[Egress] UDP GSO unavailable ("
+                          << strerror(errno) << "), sending unsegmented\n";
+                gso_ = false;
+                continue;
+            }
+            if (errno == ENOSYS) {
+                mmsg_ = false;
+                continue;
+            }
+            // Socket buffer full and the like: the rest of the frame is
+            // lost, as it would be on the wire
+            return sent;
+        }
+        if (r == 0)
+            break;
+        for (int k = 0; k < r; k++)
+            sent += datagrams_[k].packets;
+        const auto &last = datagrams_[r - 1];
+        next = last.first + last.packets;
+    }
+    return sent;
+}
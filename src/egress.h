@@ -0,0 +1,70 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <sys/socket.h>
+#include <sys/uio.h>
+
+// One frame's RTP packets for one viewer, back to back in a buffer that is
+// reused frame after frame, so they can leave in a single batched send.
+class PacketBatch {
+public:
+    void clear() {
+        buf_.clear();
+        spans_.clear();
+    }
+    // Copy a packet in; the returned bytes can be rewritten in place until
+    // the next append
+    uint8_t *append(const void *data, size_t size);
+
+    size_t count() const { return spans_.size(); }
+    size_t bytes() const { return buf_.size(); }
+    const uint8_t *data(size_t i) const { return buf_.data() + spans_[i].first; }
+    size_t size(size_t i) const { return spans_[i].second; }
+
+private:
+    std::vector<uint8_t> buf_;
+    std::vector<std::pair<size_t, size_t>> spans_; // offset, size
+};
+
+// Plain UDP egress of whole batches: runs of equal-sized packets go out as
+// one UDP GSO super-datagram (UDP_SEGMENT, the kernel splits them), and all
+// of a batch's datagrams in one sendmmsg. Falls back to sendmmsg without
+// GSO, then to one sendto per packet, where the kernel lacks either.
+// One per sending thread.
+class UdpEgress {
+public:
+    UdpEgress(const std::string &host, uint16_t port);
+    ~UdpEgress();
+    UdpEgress(const UdpEgress &) = delete;
+    UdpEgress &operator=(const UdpEgress &) = delete;
+
+    bool ok() const { return fd_ >= 0; }
+    // Packets handed to the kernel
+    size_t send(const PacketBatch &batch);
+
+    uint64_t syscalls() const { return syscalls_; }
+    bool gso() const { return gso_; }
+
+private:
+    size_t sendEach(const PacketBatch &batch, size_t from);
+
+    int fd_ = -1;
+    sockaddr_storage addr_{};
+    socklen_t addr_len_ = 0;
+    bool gso_ = true;
+    bool mmsg_ = true;
+    uint64_t syscalls_ = 0;
+    // Reused per batch
+    struct Datagram {
+        size_t first, packets, bytes;
+        uint16_t segment; // GSO segment size, 0: single packet
+    };
+    std::vector<Datagram> datagrams_;
+    std::vector<mmsghdr> msgs_;
+    std::vector<iovec> iovs_;
+    std::vector<char> control_;
+};
@@ -0,0 +1,144 @@
+#include "event_loop.h"
+#include <algorithm>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+EventLoop::EventLoop() {
+    epfd_ = epoll_create1(EPOLL_CLOEXEC);
+    wakefd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (epfd_ < 0 || wakefd_ < 0)
+        throw std::runtime_error("EventLoop: epoll/eventfd failed");
+    epoll_event ev{};
+    ev.events = EPOLLIN;
+    ev.data.fd = wakefd_;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, wakefd_, &ev);
+    thread_ = std::thread(&EventLoop::run, this);
+}
+
+EventLoop::~EventLoop() {
+    stop_ = true;
+    uint64_t one = 1;
+    (void)!write(wakefd_, &one, sizeof(one));
+    if (thread_.joinable())
+        thread_.join();
+    close(wakefd_);
+    close(epfd_);
+}
+
+void EventLoop::add(int fd, uint32_t events, IoHandler handler) {
+    handlers_[fd] = std::make_shared<IoHandler>(std::move(handler));
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd_, EPOLL_CTL_ADD, fd, &ev);
+}
+
+void EventLoop::modify(int fd, uint32_t events) {
+    epoll_event ev{};
+    ev.events = events;
+    ev.data.fd = fd;
+    epoll_ctl(epfd_, EPOLL_CTL_MOD, fd, &ev);
+}
+
+void EventLoop::remove(int fd) {
+    epoll_ctl(epfd_, EPOLL_CTL_DEL, fd, nullptr);
+    handlers_.erase(fd);
+}
+
+EventLoop::TimerId EventLoop::addTimer(std::chrono::milliseconds delay,
+                                       Task task) {
+    TimerId id = next_timer_++;
+    auto when = Clock::now() + delay;
+    timers_.emplace(std::make_pair(when, id), std::move(task));
+    timer_index_[id] = when;
+    return id;
+}
+
+void EventLoop::cancelTimer(TimerId id) {
+    auto it = timer_index_.find(id);
+    if (it == timer_index_.end())
+        return;
+    timers_.erase(std::make_pair(it->second, id));
+    timer_index_.erase(it);
+}
+
+void EventLoop::post(Task task) {
+    {
+        std::lock_guard<std::mutex> lock(posted_mtx_);
+        posted_.push_back(std::move(task));
+    }
+    uint64_t one = 1;
+    (void)!write(wakefd_, &one, sizeof(one));
+}
+
+bool EventLoop::inLoopThread() const {
+    return std::this_thread::get_id() == thread_.get_id();
+}
+
+int EventLoop::nextTimeoutMs() {
+    if (timers_.empty())
+        return 1000;
+    // Rounded up: a sub-millisecond wait truncated to 0 would spin
+    auto wait = std::chrono::ceil<std::chrono::milliseconds>(
+                    timers_.begin()->first.first - Clock::now())
+                    .count();
+    return static_cast<int>(std::clamp<long long>(wait, 0, 1000));
+}
+
+void EventLoop::runTimers() {
+    auto now = Clock::now();
+    while (!timers_.empty() && timers_.begin()->first.first <= now) {
+        auto it = timers_.begin();
+        Task task = std::move(it->second);
+        timer_index_.erase(it->first.second);
+        timers_.erase(it);
+        task();
+    }
+}
+
+void EventLoop::run() {
+    epoll_event events[64];
+    while (!stop_) {
+        int n = epoll_wait(epfd_, events, 64, nextTimeoutMs());
+        if (n < 0 && errno != EINTR) {
+            std::cerr << "[EventLoop] epoll_wait: " << strerror(errno) << "\n";
+            break;
+        }
+        for (int i = 0; i < n; i++) {
+            int fd = events[i].data.fd;
+            if (fd == wakefd_) {
+                uint64_t v;
+                (void)!read(wakefd_, &v, sizeof(v));
+                continue;
+            }
+            auto it = handlers_.find(fd);
+            if (it == handlers_.end())
+                continue;
+            auto handler = it->second; // may remove itself
+            (*handler)(events[i].events);
+        }
+
+        std::vector<Task> tasks;
+        {
+            std::lock_guard<std::mutex> lock(posted_mtx_);
+            tasks.swap(posted_);
+        }
+        for (auto &task : tasks)
+            task();
+        runTimers();
+    }
+}
+
+IngestReactor::IngestReactor(size_t threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; i++)
+        loops_.push_back(std::make_unique<EventLoop>());
+    std::cout << "[IngestReactor] " << threads << " I/O threads\n";
+}
+
+EventLoop &IngestReactor::pick() { return *loops_[next_++ % loops_.size()]; }
@@ -0,0 +1,65 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Single-threaded epoll loop with timers. Everything except post() and
+// inLoopThread() must be called on the loop thread.
+class EventLoop {
+public:
+    using IoHandler = std::function<void(uint32_t events)>;
+    using Task = std::function<void()>;
+    using TimerId = uint64_t;
+
+    EventLoop();
+    ~EventLoop();
+
+    void add(int fd, uint32_t events, IoHandler handler);
+    void modify(int fd, uint32_t events);
+    void remove(int fd);
+
+    TimerId addTimer(std::chrono::milliseconds delay, Task task);
+    void cancelTimer(TimerId id);
+
+    // Run task on the loop thread (any thread)
+    void post(Task task);
+    bool inLoopThread() const;
+
+private:
+    void run();
+    int nextTimeoutMs();
+    void runTimers();
+
+    int epfd_ = -1;
+    int wakefd_ = -1;
+    std::atomic<bool> stop_{false};
+    std::unordered_map<int, std::shared_ptr<IoHandler>> handlers_;
+
+    using Clock = std::chrono::steady_clock;
+    std::map<std::pair<Clock::time_point, TimerId>, Task> timers_;
+    std::unordered_map<TimerId, Clock::time_point> timer_index_;
+    TimerId next_timer_ = 1;
+
+    std::vector<Task> posted_;
+    std::mutex posted_mtx_;
+    std::thread thread_;
+};
+
+// Fixed pool of event loops shared by all reactor-mode readers, so thread
+// count scales with cores rather than with cameras
+class IngestReactor {
+public:
+    explicit IngestReactor(size_t threads = 0); // 0: one per core
+    EventLoop &pick(); // round-robin
+
+private:
+    std::vector<std::unique_ptr<EventLoop>> loops_;
+    std::atomic<size_t> next_{0};
+};
@@ -0,0 +1,158 @@
+#include "frame_trace.h"
+#include <chrono>
+#include <map>
+#include <nlohmann/json.hpp>
+
+// Ring size by default: ~2 min of one source at one sample per second
+static constexpr size_t kDefaultCapacity = 4096;
+
+// Name of the interval ending at each stage
+static const char *kStageNames[FrameTrace::kStages] = {
+    "receive", "pace",      "decode", "convert",
+    "encode",  "packetize", "queue",  "send"};
+
+static int64_t monotonicUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+FrameTrace::FrameTrace(uint64_t id, std::string source)
+    : id_(id), source_(std::move(source)) {}
+
+void FrameTrace::mark(TraceStage stage) {
+    at_[static_cast<size_t>(stage)] = monotonicUs();
+}
+
+TracePtr FrameTrace::fork(const std::string &lane) const {
+    auto copy = std::make_shared<FrameTrace>(*this);
+    copy->lane_ = lane_.empty() ? lane : lane_ + "/" + lane;
+    return copy;
+}
+
+Tracer &Tracer::global() {
+    static Tracer tracer;
+    return tracer;
+}
+
+Tracer::Tracer() : ring_(kDefaultCapacity) {
+    auto &registry = MetricsRegistry::global();
+    // Receive starts the clock, it has no duration of its own
+    for (size_t i = 1; i < FrameTrace::kStages; i++)
+        stages_[i] = registry.histogram("trace_stage_seconds",
+                                        "Sampled frames: time spent per stage",
+                                        {{"stage", kStageNames[i]}});
+    total_ = registry.histogram("trace_total_seconds",
+                                "Sampled frames: receive to sent", {});
+}
+
+void Tracer::setCapacity(size_t traces) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    ring_.assign(std::max<size_t>(traces, 1), nullptr);
+    next_ = 0;
+}
+
+TracePtr Tracer::sample(const std::string &source, uint64_t seq) {
+    uint32_t every = every_.load(std::memory_order_relaxed);
+    if (every == 0 || seq % every != 0)
+        return nullptr;
+    auto trace = std::make_shared<FrameTrace>(seq, source);
+    trace->mark(TraceStage::Receive);
+    return trace;
+}
+
+void Tracer::record(TracePtr trace) {
+    int64_t prev = trace->at(TraceStage::Receive);
+    for (size_t i = 1; i < FrameTrace::kStages; i++) {
+        int64_t t = trace->at(static_cast<TraceStage>(i));
+        if (t == 0)
+            continue; // stage not on this frame's path (e.g. passthrough)
+        stages_[i]->record(static_cast<uint64_t>(std::max<int64_t>(t - prev, 0)));
+        prev = t;
+    }
+    int64_t sent = trace->at(TraceStage::Sent);
+    if (sent > 0)
+        total_->record(static_cast<uint64_t>(
+            std::max<int64_t>(sent - trace->at(TraceStage::Receive), 0)));
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    ring_[next_++ % ring_.size()] = std::move(trace);
+}
+
+std::string Tracer::chromeTrace() {
+    std::vector<TracePtr> traces;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        for (const auto &t : ring_)
+            if (t)
+                traces.push_back(t);
+    }
+
+    nlohmann::json events = nlohmann::json::array();
+    std::map<std::string, int> pids;                   // source → pid
+    std::map<std::pair<int, std::string>, int> tids;   // lane → tid
+    for (const auto &trace : traces) {
+        auto pid_it = pids.find(trace->source());
+        if (pid_it == pids.end()) {
+            pid_it = pids.emplace(trace->source(), int(pids.size()) + 1).first;
+            events.push_back({{"ph", "M"},
+                              {"name", "process_name"},
+                              {"pid", pid_it->second},
+                              {"args", {{"name", trace->source()}}}});
+        }
+        int pid = pid_it->second;
+        auto tid_it = tids.find({pid, trace->lane()});
+        if (tid_it == tids.end()) {
+            tid_it = tids.emplace(std::make_pair(pid, trace->lane()),
+                                  int(tids.size()) + 1)
+                         .first;
+            events.push_back({{"ph", "M"},
+                              {"name", "thread_name"},
+                              {"pid", pid},
+                              {"tid", tid_it->second},
+                              {"args", {{"name", trace->lane()}}}});
+        }
+
+        int64_t prev = trace->at(TraceStage::Receive);
+        for (size_t i = 1; i < FrameTrace::kStages; i++) {
+            int64_t t = trace->at(static_cast<TraceStage>(i));
+            if (t == 0)
+                continue;
+            events.push_back({{"ph", "X"},
+                              {"name", kStageNames[i]},
+                              {"pid", pid},
+                              {"tid", tid_it->second},
+                              {"ts", prev},
+                              {"dur", std::max<int64_t>(t - prev, 0)},
+                              {"args", {{"frame", trace->id()}}}});
+            prev = t;
+        }
+    }
+    nlohmann::json out;
+    out["traceEvents"] = std::move(events);
+    out["displayTimeUnit"] = "ms";
+    return out.dump();
+}
+
+std::string Tracer::stageSummary() {
+    auto summarize = [](const Histogram &h) {
+        auto snap = h.snapshot();
+        uint64_t max = 0;
+        for (size_t i = snap.buckets.size(); i-- > 0;) {
+            if (snap.buckets[i]) {
+                max = Histogram::bucketUpper(i);
+                break;
+            }
+        }
+        return nlohmann::json{{"count", snap.count},
+                              {"p50_ms", snap.quantile(0.50) / 1000.0},
+                              {"p90_ms", snap.quantile(0.90) / 1000.0},
+                              {"p99_ms", snap.quantile(0.99) / 1000.0},
+                              {"max_ms", max / 1000.0}};
+    };
+    nlohmann::json out;
+    for (size_t i = 1; i < FrameTrace::kStages; i++)
+        out["stages"][kStageNames[i]] = summarize(*stages_[i]);
+    out["total"] = summarize(*total_);
+    return out.dump(2);
+}
@@ -0,0 +1,86 @@
+#pragma once
+#include "metrics.h"
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+// Pipeline stages an access unit passes, in order. Each stage's duration is
+// the time since the previous stage the frame reached.
+enum class TraceStage : uint8_t {
+    Receive,    // out of the demuxer / RTP depacketizer
+    Paced,      // released by the pacer
+    Decoded,    // HEVC decoder output
+    Converted,  // swscale output
+    Encoded,    // x264 output
+    Packetized, // RTP packets built by the fanout
+    Dequeued,   // picked up by the viewer's sender
+    Sent,       // last packet handed to the track
+    Count
+};
+
+// Monotonic timestamps of one sampled access unit. Stages stamp it in turn
+// (the queues between them order the writes). Where a frame splits into
+// renditions or viewers each branch forks its own copy, so a trace is never
+// written by two threads at once.
+class FrameTrace {
+public:
+    static constexpr size_t kStages = static_cast<size_t>(TraceStage::Count);
+
+    FrameTrace(uint64_t id, std::string source);
+
+    void mark(TraceStage stage);
+    // Copy for one branch: lane names it (rendition, session)
+    std::shared_ptr<FrameTrace> fork(const std::string &lane) const;
+
+    uint64_t id() const { return id_; }
+    const std::string &source() const { return source_; }
+    const std::string &lane() const { return lane_; }
+    int64_t at(TraceStage stage) const {
+        return at_[static_cast<size_t>(stage)];
+    }
+
+private:
+    uint64_t id_;
+    std::string source_;
+    std::string lane_;
+    std::array<int64_t, kStages> at_{}; // µs, steady clock; 0: not reached
+};
+using TracePtr = std::shared_ptr<FrameTrace>;
+
+// Samples every n-th frame of each source for tracing and keeps the last
+// finished traces in a ring. Unsampled frames carry a null trace and cost
+// nothing beyond the check.
+class Tracer {
+public:
+    static Tracer &global();
+
+    void setSampleEvery(uint32_t n) { every_ = n; } // 0: off
+    uint32_t sampleEvery() const { return every_; }
+    void setCapacity(size_t traces);
+
+    // seq: the source's own frame counter. Stamps Receive if sampled.
+    TracePtr sample(const std::string &source, uint64_t seq);
+    // A trace reached the end of the pipeline (sent to one viewer): keep it
+    // and feed the per-stage histograms
+    void record(TracePtr trace);
+
+    // Chrome trace (chrome://tracing, Perfetto): one complete event per
+    // stage, one row per source and lane
+    std::string chromeTrace();
+    // Per-stage count and p50/p90/p99/max in ms since startup
+    std::string stageSummary();
+
+private:
+    Tracer();
+
+    std::atomic<uint32_t> every_{0};
+    std::vector<TracePtr> ring_;
+    size_t next_ = 0;
+    std::mutex mtx_;
+    std::array<std::shared_ptr<Histogram>, FrameTrace::kStages> stages_;
+    std::shared_ptr<Histogram> total_;
+};
@@ -0,0 +1,26 @@
+#include "gop_cache.h"
+
+GopCache::GopCache(size_t max_frames, size_t max_bytes)
+    : max_frames_(max_frames), max_bytes_(max_bytes) {}
+
+void GopCache::push(const RtpFramePtr &frame) {
+    if (frame->is_keyframe)
+        clear();
+    else if (frames_.empty())
+        return; // no keyframe to anchor on yet
+
+    size_t size = frame->bytes;
+
+    // GOP too long to replay: give up until the next keyframe
+    if (frames_.size() >= max_frames_ || bytes_ + size > max_bytes_) {
+        clear();
+        return;
+    }
+    frames_.push_back(frame);
+    bytes_ += size;
+}
+
+void GopCache::clear() {
+    frames_.clear();
+    bytes_ = 0;
+}
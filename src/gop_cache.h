@@ -0,0 +1,25 @@
+#pragma once
+#include "rtp_frame.h"
+#include <cstddef>
+#include <vector>
+
+// Packetized frames from the most recent keyframe onward, so a late joiner
+// can start decoding at once instead of waiting for the next IDR.
+// Not thread-safe; guarded by the owning RtpFanout.
+class GopCache {
+public:
+    explicit GopCache(size_t max_frames = 300, size_t max_bytes = 4 << 20);
+
+    void push(const RtpFramePtr &frame);
+    void clear();
+
+    // Empty until a keyframe has been seen (or after overflow)
+    const std::vector<RtpFramePtr> &frames() const { return frames_; }
+    size_t bytes() const { return bytes_; }
+
+private:
+    size_t max_frames_;
+    size_t max_bytes_;
+    std::vector<RtpFramePtr> frames_;
+    size_t bytes_ = 0;
+};
@@ -1,7 +1,12 @@
 #include "stream_manager.h"
+#include <chrono>
+#include <future>
 #include <httplib.h>
 #include <iostream>
+#include <map>
 #include <nlohmann/json.hpp>
+#include <sstream>
+#include <vector>
 
 // Embed index.html as string
 static const char *INDEX_HTML = R"HTML(
@@ -31,7 +36,7 @@ video { width: 100%; max-width: 800px; background: #000; border-radius: 8px; }
     <button id="play" onclick="startPlay()">Play</button>
     <button id="stop" onclick="stopPlay()" disabled>Stop</button>
 </div>
-<video id="video" autoplay muted playsinline></video>
+<video id="video" autoplay muted playsinline controls></video>
 <div id="status">Ready</div>
 
 <script>
@@ -55,12 +60,20 @@ async function startPlay() {
         });
 
         pc.addTransceiver('video', { direction: 'recvonly' });
+        // Camera audio, if it has any (starts muted: unmute in the controls)
+        pc.addTransceiver('audio', { direction: 'recvonly' });
 
         pc.ontrack = (ev) => {
             console.log('[ontrack] kind=' + ev.track.kind + ' state=' + ev.track.readyState + ' streams=' + ev.streams.length);
-            const stream = ev.streams[0] || new MediaStream([ev.track]);
             const video = document.getElementById('video');
-            video.srcObject = stream;
+            // Audio and video share one stream; set it once
+            if (ev.streams[0]) {
+                if (video.srcObject !== ev.streams[0]) video.srcObject = ev.streams[0];
+            } else if (video.srcObject) {
+                video.srcObject.addTrack(ev.track);
+            } else {
+                video.srcObject = new MediaStream([ev.track]);
+            }
             setStatus('Track received, waiting for frames...');
 
             ev.track.onmute = () => console.log('[track] muted');
@@ -83,17 +96,24 @@ async function startPlay() {
             }
         };
 
+        // Trickle ICE: post local candidates as they are found instead of
+        // waiting for gathering to finish
+        let sessionId = null;
+        const pending = [];
+        const sendCandidate = (c) => fetch('/api/candidate', {
+            method: 'POST',
+            headers: { 'Content-Type': 'application/json' },
+            body: JSON.stringify({ session_id: sessionId, candidate: c.candidate, mid: c.sdpMid })
+        });
+        pc.onicecandidate = (ev) => {
+            if (!ev.candidate || !ev.candidate.candidate) return;
+            if (sessionId) sendCandidate(ev.candidate);
+            else pending.push(ev.candidate);
+        };
+
         const offer = await pc.createOffer();
         await pc.setLocalDescription(offer);
 
-        // Wait for ICE gathering
-        await new Promise((resolve) => {
-            if (pc.iceGatheringState === 'complete') resolve();
-            else pc.onicegatheringstatechange = () => {
-                if (pc.iceGatheringState === 'complete') resolve();
-            };
-        });
-
         console.log('[offer SDP]', pc.localDescription.sdp);
 
         const resp = await fetch('/api/offer', {
@@ -101,13 +121,17 @@ async function startPlay() {
             headers: { 'Content-Type': 'application/json' },
             body: JSON.stringify({
                 rtsp_url: url,
-                sdp: pc.localDescription.sdp
+                sdp: pc.localDescription.sdp,
+                trickle: true
             })
         });
 
         if (!resp.ok) throw new Error('Server error: ' + resp.status);
         const answer = await resp.json();
-        await pc.setRemoteDescription(new RTCSessionDescription(answer));
+        await pc.setRemoteDescription(new RTCSessionDescription({ type: answer.type, sdp: answer.sdp }));
+        sessionId = answer.session_id;
+        pending.splice(0).forEach(sendCandidate);
+        pollCandidates(pc, sessionId);
         setStatus('Connected — checking stats...');
 
         // Periodic stats to check incoming RTP
@@ -126,6 +150,21 @@ async function startPlay() {
     }
 }
 
+// Fetch server candidates until its gathering is complete
+async function pollCandidates(conn, id) {
+    let from = 0;
+    while (pc === conn) {
+        const resp = await fetch('/api/candidates?session_id=' + id + '&from=' + from);
+        if (!resp.ok) return;
+        const res = await resp.json();
+        for (const c of res.candidates)
+            await conn.addIceCandidate({ candidate: c.candidate, sdpMid: c.mid });
+        from += res.candidates.length;
+        if (res.complete) return;
+        await new Promise((r) => setTimeout(r, 100));
+    }
+}
+
 function stopPlay() {
     if (pc) { pc.close(); pc = null; }
     document.getElementById('video').srcObject = null;
@@ -138,13 +177,62 @@ function stopPlay() {
 </html>
 )HTML";
 
+// "frame", "slice" or "auto" (both) → FF_THREAD_* flags
+static int parseThreadType(const std::string &type) {
+    if (type == "frame")
+        return FF_THREAD_FRAME;
+    if (type == "slice")
+        return FF_THREAD_SLICE;
+    return FF_THREAD_FRAME | FF_THREAD_SLICE;
+}
+
+// Per-source "transcode" object of /api/offer, on top of the CLI defaults
+static TranscoderOptions parseTranscodeOptions(const nlohmann::json &j,
+                                               TranscoderOptions options) {
+    options.decode_threads = j.value("decode_threads", options.decode_threads);
+    options.encode_threads = j.value("encode_threads", options.encode_threads);
+    if (j.contains("decode_thread_type"))
+        options.decode_thread_type = parseThreadType(j["decode_thread_type"]);
+    if (j.contains("encode_thread_type"))
+        options.encode_thread_type = parseThreadType(j["encode_thread_type"]);
+    options.queue_depth = j.value("queue_depth", options.queue_depth);
+    options.min_keyframe_interval_ms = j.value(
+        "min_keyframe_interval_ms", options.min_keyframe_interval_ms);
+    if (j.contains("ladder")) {
+        options.ladder.clear();
+        for (const auto &step : j["ladder"])
+            options.ladder.push_back(
+                {step.value("height", 0), step.value("bitrate_kbps", 0)});
+        if (options.ladder.empty())
+            options.ladder.emplace_back();
+    }
+    return options;
+}
+
 int main(int argc, char *argv[]) {
     int port = 8080;
     std::string public_ip;
-    if (argc > 1)
-        port = std::atoi(argv[1]);
-    if (argc > 2)
-        public_ip = argv[2];
+    // Positional: [port] [public_ip]; options: --name=value
+    std::vector<std::string> positional;
+    std::map<std::string, std::string> opts;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg.rfind("--", 0) == 0) {
+            size_t eq = arg.find('=');
+            opts[arg.substr(2, eq == std::string::npos ? eq : eq - 2)] =
+                eq == std::string::npos ? "1" : arg.substr(eq + 1);
+        } else {
+            positional.push_back(arg);
+        }
+    }
+    if (positional.size() > 0)
+        port = std::atoi(positional[0].c_str());
+    if (positional.size() > 1)
+        public_ip = positional[1];
+    auto opt = [&opts](const std::string &name, const std::string &def) {
+        auto it = opts.find(name);
+        return it == opts.end() ? def : it->second;
+    };
 
     std::cout << "rtsp2webrtc starting on port " << port << "\n";
     if (!public_ip.empty())
@@ -153,6 +241,71 @@ int main(int argc, char *argv[]) {
     StreamManager manager;
     if (!public_ip.empty())
         manager.setPublicIP(public_ip);
+    manager.setIcePorts(
+        static_cast<uint16_t>(std::stoul(opt("ice-port", "9000"))),
+        std::stoul(opt("ice-ports", "1")), opt("ice-mux", "1") != "0");
+    // Origin/edge cluster: --relay is this node's relay address, --cluster
+    // every node's (same list on all of them)
+    std::string relay = opt("relay", "");
+    if (!relay.empty()) {
+        RelayEndpoint self;
+        std::vector<RelayEndpoint> nodes;
+        bool ok = RelayEndpoint::parse(relay, self);
+        std::stringstream list(opt("cluster", relay));
+        for (std::string item; ok && std::getline(list, item, ',');) {
+            RelayEndpoint node;
+            ok = RelayEndpoint::parse(item, node);
+            nodes.push_back(node);
+        }
+        if (!ok || !manager.enableCluster(self, nodes)) {
+            std::cerr << "Invalid --relay/--cluster or relay port in use\n";
+            return 1;
+        }
+        std::cout << "Cluster node " << self.str() << " (" << nodes.size()
+                  << " nodes)\n";
+    }
+    // Dropped cameras are reopened after 0.5s, 1s, 2s ... (jittered)
+    ReconnectOptions reconnect;
+    reconnect.enabled = opt("reconnect", "1") != "0";
+    reconnect.initial =
+        std::chrono::milliseconds(std::stol(opt("reconnect-min-ms", "500")));
+    reconnect.max = std::chrono::milliseconds(
+        std::stol(opt("reconnect-max-ms", "30000")));
+    reconnect.max_attempts = std::stoul(opt("reconnect-attempts", "0"));
+    manager.setReconnect(reconnect);
+    // Camera audio to viewers that negotiate it (passthrough or G.711)
+    manager.setAudio(opt("audio", "1") != "0");
+    // Sources nobody watches are stopped after this long
+    manager.setIdleGrace(
+        std::chrono::milliseconds(std::stol(opt("idle-grace-ms", "30000"))));
+    // 0: one FFmpeg thread per camera; N: N shared epoll loops
+    manager.setIngestThreads(std::stoul(opt("ingest-threads", "0")));
+    PacerOptions pacing;
+    pacing.max_lead =
+        std::chrono::milliseconds(std::stol(opt("max-lead-ms", "1000")));
+    pacing.max_lag =
+        std::chrono::milliseconds(std::stol(opt("max-lag-ms", "500")));
+    std::string catch_up = opt("catch-up", "burst");
+    if (catch_up == "rebase")
+        pacing.catch_up = PacerOptions::CatchUp::Rebase;
+    else if (catch_up == "drop")
+        pacing.catch_up = PacerOptions::CatchUp::DropToKeyframe;
+    manager.setPacing(std::stoul(opt("pacer-threads", "0")), pacing);
+    TranscoderOptions transcode;
+    transcode.decode_threads = std::stoi(opt("decode-threads", "0"));
+    transcode.encode_threads = std::stoi(opt("encode-threads", "0"));
+    transcode.decode_thread_type =
+        parseThreadType(opt("decode-thread-type", "auto"));
+    transcode.encode_thread_type =
+        parseThreadType(opt("encode-thread-type", "slice"));
+    transcode.ladder = parseLadder(opt("ladder", "0"));
+    transcode.min_keyframe_interval_ms =
+        std::stoi(opt("min-keyframe-interval-ms", "500"));
+    manager.setTranscodeDefaults(transcode);
+    manager.setTranscodeCores(std::stoul(opt("transcode-cores", "0")));
+    // Latency tracing: every N-th frame of each source, 0 disables
+    Tracer::global().setSampleEvery(std::stoul(opt("trace-sample", "30")));
+    Tracer::global().setCapacity(std::stoul(opt("trace-buffer", "4096")));
     httplib::Server svr;
 
     // Serve web player
@@ -160,21 +313,52 @@ int main(int argc, char *argv[]) {
         res.set_content(INDEX_HTML, "text/html");
     });
 
-    // Signaling endpoint
+    // Signaling endpoint. With "trickle": true the answer is returned at
+    // once and candidates are exchanged via /api/candidate(s), so no worker
+    // thread ever waits on ICE gathering. Legacy clients get the full answer.
     svr.Post("/api/offer",
-             [&manager](const httplib::Request &req, httplib::Response &res) {
+             [&manager, transcode](const httplib::Request &req,
+                                   httplib::Response &res) {
                  try {
                      auto j = nlohmann::json::parse(req.body);
                      std::string rtsp_url = j.at("rtsp_url");
                      std::string sdp = j.at("sdp");
+                     bool trickle = j.value("trickle", false);
+                     // Ladder index to pin, absent or "auto": follow REMB
+                     int rendition = -1;
+                     if (j.contains("rendition") && j["rendition"].is_number())
+                         rendition = j["rendition"];
 
                      std::cout << "[API] Offer for: " << rtsp_url << "\n";
 
-                     std::string answer = manager.createSession(rtsp_url, sdp);
+                     std::string answer;
+                     std::shared_ptr<WebRTCSession> session;
+                     if (j.contains("transcode")) {
+                         auto opts = parseTranscodeOptions(j["transcode"],
+                                                           transcode);
+                         session = manager.createSession(rtsp_url, sdp, answer,
+                                                         &opts, rendition);
+                     } else {
+                         session = manager.createSession(
+                             rtsp_url, sdp, answer, nullptr, rendition);
+                     }
+
+                     if (!trickle) {
+                         auto done = std::make_shared<std::promise<std::string>>();
+                         auto full = done->get_future();
+                         session->onGatheringComplete(
+                             [done](const std::string &sdp) { done->set_value(sdp); });
+                         if (full.wait_for(std::chrono::seconds(10)) ==
+                             std::future_status::timeout)
+                             throw std::runtime_error(
+                                 "Timeout waiting for ICE gathering");
+                         answer = full.get();
+                     }
 
                      nlohmann::json resp;
                      resp["type"] = "answer";
                      resp["sdp"] = answer;
+                     resp["session_id"] = session->id();
                      res.set_content(resp.dump(), "application/json");
                  } catch (const std::exception &e) {
                      nlohmann::json err;
@@ -185,6 +369,108 @@ int main(int argc, char *argv[]) {
                  }
              });
 
+    // Trickle ICE: server candidates gathered so far
+    svr.Get("/api/candidates",
+            [&manager](const httplib::Request &req, httplib::Response &res) {
+                auto session =
+                    manager.findSession(req.get_param_value("session_id"));
+                if (!session) {
+                    res.status = 404;
+                    return;
+                }
+                size_t from = 0;
+                if (req.has_param("from"))
+                    from = std::stoul(req.get_param_value("from"));
+                bool complete = false;
+                nlohmann::json resp;
+                resp["candidates"] = nlohmann::json::array();
+                for (const auto &c : session->localCandidates(from, complete))
+                    resp["candidates"].push_back(
+                        {{"candidate", c.candidate()}, {"mid", c.mid()}});
+                resp["complete"] = complete;
+                res.set_content(resp.dump(), "application/json");
+            });
+
+    // Trickle ICE: browser candidate
+    svr.Post("/api/candidate",
+             [&manager](const httplib::Request &req, httplib::Response &res) {
+                 try {
+                     auto j = nlohmann::json::parse(req.body);
+                     auto session = manager.findSession(j.at("session_id"));
+                     if (!session) {
+                         res.status = 404;
+                         return;
+                     }
+                     session->addRemoteCandidate(j.at("candidate"),
+                                                 j.value("mid", ""));
+                     res.status = 204;
+                 } catch (const std::exception &e) {
+                     nlohmann::json err;
+                     err["error"] = e.what();
+                     res.status = 400;
+                     res.set_content(err.dump(), "application/json");
+                 }
+             });
+
+    // Switch a viewer's rendition: ladder index, or "auto" for REMB
+    svr.Post("/api/rendition",
+             [&manager](const httplib::Request &req, httplib::Response &res) {
+                 try {
+                     auto j = nlohmann::json::parse(req.body);
+                     int rendition = -1;
+                     if (j.at("rendition").is_number())
+                         rendition = j["rendition"];
+                     if (!manager.setRendition(j.at("session_id"), rendition)) {
+                         res.status = 404;
+                         return;
+                     }
+                     res.status = 204;
+                 } catch (const std::exception &e) {
+                     nlohmann::json err;
+                     err["error"] = e.what();
+                     res.status = 400;
+                     res.set_content(err.dump(), "application/json");
+                 }
+             });
+
+    // Sources with their viewers and the memory held for each
+    svr.Get("/api/sources",
+            [&manager](const httplib::Request &, httplib::Response &res) {
+                nlohmann::json resp = nlohmann::json::array();
+                for (const auto &s : manager.sourceStats())
+                    resp.push_back({{"source", s.source},
+                                    {"running", s.running},
+                                    {"viewers", s.viewers},
+                                    {"edges", s.edges},
+                                    {"idle_seconds", s.idle_seconds},
+                                    {"transcoding", s.transcoding},
+                                    {"memory_bytes",
+                                     {{"jitter", s.jitter_bytes},
+                                      {"gop", s.gop_bytes},
+                                      {"transcoder", s.transcoder_bytes},
+                                      {"total", s.totalBytes()}}}});
+                res.set_content(resp.dump(), "application/json");
+            });
+
+    // Prometheus scrape: per-camera ingest/transcode/fan-out and per-viewer
+    // counters, all read without stopping the hot paths
+    svr.Get("/metrics", [](const httplib::Request &, httplib::Response &res) {
+        res.set_content(MetricsRegistry::global().render(),
+                        "text/plain; version=0.0.4");
+    });
+
+    // Sampled frame traces: Chrome trace JSON (chrome://tracing, Perfetto),
+    // or ?format=stages for per-stage percentiles
+    svr.Get("/api/trace", [](const httplib::Request &req,
+                             httplib::Response &res) {
+        if (req.get_param_value("format") == "stages")
+            res.set_content(Tracer::global().stageSummary(),
+                            "application/json");
+        else
+            res.set_content(Tracer::global().chromeTrace(),
+                            "application/json");
+    });
+
     std::cout << "Listening on http://0.0.0.0:" << port << "\n";
     svr.listen("0.0.0.0", port);
     return 0;
@@ -0,0 +1,149 @@
+#include "media_frame.h"
+#include <algorithm>
+#include <cstring>
+
+MediaFrame::~MediaFrame() {
+    av_buffer_unref(&buf_);
+    if (pooled_)
+        pooled_->unref();
+}
+
+std::shared_ptr<MediaFrame>
+MediaFrame::wrap(AVBufferRef *buf, PoolBuffer *pooled, const uint8_t *data,
+                 size_t size, AVCodecID codec_id, bool is_keyframe,
+                 int64_t pts, TracePtr trace) {
+    if (!buf && !pooled)
+        return nullptr;
+    // Control block from the pool too: no malloc per frame
+    std::shared_ptr<MediaFrame> f(new MediaFrame(),
+                                  std::default_delete<MediaFrame>(),
+                                  PoolAllocator<MediaFrame>());
+    f->buf_ = buf;
+    f->pooled_ = pooled;
+    f->data_ = data;
+    f->size_ = size;
+    f->codec_id_ = codec_id;
+    f->is_keyframe_ = is_keyframe;
+    f->pts_ = pts;
+    f->trace_ = std::move(trace);
+    return f;
+}
+
+PoolBuffer *MediaFrame::allocPadded(size_t size) {
+    // Decoders expect zeroed padding past the payload
+    PoolBuffer *buf = PoolBuffer::create(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    memset(buf->data() + size, 0, AV_INPUT_BUFFER_PADDING_SIZE);
+    return buf;
+}
+
+FramePtr MediaFrame::fromPacket(const AVPacket *pkt, AVCodecID codec_id,
+                                bool is_keyframe, int64_t pts) {
+    if (!pkt->buf)
+        return copy(pkt->data, pkt->size, codec_id, is_keyframe, pts);
+    return wrap(av_buffer_ref(pkt->buf), nullptr, pkt->data, pkt->size,
+                codec_id, is_keyframe, pts);
+}
+
+FramePtr MediaFrame::copy(const uint8_t *data, size_t size, AVCodecID codec_id,
+                          bool is_keyframe, int64_t pts) {
+    PoolBuffer *buf = allocPadded(size);
+    memcpy(buf->data(), data, size);
+    return wrap(nullptr, buf, buf->data(), size, codec_id, is_keyframe, pts);
+}
+
+// Both parts start on a start code, so scanning them apart finds the
+// same NAL units as scanning the joined buffer
+static bool startsWithStartCode(const uint8_t *p, size_t size) {
+    size_t i = findStartCode(p, 0, std::min<size_t>(size, 4));
+    return i < size && (i == 0 || (i == 1 && p[0] == 0));
+}
+
+FramePtr MediaFrame::concat(const std::vector<uint8_t> &prefix,
+                            const MediaFrame &frame) {
+    size_t size = prefix.size() + frame.size();
+    PoolBuffer *buf = allocPadded(size);
+    memcpy(buf->data(), prefix.data(), prefix.size());
+    memcpy(buf->data() + prefix.size(), frame.data(), frame.size());
+    auto f = wrap(nullptr, buf, buf->data(), size, frame.codecId(),
+                  frame.isKeyframe(), frame.pts(), frame.trace_);
+    // The frame's index is reused; only the (small) prefix is scanned
+    if (f && frame.nals_ready_.load(std::memory_order_acquire) &&
+        !frame.nals_.empty() &&
+        startsWithStartCode(prefix.data(), prefix.size()) &&
+        startsWithStartCode(frame.data(), frame.size())) {
+        scanNals(prefix.data(), prefix.size(),
+                 frame.codecId() == AV_CODEC_ID_HEVC, f->nals_);
+        frame.shareNals(*f, prefix.size());
+    }
+    return f;
+}
+
+FramePtr MediaFrame::slice(size_t offset, size_t size) const {
+    if (offset > size_ || size > size_ - offset)
+        return nullptr;
+    return wrap(buf_ ? av_buffer_ref(buf_) : nullptr,
+                pooled_ ? pooled_->ref() : nullptr, data_ + offset, size,
+                codec_id_, is_keyframe_, pts_, trace_);
+}
+
+FramePtr MediaFrame::withTrace(TracePtr trace) const {
+    auto f = wrap(buf_ ? av_buffer_ref(buf_) : nullptr,
+                  pooled_ ? pooled_->ref() : nullptr, data_, size_, codec_id_,
+                  is_keyframe_, pts_, std::move(trace));
+    if (f)
+        shareNals(*f);
+    return f;
+}
+
+FramePtr MediaFrame::withPts(int64_t pts) const {
+    auto f = wrap(buf_ ? av_buffer_ref(buf_) : nullptr,
+                  pooled_ ? pooled_->ref() : nullptr, data_, size_, codec_id_,
+                  is_keyframe_, pts, trace_);
+    if (f)
+        shareNals(*f);
+    return f;
+}
+
+const NalList &MediaFrame::nals() const {
+    std::call_once(nals_once_, [this] {
+        if (codec_id_ == AV_CODEC_ID_H264 || codec_id_ == AV_CODEC_ID_HEVC)
+            scanNals(data_, size_, codec_id_ == AV_CODEC_ID_HEVC, nals_);
+        nals_ready_.store(true, std::memory_order_release);
+    });
+    return nals_;
+}
+
+void MediaFrame::shareNals(MediaFrame &to, size_t shift) const {
+    if (!nals_ready_.load(std::memory_order_acquire))
+        return;
+    for (NalUnit nal : nals_) {
+        nal.offset += static_cast<uint32_t>(shift);
+        to.nals_.push_back(nal);
+    }
+    std::call_once(to.nals_once_, [&to] { to.nals_ready_ = true; });
+}
+
+static void releasePooled(void *opaque, uint8_t *) {
+    static_cast<PoolBuffer *>(opaque)->unref();
+}
+
+bool MediaFrame::toPacket(AVPacket *pkt) const {
+    av_packet_unref(pkt);
+    if (buf_) {
+        pkt->buf = av_buffer_ref(buf_);
+    } else {
+        // FFmpeg needs its own buffer type; it shares the pooled bytes
+        pkt->buf = av_buffer_create(pooled_->data(), pooled_->size(),
+                                    releasePooled, pooled_->ref(),
+                                    AV_BUFFER_FLAG_READONLY);
+        if (!pkt->buf)
+            pooled_->unref();
+    }
+    if (!pkt->buf)
+        return false;
+    pkt->data = const_cast<uint8_t *>(data_);
+    pkt->size = static_cast<int>(size_);
+    if (is_keyframe_)
+        pkt->flags |= AV_PKT_FLAG_KEY;
+    return true;
+}
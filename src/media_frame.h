@@ -0,0 +1,101 @@
+#pragma once
+#include "buffer_pool.h"
+#include "frame_trace.h"
+#include "nal_scanner.h"
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+extern "C" {
+#include <libavcodec/avcodec.h>
+}
+
+class MediaFrame;
+using FramePtr = std::shared_ptr<const MediaFrame>;
+
+// Immutable access unit shared by every stage and session of a source.
+// Payload is held through an AVBufferRef (demuxer/encoder packets) or a
+// PoolBuffer (frames built here), so handing a frame on costs a refcount
+// bump instead of a copy. Frames themselves come from the BufferPool.
+class MediaFrame {
+public:
+    ~MediaFrame();
+    MediaFrame(const MediaFrame &) = delete;
+    MediaFrame &operator=(const MediaFrame &) = delete;
+
+    // Take a reference to the packet's buffer (copies only if pkt is not
+    // refcounted)
+    static FramePtr fromPacket(const AVPacket *pkt, AVCodecID codec_id,
+                               bool is_keyframe, int64_t pts);
+    // Copy raw bytes into a new padded (pooled) buffer
+    static FramePtr copy(const uint8_t *data, size_t size, AVCodecID codec_id,
+                         bool is_keyframe, int64_t pts);
+    // prefix + frame payload in a single allocation (e.g. SPS/PPS + IDR)
+    static FramePtr concat(const std::vector<uint8_t> &prefix,
+                           const MediaFrame &frame);
+    // View into part of this frame, sharing the same buffer
+    FramePtr slice(size_t offset, size_t size) const;
+    // Point pkt at this payload with a new buffer reference (no copy)
+    bool toPacket(AVPacket *pkt) const;
+    // Same payload, carrying a latency trace (only sampled frames)
+    FramePtr withTrace(TracePtr trace) const;
+    // Same payload, restamped (timeline rebase after a reconnect)
+    FramePtr withPts(int64_t pts) const;
+
+    const uint8_t *data() const { return data_; }
+    size_t size() const { return size_; }
+    AVCodecID codecId() const { return codec_id_; }
+    bool isKeyframe() const { return is_keyframe_; }
+    int64_t pts() const { return pts_; } // 90kHz, or -1 if unknown
+    // Null unless sampled; stages stamp it as the frame passes
+    const TracePtr &trace() const { return trace_; }
+    // NAL units of an H.264/H.265 access unit (empty for other codecs),
+    // scanned on first use from any thread and reused by every later stage.
+    // Restamped and traced copies inherit it.
+    const NalList &nals() const;
+
+    static void *operator new(size_t size) {
+        return BufferPool::global().allocate(size);
+    }
+    static void operator delete(void *p) { BufferPool::global().deallocate(p); }
+
+private:
+    MediaFrame() = default;
+    // Takes ownership of exactly one of buf / pooled
+    static std::shared_ptr<MediaFrame>
+    wrap(AVBufferRef *buf, PoolBuffer *pooled, const uint8_t *data,
+         size_t size, AVCodecID codec_id, bool is_keyframe, int64_t pts,
+         TracePtr trace = nullptr);
+    // Hand an already scanned index to `to`, whose payload holds these
+    // bytes at `shift` after entries `to` already has
+    void shareNals(MediaFrame &to, size_t shift = 0) const;
+    // Padded pooled buffer holding `size` payload bytes
+    static PoolBuffer *allocPadded(size_t size);
+
+    AVBufferRef *buf_ = nullptr;
+    PoolBuffer *pooled_ = nullptr;
+    const uint8_t *data_ = nullptr;
+    size_t size_ = 0;
+    AVCodecID codec_id_ = AV_CODEC_ID_NONE;
+    bool is_keyframe_ = false;
+    int64_t pts_ = -1;
+    TracePtr trace_;
+    mutable NalList nals_;
+    mutable std::once_flag nals_once_;
+    mutable std::atomic<bool> nals_ready_{false};
+};
+
+// The source's audio stream, next to the video's extradata. Audio frames
+// are MediaFrames too, one codec frame each, on the same 90kHz PTS clock.
+struct AudioInfo {
+    AVCodecID codec_id = AV_CODEC_ID_NONE; // NONE: no audio
+    int sample_rate = 0;
+    int channels = 0;
+    std::vector<uint8_t> extradata; // e.g. AAC AudioSpecificConfig
+};
+
+inline bool isAudioCodec(AVCodecID codec_id) {
+    return avcodec_get_type(codec_id) == AVMEDIA_TYPE_AUDIO;
+}
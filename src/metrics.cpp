@@ -0,0 +1,202 @@
+#include "metrics.h"
+#include <algorithm>
+#include <iomanip>
+#include <sstream>
+
+// Cumulative `le` bounds exported per histogram, in µs
+static constexpr uint64_t kExportBounds[] = {
+    100,    250,    500,     1000,    2500,    5000,     10000,    25000,
+    50000,  100000, 250000,  500000,  1000000, 2500000,  5000000,  10000000};
+
+uint64_t Counter::value() const {
+    uint64_t total = 0;
+    for (const auto &s : shards_)
+        total += s.value.load(std::memory_order_relaxed);
+    return total;
+}
+
+size_t Histogram::bucketOf(uint64_t us) {
+    constexpr uint64_t sub = uint64_t(1) << kSubBits;
+    if (us < sub)
+        return static_cast<size_t>(us); // exact below 8 µs
+    if (us >= uint64_t(1) << kMaxBits)
+        return kBuckets - 1;
+    size_t exp = 63 - static_cast<size_t>(__builtin_clzll(us));
+    size_t shift = exp - kSubBits;
+    return ((shift + 1) << kSubBits) + ((us >> shift) & (sub - 1));
+}
+
+uint64_t Histogram::bucketUpper(size_t index) {
+    constexpr uint64_t sub = uint64_t(1) << kSubBits;
+    if (index < sub)
+        return index + 1;
+    size_t shift = (index >> kSubBits) - 1;
+    return (sub + (index & (sub - 1)) + 1) << shift;
+}
+
+Histogram::Snapshot Histogram::snapshot() const {
+    Snapshot snap;
+    snap.buckets.resize(kBuckets);
+    for (size_t i = 0; i < kBuckets; i++) {
+        snap.buckets[i] = buckets_[i].load(std::memory_order_relaxed);
+        snap.count += snap.buckets[i];
+    }
+    snap.sum_us = sum_us_.load(std::memory_order_relaxed);
+    return snap;
+}
+
+uint64_t Histogram::Snapshot::quantile(double q) const {
+    if (count == 0)
+        return 0;
+    auto rank = static_cast<uint64_t>(q * static_cast<double>(count - 1));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < buckets.size(); i++) {
+        seen += buckets[i];
+        if (seen > rank)
+            return bucketUpper(i);
+    }
+    return bucketUpper(buckets.size() - 1);
+}
+
+MetricsRegistry &MetricsRegistry::global() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+void MetricsRegistry::add(const std::string &name, const std::string &help,
+                          Type type, MetricLabels labels,
+                          std::weak_ptr<void> metric) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = families_.find(name);
+    if (it == families_.end())
+        it = families_.emplace(name, Family{help, type, {}}).first;
+    it->second.series.push_back({std::move(labels), std::move(metric)});
+}
+
+std::shared_ptr<Counter> MetricsRegistry::counter(const std::string &name,
+                                                  const std::string &help,
+                                                  MetricLabels labels) {
+    auto metric = std::make_shared<Counter>();
+    add(name, help, Type::Counter, std::move(labels), metric);
+    return metric;
+}
+
+std::shared_ptr<Gauge> MetricsRegistry::gauge(const std::string &name,
+                                              const std::string &help,
+                                              MetricLabels labels) {
+    auto metric = std::make_shared<Gauge>();
+    add(name, help, Type::Gauge, std::move(labels), metric);
+    return metric;
+}
+
+std::shared_ptr<Histogram>
+MetricsRegistry::histogram(const std::string &name, const std::string &help,
+                           MetricLabels labels) {
+    auto metric = std::make_shared<Histogram>();
+    add(name, help, Type::Histogram, std::move(labels), metric);
+    return metric;
+}
+
+static std::string escape(const std::string &value) {
+    std::string out;
+    for (char c : value) {
+        if (c == '\\' || c == '"')
+            out += '\\';
+        if (c == '\n')
+            out += "\\n";
+        else
+            out += c;
+    }
+    return out;
+}
+
+// {a="1",b="2"} with an optional extra pair (histogram `le`)
+static std::string labelSet(const MetricLabels &labels,
+                            const std::string &extra_key = "",
+                            const std::string &extra_value = "") {
+    std::string out;
+    for (const auto &[k, v] : labels)
+        out += (out.empty() ? "" : ",") + k + "=\"" + escape(v) + "\"";
+    if (!extra_key.empty())
+        out += (out.empty() ? "" : ",") + extra_key + "=\"" + extra_value +
+               "\"";
+    return out.empty() ? out : "{" + out + "}";
+}
+
+std::string MetricsRegistry::render() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    std::ostringstream out;
+    // Byte gauges run to 1e8 and beyond: the default 6 digits would round
+    out << std::setprecision(17);
+    for (auto it = families_.begin(); it != families_.end();) {
+        const std::string &name = it->first;
+        Family &family = it->second;
+        // Series whose owner is gone disappear from the next scrape on
+        auto &series = family.series;
+        series.erase(std::remove_if(series.begin(), series.end(),
+                                    [](const Series &s) {
+                                        return s.metric.expired();
+                                    }),
+                     series.end());
+        if (series.empty()) {
+            it = families_.erase(it);
+            continue;
+        }
+
+        static const char *types[] = {"counter", "gauge", "histogram"};
+        out << "# HELP " << name << " " << family.help << "\n";
+        out << "# TYPE " << name << " "
+            << types[static_cast<int>(family.type)] << "\n";
+        for (const auto &s : series) {
+            auto metric = s.metric.lock();
+            if (!metric)
+                continue;
+            switch (family.type) {
+            case Type::Counter:
+                out << name << labelSet(s.labels) << " "
+                    << static_cast<Counter *>(metric.get())->value() << "\n";
+                break;
+            case Type::Gauge:
+                out << name << labelSet(s.labels) << " "
+                    << static_cast<Gauge *>(metric.get())->value() << "\n";
+                break;
+            case Type::Histogram: {
+                auto snap = static_cast<Histogram *>(metric.get())->snapshot();
+                size_t b = 0;
+                uint64_t cumulative = 0;
+                for (uint64_t bound : kExportBounds) {
+                    std::ostringstream le;
+                    le << bound / 1e6;
+                    // Buckets entirely below the bound; HDR precision is
+                    // 12.5%, so the edge bucket is not split
+                    while (b < snap.buckets.size() &&
+                           Histogram::bucketUpper(b) <= bound)
+                        cumulative += snap.buckets[b++];
+                    out << name << "_bucket"
+                        << labelSet(s.labels, "le", le.str())
+                        << " " << cumulative << "\n";
+                }
+                out << name << "_bucket" << labelSet(s.labels, "le", "+Inf")
+                    << " " << snap.count << "\n";
+                out << name << "_sum" << labelSet(s.labels) << " "
+                    << snap.sum_us / 1e6 << "\n";
+                out << name << "_count" << labelSet(s.labels) << " "
+                    << snap.count << "\n";
+                break;
+            }
+            }
+        }
+        ++it;
+    }
+    return out.str();
+}
+
+std::string redactCredentials(const std::string &url) {
+    size_t scheme = url.find("://");
+    size_t start = scheme == std::string::npos ? 0 : scheme + 3;
+    size_t at = url.find('@', start);
+    size_t slash = url.find('/', start);
+    if (at == std::string::npos || (slash != std::string::npos && at > slash))
+        return url;
+    return url.substr(0, start) + url.substr(at + 1);
+}
@@ -0,0 +1,145 @@
+#include "nal_scanner.h"
+#include <atomic>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define NAL_SCANNER_X86 1
+#endif
+
+// Skips 3 bytes whenever the third can neither be the 01 nor one of the
+// zeros: most of a slice's payload is passed over 3 bytes at a time
+static size_t findScalar(const uint8_t *p, size_t i, size_t size) {
+    while (i + 3 <= size) {
+        if (p[i + 2] > 1)
+            i += 3; // no start code can begin at i, i+1 or i+2
+        else if (p[i + 2] == 1 && p[i + 1] == 0 && p[i] == 0)
+            return i;
+        else
+            i++;
+    }
+    return size;
+}
+
+#ifdef NAL_SCANNER_X86
+// One lane per candidate position: p[i] == 0, p[i+1] == 0, p[i+2] == 1,
+// from three overlapping unaligned loads. The tail goes to the scalar loop.
+__attribute__((target("sse2"))) static size_t
+findSse2(const uint8_t *p, size_t i, size_t size) {
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    for (; i + 18 <= size; i += 16) {
+        __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i));
+        __m128i b =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 1));
+        __m128i c =
+            _mm_loadu_si128(reinterpret_cast<const __m128i *>(p + i + 2));
+        __m128i hit = _mm_and_si128(
+            _mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)),
+            _mm_cmpeq_epi8(c, one));
+        if (unsigned mask = static_cast<unsigned>(_mm_movemask_epi8(hit)))
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+    }
+    return findScalar(p, i, size);
+}
+
+__attribute__((target("avx2"))) static size_t
+findAvx2(const uint8_t *p, size_t i, size_t size) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    for (; i + 34 <= size; i += 32) {
+        __m256i a =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i));
+        __m256i b =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + 1));
+        __m256i c =
+            _mm256_loadu_si256(reinterpret_cast<const __m256i *>(p + i + 2));
+        __m256i hit = _mm256_and_si256(
+            _mm256_and_si256(_mm256_cmpeq_epi8(a, zero),
+                             _mm256_cmpeq_epi8(b, zero)),
+            _mm256_cmpeq_epi8(c, one));
+        if (unsigned mask = static_cast<unsigned>(_mm256_movemask_epi8(hit)))
+            return i + static_cast<size_t>(__builtin_ctz(mask));
+    }
+    return findSse2(p, i, size);
+}
+#endif
+
+using FindFn = size_t (*)(const uint8_t *, size_t, size_t);
+
+static FindFn kernelFn(NalKernel kernel) {
+#ifdef NAL_SCANNER_X86
+    __builtin_cpu_init();
+    if (kernel == NalKernel::Avx2 && __builtin_cpu_supports("avx2"))
+        return findAvx2;
+    if (kernel == NalKernel::Sse2 && __builtin_cpu_supports("sse2"))
+        return findSse2;
+#endif
+    return kernel == NalKernel::Scalar ? findScalar : nullptr;
+}
+
+struct ActiveKernel {
+    std::atomic<FindFn> fn;
+    std::atomic<NalKernel> kernel;
+};
+
+// Best kernel the CPU has, decided on first use
+static ActiveKernel &active() {
+    static ActiveKernel a = [] {
+        for (NalKernel k : {NalKernel::Avx2, NalKernel::Sse2}) {
+            if (FindFn fn = kernelFn(k))
+                return ActiveKernel{{fn}, {k}};
+        }
+        return ActiveKernel{{findScalar}, {NalKernel::Scalar}};
+    }();
+    return a;
+}
+
+size_t findStartCode(const uint8_t *p, size_t from, size_t size) {
+    return active().fn.load(std::memory_order_relaxed)(p, from, size);
+}
+
+void scanNals(const uint8_t *p, size_t size, bool hevc, NalList &out) {
+    FindFn find = active().fn.load(std::memory_order_relaxed);
+    size_t i = find(p, 0, size);
+    if (i == size && size > 0) {
+        out.push_back({0, static_cast<uint32_t>(size), nalType(p, hevc)});
+        return;
+    }
+    // Each NAL's end is the next one's start code: one pass over the bytes
+    while (i < size) {
+        size_t start = i + 3;
+        size_t next = find(p, start, size);
+        size_t end = next;
+        while (end > start && p[end - 1] == 0)
+            end--; // the zero of a 4-byte start code, or trailing_zero_8bits
+        if (end > start)
+            out.push_back({static_cast<uint32_t>(start),
+                           static_cast<uint32_t>(end - start),
+                           nalType(p + start, hevc)});
+        i = next;
+    }
+}
+
+NalKernel nalKernel() {
+    return active().kernel.load(std::memory_order_relaxed);
+}
+
+bool setNalKernel(NalKernel kernel) {
+    FindFn fn = kernelFn(kernel);
+    if (!fn)
+        return false;
+    active().fn.store(fn, std::memory_order_relaxed);
+    active().kernel.store(kernel, std::memory_order_relaxed);
+    return true;
+}
+
+const char *nalKernelName(NalKernel kernel) {
+    switch (kernel) {
+    case NalKernel::Avx2:
+        return "avx2";
+    case NalKernel::Sse2:
+        return "sse2";
+    default:
+        return "scalar";
+    }
+}
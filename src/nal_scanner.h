@@ -0,0 +1,37 @@
+#pragma once
+#include "buffer_pool.h"
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Annex-B start code scanning, shared by every stage that splits access
+// units into NAL units. The 00 00 01 search runs on SSE2 or AVX2 kernels
+// picked once at startup from the CPU's features (scalar elsewhere); on
+// multi-megabyte keyframes it is the bulk of the per-frame work.
+
+struct NalUnit {
+    uint32_t offset; // first byte after the start code
+    uint32_t size;   // up to the next start code, trailing zeros excluded
+    uint8_t type;    // nal_unit_type: 5 bits for H.264, 6 for H.265
+};
+using NalList = std::vector<NalUnit, PoolAllocator<NalUnit>>;
+
+enum class NalKernel { Scalar, Sse2, Avx2 };
+
+// Offset of the next 00 00 01 at or after `from`, or size
+size_t findStartCode(const uint8_t *p, size_t from, size_t size);
+
+// Every NAL unit of an access unit in one pass, appended to out. Bytes
+// before the first start code are skipped; without any start code the
+// whole buffer is one NAL.
+void scanNals(const uint8_t *p, size_t size, bool hevc, NalList &out);
+
+inline uint8_t nalType(const uint8_t *nal, bool hevc) {
+    return hevc ? (nal[0] >> 1) & 0x3F : nal[0] & 0x1F;
+}
+
+// Kernel in use, and a way to force one (benchmarks); false if this CPU
+// or build cannot run it
+NalKernel nalKernel();
+bool setNalKernel(NalKernel kernel);
+const char *nalKernelName(NalKernel kernel);
@@ -0,0 +1,234 @@
+#include "pacer.h"
+#include <algorithm>
+#include <iostream>
+
+// PTS are 90kHz on every ingest path
+static constexpr int64_t kTicksPerMs = 90;
+
+PacedStream::PacedStream(PacerWorker &worker, const PacerOptions &options,
+                         Output output)
+    : worker_(worker), options_(options), output_(std::move(output)) {}
+
+void PacedStream::rebase(int64_t pts, uint64_t now) {
+    have_base_ = true;
+    base_pts_ = pts;
+    base_ms_ = now;
+}
+
+void PacedStream::push(const FramePtr &frame) {
+    if (!options_.realtime) {
+        std::lock_guard<std::mutex> lock(out_mtx_);
+        if (output_)
+            output_(frame);
+        return;
+    }
+    uint64_t arm_at = 0;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (closed_)
+            return;
+        uint64_t now = worker_.now();
+        uint64_t due = now; // no PTS: pass through unpaced
+        int64_t pts = frame->pts();
+        if (pts >= 0) {
+            int64_t lead = options_.max_lead.count();
+            if (!have_base_ || pts < last_pts_ - lead * kTicksPerMs) {
+                // First frame, or the source clock jumped backwards
+                rebase(pts, now);
+            } else {
+                int64_t ahead = static_cast<int64_t>(base_ms_) +
+                                (pts - base_pts_) / kTicksPerMs -
+                                static_cast<int64_t>(now);
+                if (ahead > lead) {
+                    rebase(pts, now);
+                } else if (ahead < -options_.max_lag.count()) {
+                    switch (options_.catch_up) {
+                    case PacerOptions::CatchUp::Burst:
+                        // Backlog goes out at once; re-anchor once drained
+                        if (queue_.empty())
+                            rebase(pts, now);
+                        break;
+                    case PacerOptions::CatchUp::Rebase:
+                        rebase(pts, now);
+                        break;
+                    case PacerOptions::CatchUp::DropToKeyframe:
+                        if (frame->isKeyframe())
+                            rebase(pts, now);
+                        else
+                            dropping_ = true;
+                        break;
+                    }
+                }
+            }
+            last_pts_ = pts;
+            int64_t at = static_cast<int64_t>(base_ms_) +
+                         (pts - base_pts_) / kTicksPerMs;
+            due = std::max(now, static_cast<uint64_t>(std::max<int64_t>(at, 0)));
+        }
+
+        if (queue_.size() >= options_.max_frames) {
+            std::cerr << "[Pacer] Jitter buffer full, dropping "
+                      << queue_.size() << " frames to next keyframe\n";
+            dropped_ += queue_.size();
+            queue_.clear();
+            dropping_ = true;
+        }
+        if (dropping_ && !frame->isKeyframe()) {
+            dropped_++;
+            return;
+        }
+        dropping_ = false;
+
+        queue_.push_back({frame, due});
+        // Frames leave in order, so only the head needs a timer
+        if (armed_due_ == 0) {
+            armed_due_ = due;
+            arm_at = due;
+        }
+    }
+    if (arm_at)
+        worker_.arm(shared_from_this(), arm_at);
+}
+
+void PacedStream::reset() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    queue_.clear();
+    have_base_ = false;
+    dropping_ = false;
+    armed_due_ = 0; // a pending timer becomes stale
+}
+
+void PacedStream::close() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        closed_ = true;
+        queue_.clear();
+        armed_due_ = 0;
+    }
+    std::lock_guard<std::mutex> lock(out_mtx_);
+    output_ = nullptr;
+}
+
+size_t PacedStream::bytes() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    size_t total = 0;
+    for (const auto &entry : queue_)
+        total += entry.frame->size();
+    return total;
+}
+
+size_t PacedStream::depth() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return queue_.size();
+}
+
+uint64_t PacedStream::dropped() const {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return dropped_;
+}
+
+uint64_t PacedStream::release(uint64_t tick, uint64_t now) {
+    auto &out = released_;
+    uint64_t next;
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        if (tick != armed_due_)
+            return 0;
+        while (!queue_.empty() && queue_.front().due <= now) {
+            out.push_back(std::move(queue_.front().frame));
+            queue_.pop_front();
+        }
+        armed_due_ = queue_.empty() ? 0 : queue_.front().due;
+        next = armed_due_;
+    }
+    // Outside mtx_ so the reader can keep pushing meanwhile
+    std::lock_guard<std::mutex> lock(out_mtx_);
+    if (output_)
+        for (const auto &frame : out)
+            output_(frame);
+    out.clear();
+    return next;
+}
+
+PacerWorker::PacerWorker()
+    : epoch_(std::chrono::steady_clock::now()), wheel_(now()),
+      thread_(&PacerWorker::run, this) {}
+
+PacerWorker::~PacerWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+uint64_t PacerWorker::now() const {
+    // +1 keeps 0 free as "no timer"
+    return static_cast<uint64_t>(
+               std::chrono::duration_cast<std::chrono::milliseconds>(
+                   std::chrono::steady_clock::now() - epoch_)
+                   .count()) +
+           1;
+}
+
+void PacerWorker::arm(const std::shared_ptr<PacedStream> &stream,
+                      uint64_t due) {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        incoming_.emplace_back(stream, due);
+    }
+    cv_.notify_one();
+}
+
+void PacerWorker::run() {
+    std::vector<Timer> incoming;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            auto ready = [this] { return stop_ || !incoming_.empty(); };
+            // Asleep until the earliest due frame, not every tick; tick t
+            // is reached at epoch_ + (t - 1) ms
+            if (uint64_t next = wheel_.nextExpiry())
+                cv_.wait_until(lock,
+                               epoch_ + std::chrono::milliseconds(next - 1),
+                               ready);
+            else
+                cv_.wait(lock, ready);
+            if (stop_)
+                return;
+            incoming.swap(incoming_);
+        }
+
+        uint64_t now = this->now();
+        for (auto &timer : incoming)
+            wheel_.insert(timer.second, std::move(timer));
+        incoming.clear();
+
+        wheel_.advance(now, [this, now](Timer &timer) {
+            auto stream = timer.first.lock();
+            if (!stream)
+                return;
+            if (uint64_t next = stream->release(timer.second, now)) {
+                timer.second = next;
+                wheel_.insert(next, std::move(timer));
+            }
+        });
+    }
+}
+
+Pacer::Pacer(size_t threads, PacerOptions options) : options_(options) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; i++)
+        workers_.push_back(std::make_unique<PacerWorker>());
+}
+
+Pacer::~Pacer() = default;
+
+std::shared_ptr<PacedStream> Pacer::createStream(PacedStream::Output output) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto &worker = *workers_[next_++ % workers_.size()];
+    return std::make_shared<PacedStream>(worker, options_, std::move(output));
+}
@@ -0,0 +1,124 @@
+#pragma once
+#include "media_frame.h"
+#include "timer_wheel.h"
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class PacerWorker;
+
+struct PacerOptions {
+    // Never hold a frame longer than this: beyond it (PTS jump, source
+    // burst) the timeline is re-anchored to now
+    std::chrono::milliseconds max_lead{1000};
+    // Frames later than this trigger the catch-up policy
+    std::chrono::milliseconds max_lag{500};
+    enum class CatchUp {
+        Burst,         // release late frames at once, keep the timeline
+        Rebase,        // re-anchor the timeline at the late frame
+        DropToKeyframe // drop late deltas, re-anchor at the next keyframe
+    } catch_up = CatchUp::Burst;
+    // Jitter buffer bound per stream; on overflow drop to the next keyframe
+    size_t max_frames = 300;
+    // false: release every frame as it arrives, on the pushing thread
+    // (files and benchmarks that run faster than real time)
+    bool realtime = true;
+};
+
+// Per-source jitter buffer. The reader pushes frames as fast as they arrive;
+// a pacer thread releases them to the output on their PTS schedule.
+class PacedStream : public std::enable_shared_from_this<PacedStream> {
+public:
+    using Output = std::function<void(const FramePtr &frame)>;
+
+    PacedStream(PacerWorker &worker, const PacerOptions &options,
+                Output output);
+
+    // Any thread, never blocks on the schedule
+    void push(const FramePtr &frame);
+    // Drop buffered frames and start a new timeline (e.g. after reconnect)
+    void reset();
+    // Stop delivering; waits for a release in progress to finish
+    void close();
+
+    size_t depth() const;
+    size_t bytes() const; // payload of the frames waiting
+    uint64_t dropped() const;
+
+private:
+    friend class PacerWorker;
+    struct Entry {
+        FramePtr frame;
+        uint64_t due; // pacer clock, ms
+    };
+
+    // Called by the worker when the timer armed for `tick` fires. Returns
+    // the next due tick, or 0 if nothing is left or the timer was stale.
+    uint64_t release(uint64_t tick, uint64_t now);
+    void rebase(int64_t pts, uint64_t now);
+
+    PacerWorker &worker_;
+    PacerOptions options_;
+
+    mutable std::mutex mtx_;
+    std::deque<Entry, PoolAllocator<Entry>> queue_;
+    bool have_base_ = false;
+    int64_t base_pts_ = 0;
+    uint64_t base_ms_ = 0;
+    int64_t last_pts_ = 0;
+    bool dropping_ = false;
+    uint64_t dropped_ = 0;
+    uint64_t armed_due_ = 0; // tick of the live timer, 0 if none
+    bool closed_ = false;
+
+    std::mutex out_mtx_;
+    Output output_;
+    std::vector<FramePtr> released_; // worker thread only, reused
+};
+
+// One pacer thread turning a timer wheel for the streams assigned to it
+class PacerWorker {
+public:
+    PacerWorker();
+    ~PacerWorker();
+
+    // Milliseconds on the pacer clock
+    uint64_t now() const;
+    // Thread-safe: schedule a release of `stream` at `due`
+    void arm(const std::shared_ptr<PacedStream> &stream, uint64_t due);
+
+private:
+    using Timer = std::pair<std::weak_ptr<PacedStream>, uint64_t>;
+    void run();
+
+    const std::chrono::steady_clock::time_point epoch_;
+    TimerWheel<Timer> wheel_; // pacer thread only
+    std::vector<Timer> incoming_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// Fixed pool of pacer threads shared by all sources
+class Pacer {
+public:
+    explicit Pacer(size_t threads = 1, PacerOptions options = {});
+    ~Pacer();
+
+    // New stream on the next worker (round-robin)
+    std::shared_ptr<PacedStream> createStream(PacedStream::Output output);
+
+private:
+    PacerOptions options_;
+    std::vector<std::unique_ptr<PacerWorker>> workers_;
+    size_t next_ = 0;
+    std::mutex mtx_;
+};
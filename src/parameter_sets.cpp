@@ -0,0 +1,197 @@
+#include "parameter_sets.h"
+#include <algorithm>
+#include <iostream>
+
+// NAL unit types of parameter sets
+static constexpr uint8_t kH264Sps = 7;
+static constexpr uint8_t kH264Pps = 8;
+static constexpr uint8_t kHevcVps = 32;
+static constexpr uint8_t kHevcSps = 33;
+static constexpr uint8_t kHevcPps = 34;
+
+// Reads the start of an RBSP: emulation prevention bytes (00 00 03)
+// removed, enough for the ids at the front of a parameter set
+class BitReader {
+public:
+    BitReader(const uint8_t *data, size_t size) {
+        size_t zeros = 0;
+        for (size_t i = 0; i < size && len_ < sizeof(rbsp_); i++) {
+            if (zeros >= 2 && data[i] == 3) {
+                zeros = 0;
+                continue;
+            }
+            zeros = data[i] == 0 ? zeros + 1 : 0;
+            rbsp_[len_++] = data[i];
+        }
+    }
+
+    uint32_t bits(unsigned n) {
+        uint32_t v = 0;
+        while (n--) {
+            size_t byte = pos_ >> 3;
+            if (byte >= len_) {
+                ok_ = false;
+                return 0;
+            }
+            v = v << 1 | ((rbsp_[byte] >> (7 - (pos_ & 7))) & 1);
+            pos_++;
+        }
+        return v;
+    }
+    void skip(unsigned n) { pos_ += n; }
+    // Exp-Golomb ue(v)
+    uint32_t ue() {
+        unsigned zeros = 0;
+        while (ok_ && bits(1) == 0) {
+            // Untrusted bytes: 32 leading zeros do not fit a uint32_t
+            if (++zeros == 32) {
+                ok_ = false;
+                return 0;
+            }
+        }
+        return zeros ? (1u << zeros) - 1 + bits(zeros) : 0;
+    }
+    bool ok() const { return ok_ && (pos_ >> 3) <= len_; }
+
+private:
+    uint8_t rbsp_[64];
+    size_t len_ = 0;
+    size_t pos_ = 0;
+    bool ok_ = true;
+};
+
+// H.265 profile_tier_level(1, max_sub_layers_minus1), skipped
+static void skipProfileTierLevel(BitReader &br, unsigned max_sub_layers_minus1) {
+    br.skip(96); // general profile (88 bits) + general_level_idc
+    bool profile[8] = {}, level[8] = {};
+    for (unsigned i = 0; i < max_sub_layers_minus1; i++) {
+        profile[i] = br.bits(1);
+        level[i] = br.bits(1);
+    }
+    if (max_sub_layers_minus1 > 0)
+        br.skip(2 * (8 - max_sub_layers_minus1));
+    for (unsigned i = 0; i < max_sub_layers_minus1; i++)
+        br.skip((profile[i] ? 88 : 0) + (level[i] ? 8 : 0));
+}
+
+// Parameter set id, or -1 if the NAL is not a parameter set (or too short)
+static int parameterSetId(const uint8_t *nal, size_t size, uint8_t type,
+                          bool hevc) {
+    if (!hevc) {
+        if (type == kH264Sps && size > 4) {
+            BitReader br(nal + 4, size - 4); // after profile, flags, level
+            uint32_t id = br.ue();
+            return br.ok() && id < 32 ? static_cast<int>(id) : -1;
+        }
+        if (type == kH264Pps && size > 1) {
+            BitReader br(nal + 1, size - 1);
+            uint32_t id = br.ue();
+            return br.ok() && id < 256 ? static_cast<int>(id) : -1;
+        }
+        return -1;
+    }
+    if (size <= 2 || type < kHevcVps || type > kHevcPps)
+        return -1;
+    BitReader br(nal + 2, size - 2);
+    uint32_t id;
+    if (type == kHevcVps) {
+        id = br.bits(4);
+    } else if (type == kHevcSps) {
+        br.skip(4); // sps_video_parameter_set_id
+        unsigned max_sub_layers_minus1 = br.bits(3);
+        br.skip(1);
+        skipProfileTierLevel(br, max_sub_layers_minus1);
+        id = br.ue();
+    } else {
+        id = br.ue();
+    }
+    return br.ok() && id < 64 ? static_cast<int>(id) : -1;
+}
+
+ParameterSetTracker::ParameterSetTracker(const std::string &source) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{{"source", source}};
+    changes_metric_ = registry.counter(
+        "parameter_set_changes_total",
+        "Parameter sets replaced mid-stream (resolution switch, reconnect)",
+        labels);
+    injected_metric_ = registry.counter(
+        "parameter_set_injected_keyframes_total",
+        "Keyframes sent with the cached parameter sets prepended", labels);
+    inband_metric_ = registry.counter(
+        "parameter_set_inband_keyframes_total",
+        "Keyframes that carried their own parameter sets", labels);
+}
+
+void ParameterSetTracker::record(const uint8_t *nal, size_t size,
+                                 uint8_t type, bool hevc) {
+    int id = parameterSetId(nal, size, type, hevc);
+    if (id < 0)
+        return;
+    auto &slot = sets_[static_cast<uint16_t>(type << 8 | id)];
+    if (slot.size() == size && std::equal(slot.begin(), slot.end(), nal))
+        return;
+    if (!slot.empty()) {
+        version_++;
+        changes_metric_->add();
+        std::cout << "[ParameterSets] NAL type " << int(type) << " id " << id
+                  << " changed, version " << version_ << "\n";
+    }
+    slot.assign(nal, nal + size);
+    dirty_ = true;
+}
+
+const std::vector<uint8_t> &ParameterSetTracker::annexB() {
+    if (dirty_) {
+        annexb_.clear();
+        for (const auto &[key, set] : sets_) {
+            static const uint8_t kStartCode[4] = {0, 0, 0, 1};
+            annexb_.insert(annexb_.end(), kStartCode, kStartCode + 4);
+            annexb_.insert(annexb_.end(), set.begin(), set.end());
+        }
+        dirty_ = false;
+    }
+    return annexb_;
+}
+
+FramePtr ParameterSetTracker::process(
+    const FramePtr &frame,
+    const std::shared_ptr<const std::vector<uint8_t>> &extradata) {
+    bool hevc = frame->codecId() == AV_CODEC_ID_HEVC;
+    if (extradata && extradata != extradata_) {
+        extradata_ = extradata;
+        NalList nals;
+        scanNals(extradata->data(), extradata->size(), hevc, nals);
+        for (const NalUnit &nal : nals)
+            record(extradata->data() + nal.offset, nal.size, nal.type, hevc);
+    }
+
+    // The frame's own sets: cached, and they tell whether it needs ours
+    const uint8_t sps = hevc ? kHevcSps : kH264Sps;
+    const uint8_t pps = hevc ? kHevcPps : kH264Pps;
+    bool has_vps = !hevc, has_sps = false, has_pps = false;
+    for (const NalUnit &nal : frame->nals()) {
+        if (hevc && nal.type == kHevcVps)
+            has_vps = true;
+        else if (nal.type == sps)
+            has_sps = true;
+        else if (nal.type == pps)
+            has_pps = true;
+        else
+            continue;
+        record(frame->data() + nal.offset, nal.size, nal.type, hevc);
+    }
+
+    if (!frame->isKeyframe())
+        return frame;
+    if (has_vps && has_sps && has_pps) {
+        inband_metric_->add();
+        return frame;
+    }
+    const auto &prefix = annexB();
+    if (prefix.empty())
+        return frame;
+    injected_metric_->add();
+    auto with_ps = MediaFrame::concat(prefix, *frame);
+    return with_ps ? with_ps : frame;
+}
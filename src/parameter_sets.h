@@ -0,0 +1,47 @@
+#pragma once
+#include "media_frame.h"
+#include "metrics.h"
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Per-source cache of the H.264 SPS/PPS and H.265 VPS/SPS/PPS, by id, as
+// the stream carries them in-band, seeded from the reader's extradata (SDP
+// sprop, demuxer). Keyframes that carry their own sets go out untouched;
+// only those missing one get the cached sets prepended, so a viewer can
+// always start on a keyframe. A set replaced by different bytes (the camera
+// switched resolution, a reconnect brought new parameters) bumps the
+// version. Pacer thread only.
+class ParameterSetTracker {
+public:
+    // source: metric label
+    explicit ParameterSetTracker(const std::string &source = "");
+
+    // Every video frame, in order. extradata: the reader's current
+    // snapshot, (re)read only when it is a new one. Returns the frame to
+    // deliver: the same one, or a keyframe with the cached sets in front.
+    FramePtr process(const FramePtr &frame,
+                     const std::shared_ptr<const std::vector<uint8_t>> &extradata);
+
+    // Bumped when a cached set is replaced by different bytes (new ids
+    // alongside the known ones do not count)
+    uint64_t version() const { return version_; }
+    // Cached sets as Annex-B, VPS, SPS, PPS order (decoder extradata)
+    const std::vector<uint8_t> &annexB();
+
+private:
+    void record(const uint8_t *nal, size_t size, uint8_t type, bool hevc);
+
+    // Key: NAL type << 8 | id, so the map iterates VPS, SPS, PPS
+    std::map<uint16_t, std::vector<uint8_t>> sets_;
+    std::vector<uint8_t> annexb_; // sets_ serialized, rebuilt when dirty
+    bool dirty_ = false;
+    uint64_t version_ = 0;
+    std::shared_ptr<const std::vector<uint8_t>> extradata_; // last seen
+
+    std::shared_ptr<Counter> changes_metric_;
+    std::shared_ptr<Counter> injected_metric_;
+    std::shared_ptr<Counter> inband_metric_;
+};
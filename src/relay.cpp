@@ -0,0 +1,439 @@
+#include "relay.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+static constexpr char kMagic[4] = {'R', '2', 'W', '1'};
+// Largest message accepted from an origin: a broken peer must not make us
+// allocate gigabytes
+static constexpr uint32_t kMaxMessage = 64 << 20;
+
+static void putU32(uint8_t *p, uint32_t v) {
+    p[0] = v >> 24;
+    p[1] = v >> 16;
+    p[2] = v >> 8;
+    p[3] = v;
+}
+
+static uint32_t getU32(const uint8_t *p) {
+    return (uint32_t(p[0]) << 24) | (uint32_t(p[1]) << 16) |
+           (uint32_t(p[2]) << 8) | p[3];
+}
+
+static void putU64(uint8_t *p, uint64_t v) {
+    putU32(p, uint32_t(v >> 32));
+    putU32(p + 4, uint32_t(v));
+}
+
+static uint64_t getU64(const uint8_t *p) {
+    return (uint64_t(getU32(p)) << 32) | getU32(p + 4);
+}
+
+// Write every iovec, resuming after partial writes
+static bool sendAll(int fd, iovec *iov, int count) {
+    while (count > 0) {
+        msghdr msg{};
+        msg.msg_iov = iov;
+        msg.msg_iovlen = count;
+        ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        size_t left = static_cast<size_t>(n);
+        while (count > 0 && left >= iov->iov_len) {
+            left -= iov->iov_len;
+            iov++;
+            count--;
+        }
+        if (count > 0) {
+            iov->iov_base = static_cast<uint8_t *>(iov->iov_base) + left;
+            iov->iov_len -= left;
+        }
+    }
+    return true;
+}
+
+static bool recvAll(int fd, void *buf, size_t size) {
+    auto *p = static_cast<uint8_t *>(buf);
+    while (size > 0) {
+        ssize_t n = recv(fd, p, size, 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        p += n;
+        size -= static_cast<size_t>(n);
+    }
+    return true;
+}
+
+// ==== RelayEndpoint ====
+
+bool RelayEndpoint::parse(const std::string &spec, RelayEndpoint &out) {
+    size_t colon = spec.rfind(':');
+    if (colon == std::string::npos || colon == 0)
+        return false;
+    char *end = nullptr;
+    unsigned long port = strtoul(spec.c_str() + colon + 1, &end, 10);
+    if (*end != '\0' || port == 0 || port > 65535)
+        return false;
+    out.host = spec.substr(0, colon);
+    out.port = static_cast<uint16_t>(port);
+    return true;
+}
+
+// ==== HashRing ====
+
+// FNV-1a with a murmur3 finalizer: stable across processes and builds
+// (std::hash is not), and spreads similar URLs over the whole ring
+static uint64_t hash64(const std::string &s) {
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (unsigned char c : s) {
+        h ^= c;
+        h *= 0x100000001b3ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+}
+
+HashRing::HashRing(size_t vnodes) : vnodes_(vnodes ? vnodes : 1) {}
+
+void HashRing::add(const std::string &node) {
+    // Virtual nodes even out the share of each node
+    for (size_t i = 0; i < vnodes_; i++)
+        ring_[hash64(node + "#" + std::to_string(i))] = node;
+}
+
+std::string HashRing::owner(const std::string &key) const {
+    if (ring_.empty())
+        return "";
+    auto it = ring_.lower_bound(hash64(key));
+    if (it == ring_.end())
+        it = ring_.begin();
+    return it->second;
+}
+
+// ==== RelayFeed ====
+
+RelayFeed::RelayFeed(const std::string &source) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{{"source", source}};
+    frames_metric_ = registry.counter(
+        "relay_frames_total", "Access units sent to edge nodes", labels);
+    bytes_metric_ = registry.counter(
+        "relay_bytes_total", "Access unit bytes sent to edge nodes", labels);
+    dropped_metric_ = registry.counter(
+        "relay_dropped_frames_total",
+        "Access units not sent to a lagging edge node", labels);
+    subscribers_metric_ = registry.gauge(
+        "relay_subscribers", "Edge nodes subscribed to the source", labels);
+}
+
+static void stopSubscriber(int fd, std::thread &thread) {
+    // Unblocks a sender stuck in sendmsg
+    shutdown(fd, SHUT_RDWR);
+    if (thread.joinable())
+        thread.join();
+    close(fd);
+}
+
+RelayFeed::~RelayFeed() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto &sub : subscribers_) {
+        sub->queue.close();
+        stopSubscriber(sub->fd, sub->thread);
+    }
+}
+
+void RelayFeed::addSubscriber(int fd) {
+    auto sub = std::make_unique<Subscriber>(fd);
+    sub->resend_info = true;
+    sub->thread = std::thread(&Subscriber::run, sub.get(), this);
+    std::lock_guard<std::mutex> lock(mtx_);
+    subscribers_.push_back(std::move(sub));
+    active_.store(subscribers_.size(), std::memory_order_relaxed);
+    subscribers_metric_->set(static_cast<double>(subscribers_.size()));
+}
+
+size_t RelayFeed::subscriberCount() {
+    // Edges that went away count as gone even before push() prunes them
+    std::lock_guard<std::mutex> lock(mtx_);
+    return static_cast<size_t>(std::count_if(
+        subscribers_.begin(), subscribers_.end(), [](const auto &sub) {
+            return sub->alive.load(std::memory_order_acquire);
+        }));
+}
+
+void RelayFeed::push(const FramePtr &frame,
+                     const std::vector<uint8_t> &extradata) {
+    if (active_.load(std::memory_order_relaxed) == 0)
+        return;
+    std::lock_guard<std::mutex> lock(mtx_);
+
+    // Edges that went away: their sender already exited
+    for (auto it = subscribers_.begin(); it != subscribers_.end();) {
+        if ((*it)->alive.load(std::memory_order_acquire)) {
+            ++it;
+            continue;
+        }
+        (*it)->queue.close();
+        stopSubscriber((*it)->fd, (*it)->thread);
+        it = subscribers_.erase(it);
+    }
+    active_.store(subscribers_.size(), std::memory_order_relaxed);
+    subscribers_metric_->set(static_cast<double>(subscribers_.size()));
+
+    if (!info_ || info_->codec != frame->codecId() ||
+        info_->extradata != extradata) {
+        auto info = std::make_shared<StreamInfo>();
+        info->codec = frame->codecId();
+        info->extradata = extradata;
+        info_ = std::move(info);
+        for (auto &sub : subscribers_) {
+            if (sub->resend_info)
+                continue; // goes out before its next keyframe anyway
+            if (!sub->queue.tryPush({nullptr, info_})) {
+                sub->resend_info = true;
+                sub->waiting_keyframe = true;
+            }
+        }
+    }
+    for (auto &sub : subscribers_) {
+        if (!sub->offer(frame, info_))
+            dropped_metric_->add();
+    }
+}
+
+bool RelayFeed::Subscriber::offer(
+    const FramePtr &frame, const std::shared_ptr<const StreamInfo> &info) {
+    // A new or lagging edge resumes on a keyframe, so its decoder never
+    // sees a broken reference chain
+    if (waiting_keyframe) {
+        if (!frame->isKeyframe())
+            return false;
+        if (resend_info && !queue.tryPush({nullptr, info}))
+            return false;
+        resend_info = false;
+        waiting_keyframe = false;
+    }
+    if (!queue.tryPush({frame, nullptr})) {
+        waiting_keyframe = true;
+        return false;
+    }
+    return true;
+}
+
+void RelayFeed::Subscriber::run(RelayFeed *feed) {
+    Item item;
+    while (queue.pop(item)) {
+        uint8_t header[5 + 9];
+        iovec iov[2];
+        size_t prefix;
+        if (item.info) {
+            const auto &extra = item.info->extradata;
+            header[0] = static_cast<uint8_t>(RelayClient::Type::Info);
+            putU32(header + 1, uint32_t(4 + extra.size()));
+            putU32(header + 5, uint32_t(item.info->codec));
+            prefix = 5 + 4;
+            iov[1].iov_base = const_cast<uint8_t *>(extra.data());
+            iov[1].iov_len = extra.size();
+        } else {
+            const auto &frame = item.frame;
+            header[0] = static_cast<uint8_t>(RelayClient::Type::Frame);
+            putU32(header + 1, uint32_t(9 + frame->size()));
+            header[5] = frame->isKeyframe() ? 1 : 0;
+            putU64(header + 6, static_cast<uint64_t>(frame->pts()));
+            prefix = 5 + 9;
+            iov[1].iov_base = const_cast<uint8_t *>(frame->data());
+            iov[1].iov_len = frame->size();
+        }
+        iov[0].iov_base = header;
+        iov[0].iov_len = prefix;
+        if (!sendAll(fd, iov, 2))
+            break;
+        if (item.frame) {
+            feed->frames_metric_->add();
+            feed->bytes_metric_->add(item.frame->size());
+        }
+        item = {};
+    }
+    alive.store(false, std::memory_order_release);
+}
+
+// ==== RelayServer ====
+
+RelayServer::RelayServer(uint16_t port, Subscribe subscribe)
+    : subscribe_(std::move(subscribe)) {
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (fd < 0 ||
+        bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0 ||
+        listen(fd, 64) < 0) {
+        std::cerr << "[Relay] Cannot listen on port " << port << ": "
+                  << strerror(errno) << "\n";
+        if (fd >= 0)
+            close(fd);
+        return;
+    }
+    listen_fd_ = fd;
+    thread_ = std::thread(&RelayServer::acceptLoop, this);
+    std::cout << "[Relay] Listening on port " << port << "\n";
+}
+
+RelayServer::~RelayServer() {
+    running_ = false;
+    if (listen_fd_ >= 0) {
+        // Wakes accept()
+        shutdown(listen_fd_, SHUT_RDWR);
+        if (thread_.joinable())
+            thread_.join();
+        close(listen_fd_);
+    }
+}
+
+void RelayServer::acceptLoop() {
+    while (running_) {
+        int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (!running_)
+                break;
+            continue;
+        }
+        // Subscription: short deadline so a silent peer cannot hold up
+        // the next edge
+        timeval timeout{2, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        char magic[4];
+        uint8_t len[2];
+        std::string url;
+        bool ok = recvAll(fd, magic, sizeof(magic)) &&
+                  memcmp(magic, kMagic, sizeof(kMagic)) == 0 &&
+                  recvAll(fd, len, sizeof(len));
+        if (ok) {
+            url.resize((size_t(len[0]) << 8) | len[1]);
+            ok = !url.empty() && recvAll(fd, &url[0], url.size());
+        }
+        if (!ok) {
+            std::cerr << "[Relay] Bad subscription, closing\n";
+            close(fd);
+            continue;
+        }
+        timeout = {0, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        std::cout << "[Relay] Edge subscribed: " << redactCredentials(url)
+                  << "\n";
+        subscribe_(url, fd);
+    }
+}
+
+// ==== RelayClient ====
+
+RelayClient::RelayClient(const RelayEndpoint &origin, const std::string &url)
+    : origin_(origin), url_(url) {}
+
+RelayClient::~RelayClient() {
+    int fd = fd_.exchange(-1);
+    if (fd >= 0)
+        close(fd);
+}
+
+bool RelayClient::connect() {
+    if (url_.size() > 0xffff)
+        return false;
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    std::string port = std::to_string(origin_.port);
+    if (getaddrinfo(origin_.host.c_str(), port.c_str(), &hints, &res) != 0 ||
+        !res) {
+        std::cerr << "[Relay] Cannot resolve " << origin_.str() << "\n";
+        return false;
+    }
+    int fd = socket(res->ai_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    // Connect deadline (Linux applies SO_SNDTIMEO to connect)
+    timeval timeout{5, 0};
+    if (fd >= 0)
+        setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    bool ok = fd >= 0 && ::connect(fd, res->ai_addr, res->ai_addrlen) == 0;
+    freeaddrinfo(res);
+    if (!ok) {
+        std::cerr << "[Relay] Cannot connect to " << origin_.str() << ": "
+                  << strerror(errno) << "\n";
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+
+    uint8_t len[2] = {uint8_t(url_.size() >> 8), uint8_t(url_.size())};
+    iovec iov[3] = {{const_cast<char *>(kMagic), sizeof(kMagic)},
+                    {len, sizeof(len)},
+                    {const_cast<char *>(url_.data()), url_.size()}};
+    if (!sendAll(fd, iov, 3)) {
+        close(fd);
+        return false;
+    }
+    // Reconnect: the previous connection is done with
+    int old = fd_.exchange(fd);
+    if (old >= 0)
+        close(old);
+    return true;
+}
+
+bool RelayClient::read(Message &msg) {
+    int fd = fd_.load();
+    uint8_t header[5 + 9];
+    if (fd < 0 || !recvAll(fd, header, 5))
+        return false;
+    uint32_t size = getU32(header + 1);
+    size_t prefix;
+    switch (static_cast<Type>(header[0])) {
+    case Type::Info:
+        prefix = 4;
+        break;
+    case Type::Frame:
+        prefix = 9;
+        break;
+    default:
+        std::cerr << "[Relay] Unknown message type " << int(header[0]) << "\n";
+        return false;
+    }
+    if (size < prefix || size > kMaxMessage ||
+        !recvAll(fd, header + 5, prefix))
+        return false;
+    msg.type = static_cast<Type>(header[0]);
+    if (msg.type == Type::Info) {
+        msg.codec = static_cast<AVCodecID>(getU32(header + 5));
+    } else {
+        msg.keyframe = (header[5] & 1) != 0;
+        msg.pts = static_cast<int64_t>(getU64(header + 6));
+    }
+    msg.data.resize(size - prefix);
+    return msg.data.empty() || recvAll(fd, msg.data.data(), msg.data.size());
+}
+
+void RelayClient::interrupt() {
+    int fd = fd_.load();
+    if (fd >= 0)
+        shutdown(fd, SHUT_RDWR);
+}
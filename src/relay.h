@@ -0,0 +1,145 @@
+#pragma once
+#include "bounded_queue.h"
+#include "media_frame.h"
+#include "metrics.h"
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Origin/edge relay. The node a camera URL hashes to (origin) is the only
+// one pulling it; every other node (edge) subscribes to the origin over TCP
+// and gets the already parsed access units, which it paces, transcodes and
+// fans out locally.
+//
+// Wire format, all integers big endian:
+//   edge → origin   "R2W1" | u16 url length | url
+//   origin → edge   u8 type | u32 payload length | payload
+//     type 1 info:  u32 AVCodecID | extradata (sent first and on change)
+//     type 2 frame: u8 flags (1: keyframe) | i64 pts (90kHz, -1) | Annex-B
+
+// host:port
+struct RelayEndpoint {
+    std::string host;
+    uint16_t port = 0;
+
+    static bool parse(const std::string &spec, RelayEndpoint &out);
+    std::string str() const { return host + ":" + std::to_string(port); }
+};
+
+// Consistent hashing of URLs onto nodes: adding or removing a node only
+// moves the URLs that hashed to it. Every node must see the same list.
+class HashRing {
+public:
+    explicit HashRing(size_t vnodes = 128);
+
+    void add(const std::string &node);
+    // Owning node, empty if the ring is empty
+    std::string owner(const std::string &key) const;
+    bool empty() const { return ring_.empty(); }
+
+private:
+    size_t vnodes_;
+    std::map<uint64_t, std::string> ring_;
+};
+
+// Origin side of one source: copies the reader's access units to the edges
+// subscribed to it. The reader only tries to queue; each edge has its own
+// sender thread and drops to the next keyframe if it falls behind.
+class RelayFeed {
+public:
+    explicit RelayFeed(const std::string &source);
+    ~RelayFeed();
+
+    // Reader thread. extradata: the reader's current SPS/PPS (VPS)
+    void push(const FramePtr &frame, const std::vector<uint8_t> &extradata);
+    // Take over a connected socket that already sent its subscription
+    void addSubscriber(int fd);
+    size_t subscriberCount();
+
+private:
+    struct StreamInfo {
+        AVCodecID codec = AV_CODEC_ID_NONE;
+        std::vector<uint8_t> extradata;
+    };
+    struct Item {
+        FramePtr frame;                          // or
+        std::shared_ptr<const StreamInfo> info;  // stream info
+    };
+    struct Subscriber {
+        explicit Subscriber(int fd) : fd(fd), queue(256) {}
+        void run(RelayFeed *feed);
+        // Reader thread, feed locked. False if the frame was not queued
+        bool offer(const FramePtr &frame,
+                   const std::shared_ptr<const StreamInfo> &info);
+
+        int fd;
+        BoundedQueue<Item> queue;
+        bool waiting_keyframe = true; // reader thread
+        bool resend_info = false;     // reader thread
+        std::atomic<bool> alive{true};
+        std::thread thread;
+    };
+
+    std::vector<std::unique_ptr<Subscriber>> subscribers_;
+    std::shared_ptr<const StreamInfo> info_;
+    std::atomic<size_t> active_{0}; // skip the lock while nobody listens
+    std::mutex mtx_;
+
+    std::shared_ptr<Counter> frames_metric_;
+    std::shared_ptr<Counter> bytes_metric_;
+    std::shared_ptr<Counter> dropped_metric_;
+    std::shared_ptr<Gauge> subscribers_metric_;
+};
+
+// Origin side: accepts edge connections. subscribe gets the requested URL
+// and the socket, which it owns from then on (close it to refuse).
+class RelayServer {
+public:
+    using Subscribe = std::function<void(const std::string &url, int fd)>;
+
+    RelayServer(uint16_t port, Subscribe subscribe);
+    ~RelayServer();
+
+    bool listening() const { return listen_fd_ >= 0; }
+
+private:
+    void acceptLoop();
+
+    int listen_fd_ = -1;
+    Subscribe subscribe_;
+    std::atomic<bool> running_{true};
+    std::thread thread_;
+};
+
+// Edge side: subscription to one URL on its origin. Blocking; interrupt()
+// from another thread makes a pending read() fail.
+class RelayClient {
+public:
+    enum class Type : uint8_t { Info = 1, Frame = 2 };
+    struct Message {
+        Type type = Type::Frame;
+        AVCodecID codec = AV_CODEC_ID_NONE; // info
+        bool keyframe = false;              // frame
+        int64_t pts = -1;                   // frame
+        std::vector<uint8_t> data;          // extradata or access unit
+    };
+
+    RelayClient(const RelayEndpoint &origin, const std::string &url);
+    ~RelayClient();
+
+    bool connect();
+    bool read(Message &msg);
+    void interrupt();
+    const RelayEndpoint &origin() const { return origin_; }
+
+private:
+    RelayEndpoint origin_;
+    std::string url_;
+    std::atomic<int> fd_{-1};
+};
@@ -0,0 +1,112 @@
+#include "rtcp_feedback.h"
+#include <algorithm>
+#include <chrono>
+
+// RTCP packet types (RFC 3550, RFC 4585)
+static constexpr uint8_t kSenderReport = 200;
+static constexpr uint8_t kReceiverReport = 201;
+static constexpr uint8_t kTransportFeedback = 205;
+static constexpr uint8_t kPayloadFeedback = 206;
+// Feedback message types
+static constexpr uint8_t kFmtNack = 1;
+static constexpr uint8_t kFmtPli = 1;
+static constexpr uint8_t kFmtFir = 4;
+static constexpr uint8_t kFmtAfb = 15; // REMB rides on application layer FB
+
+static uint32_t read32(const uint8_t *p) {
+    return uint32_t(p[0]) << 24 | uint32_t(p[1]) << 16 | uint32_t(p[2]) << 8 |
+           p[3];
+}
+
+RtcpFeedbackHandler::RtcpFeedbackHandler(uint32_t ssrc, Listener listener)
+    : ssrc_(ssrc), listener_(std::move(listener)) {}
+
+double RtcpFeedbackHandler::roundTripSeconds(const ReportBlock &rb) {
+    if (rb.last_sr == 0)
+        return -1;
+    // Middle 32 bits of the current NTP time (seconds since 1900, 16.16)
+    static constexpr uint64_t kNtpEpochOffset = 2208988800ULL;
+    auto us = std::chrono::duration_cast<std::chrono::microseconds>(
+                  std::chrono::system_clock::now().time_since_epoch())
+                  .count();
+    uint64_t secs = static_cast<uint64_t>(us / 1000000) + kNtpEpochOffset;
+    uint64_t frac = static_cast<uint64_t>(us % 1000000) * 65536 / 1000000;
+    auto now = static_cast<uint32_t>(secs << 16 | frac);
+    uint32_t rtt = now - rb.last_sr - rb.delay_since_sr;
+    // Anything past 60 s is clock trouble or a stale LSR, not a round trip
+    if (rtt > 60u * 65536)
+        return -1;
+    return rtt / 65536.0;
+}
+
+void RtcpFeedbackHandler::incoming(rtc::message_vector &messages,
+                                   const rtc::message_callback &) {
+    for (const auto &msg : messages) {
+        if (msg && msg->type == rtc::Message::Control)
+            parse(reinterpret_cast<const uint8_t *>(msg->data()), msg->size());
+    }
+}
+
+void RtcpFeedbackHandler::parse(const uint8_t *data, size_t size) {
+    // Walk the compound packet
+    while (size >= 8) {
+        if ((data[0] >> 6) != 2)
+            return;
+        uint8_t count = data[0] & 0x1F; // RC or FMT
+        uint8_t type = data[1];
+        size_t len = (size_t(data[2]) << 8 | data[3]) * 4 + 4;
+        if (len > size)
+            return;
+
+        const uint8_t *blocks = nullptr;
+        if (type == kReceiverReport)
+            blocks = data + 8;
+        else if (type == kSenderReport)
+            blocks = data + 28; // after the 20-byte sender info
+        if (blocks && listener_.on_report) {
+            for (uint8_t i = 0; i < count; i++) {
+                const uint8_t *b = blocks + i * 24;
+                if (b + 24 > data + len)
+                    break;
+                if (read32(b) != ssrc_)
+                    continue;
+                ReportBlock rb;
+                rb.ssrc = read32(b);
+                rb.fraction_lost = b[4] / 256.0;
+                // 24-bit signed
+                int32_t lost = int32_t(read32(b + 4) & 0xFFFFFF);
+                rb.cumulative_lost = lost & 0x800000 ? lost - 0x1000000 : lost;
+                rb.highest_seq = read32(b + 8);
+                rb.jitter = read32(b + 12);
+                rb.last_sr = read32(b + 16);
+                rb.delay_since_sr = read32(b + 20);
+                listener_.on_report(rb);
+            }
+        } else if (type == kPayloadFeedback && len >= 12) {
+            if ((count == kFmtPli || count == kFmtFir) &&
+                listener_.on_keyframe_request) {
+                listener_.on_keyframe_request();
+            } else if (count == kFmtAfb && len >= 20 &&
+                       std::equal(data + 12, data + 16, "REMB") &&
+                       listener_.on_remb) {
+                // Num SSRC (8) | BR Exp (6) | BR Mantissa (18)
+                uint8_t exp = data[17] >> 2;
+                uint64_t mantissa = uint64_t(data[17] & 0x03) << 16 |
+                                    uint64_t(data[18]) << 8 | data[19];
+                listener_.on_remb(exp > 46 ? UINT64_MAX : mantissa << exp);
+            }
+        } else if (type == kTransportFeedback && count == kFmtNack &&
+                   listener_.on_nack) {
+            // FCI: PID (16) | BLP (16), each one lost packet plus a bitmask
+            size_t lost = 0;
+            for (size_t off = 12; off + 4 <= len; off += 4) {
+                uint16_t blp = uint16_t(data[off + 2] << 8 | data[off + 3]);
+                lost += 1 + static_cast<size_t>(__builtin_popcount(blp));
+            }
+            listener_.on_nack(lost);
+        }
+
+        data += len;
+        size -= len;
+    }
+}
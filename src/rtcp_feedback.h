@@ -0,0 +1,44 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+
+#include <rtc/rtc.hpp>
+
+// Media handler that reads the viewer's RTCP feedback: receiver reports,
+// REMB, PLI/FIR and NACK. Messages pass through unchanged, so it can sit
+// anywhere in the chain next to the NACK responder.
+class RtcpFeedbackHandler : public rtc::MediaHandler {
+public:
+    struct ReportBlock {
+        uint32_t ssrc = 0;
+        double fraction_lost = 0; // 0..1 since the previous report
+        int32_t cumulative_lost = 0;
+        uint32_t highest_seq = 0; // extended
+        uint32_t jitter = 0;      // RTP timestamp units
+        uint32_t last_sr = 0;     // LSR: middle 32 bits of our SR's NTP time
+        uint32_t delay_since_sr = 0; // DLSR, 1/65536 s
+    };
+
+    // Round trip from LSR/DLSR against the wall clock our SRs were stamped
+    // with, in seconds; negative if the report has no SR to go by
+    static double roundTripSeconds(const ReportBlock &rb);
+
+    struct Listener {
+        std::function<void(const ReportBlock &)> on_report;
+        std::function<void(uint64_t bitrate)> on_remb; // bps
+        std::function<void()> on_keyframe_request;     // PLI or FIR
+        std::function<void(size_t lost)> on_nack;      // packets asked for
+    };
+
+    // ssrc: our media SSRC, report blocks about other streams are ignored
+    RtcpFeedbackHandler(uint32_t ssrc, Listener listener);
+
+    void incoming(rtc::message_vector &messages,
+                  const rtc::message_callback &send) override;
+
+private:
+    void parse(const uint8_t *data, size_t size);
+
+    uint32_t ssrc_;
+    Listener listener_;
+};
@@ -0,0 +1,165 @@
+#include "rtp_depacketizer.h"
+
+static const uint8_t kStartCode[4] = {0, 0, 0, 1};
+
+RtpDepacketizer::RtpDepacketizer(AVCodecID codec_id) : codec_id_(codec_id) {}
+
+void RtpDepacketizer::push(const uint8_t *data, size_t size) {
+    if (size < 12 || (data[0] >> 6) != 2)
+        return;
+    bool padding = data[0] & 0x20;
+    bool extension = data[0] & 0x10;
+    size_t csrc = data[0] & 0x0F;
+    bool marker = data[1] & 0x80;
+    uint16_t seq = static_cast<uint16_t>(data[2] << 8 | data[3]);
+    uint32_t ts = static_cast<uint32_t>(data[4]) << 24 | data[5] << 16 |
+                  data[6] << 8 | data[7];
+
+    // Lengths come off the network: anything pointing outside the packet
+    // drops it
+    size_t off = 12 + csrc * 4;
+    if (off > size)
+        return;
+    if (extension) {
+        if (off + 4 > size)
+            return;
+        size_t ext = 4 * static_cast<size_t>(data[off + 2] << 8 | data[off + 3]);
+        if (ext > size - off - 4)
+            return;
+        off += 4 + ext;
+    }
+    size_t end = size;
+    if (padding) {
+        size_t pad = data[size - 1];
+        if (pad == 0 || pad > size - off)
+            return;
+        end -= pad;
+    }
+    if (off >= end)
+        return;
+
+    // A gap breaks the fragmented NAL in progress; drop its partial bytes
+    if (have_seq_ && seq != static_cast<uint16_t>(last_seq_ + 1) && in_fu_) {
+        au_.resize(fu_start_);
+        in_fu_ = false;
+    }
+    have_seq_ = true;
+    last_seq_ = seq;
+
+    if (!au_.empty() && ts != au_ts_)
+        flush();
+    if (!have_ts_) {
+        have_ts_ = true;
+    } else {
+        ext_ts_ += static_cast<int32_t>(ts - last_ts_);
+    }
+    last_ts_ = ts;
+    au_ts_ = ts;
+
+    if (codec_id_ == AV_CODEC_ID_HEVC)
+        pushH265(data + off, end - off);
+    else
+        pushH264(data + off, end - off);
+
+    if (marker)
+        flush();
+}
+
+void RtpDepacketizer::appendNal(const uint8_t *nal, size_t size) {
+    au_.insert(au_.end(), kStartCode, kStartCode + 4);
+    au_.insert(au_.end(), nal, nal + size);
+}
+
+void RtpDepacketizer::pushH264(const uint8_t *p, size_t size) {
+    uint8_t type = p[0] & 0x1F;
+    if (type >= 1 && type <= 23) {
+        if (type == 5)
+            au_key_ = true;
+        appendNal(p, size);
+    } else if (type == 24) { // STAP-A
+        size_t i = 1;
+        while (i + 2 <= size) {
+            size_t len = static_cast<size_t>(p[i] << 8 | p[i + 1]);
+            i += 2;
+            if (len == 0 || i + len > size)
+                break;
+            if ((p[i] & 0x1F) == 5)
+                au_key_ = true;
+            appendNal(p + i, len);
+            i += len;
+        }
+    } else if (type == 28 && size > 2) { // FU-A
+        bool start = p[1] & 0x80;
+        bool stop = p[1] & 0x40;
+        uint8_t nal_type = p[1] & 0x1F;
+        if (start) {
+            if (nal_type == 5)
+                au_key_ = true;
+            fu_start_ = au_.size();
+            au_.insert(au_.end(), kStartCode, kStartCode + 4);
+            au_.push_back(static_cast<uint8_t>((p[0] & 0xE0) | nal_type));
+            in_fu_ = true;
+        }
+        if (!in_fu_)
+            return; // missed the start fragment
+        au_.insert(au_.end(), p + 2, p + size);
+        if (stop)
+            in_fu_ = false;
+    }
+}
+
+void RtpDepacketizer::pushH265(const uint8_t *p, size_t size) {
+    if (size < 3)
+        return;
+    uint8_t type = (p[0] >> 1) & 0x3F;
+    auto is_irap = [](uint8_t t) { return t >= 16 && t <= 23; };
+    if (type < 48) {
+        if (is_irap(type))
+            au_key_ = true;
+        appendNal(p, size);
+    } else if (type == 48) { // AP
+        size_t i = 2;
+        while (i + 2 <= size) {
+            size_t len = static_cast<size_t>(p[i] << 8 | p[i + 1]);
+            i += 2;
+            if (len == 0 || i + len > size)
+                break;
+            if (is_irap((p[i] >> 1) & 0x3F))
+                au_key_ = true;
+            appendNal(p + i, len);
+            i += len;
+        }
+    } else if (type == 49) { // FU
+        bool start = p[2] & 0x80;
+        bool stop = p[2] & 0x40;
+        uint8_t nal_type = p[2] & 0x3F;
+        if (start) {
+            if (is_irap(nal_type))
+                au_key_ = true;
+            fu_start_ = au_.size();
+            au_.insert(au_.end(), kStartCode, kStartCode + 4);
+            au_.push_back(static_cast<uint8_t>((p[0] & 0x81) | (nal_type << 1)));
+            au_.push_back(p[1]);
+            in_fu_ = true;
+        }
+        if (!in_fu_)
+            return;
+        au_.insert(au_.end(), p + 3, p + size);
+        if (stop)
+            in_fu_ = false;
+    }
+}
+
+void RtpDepacketizer::flush() {
+    if (in_fu_) { // unterminated fragment
+        au_.resize(fu_start_);
+        in_fu_ = false;
+    }
+    if (!au_.empty() && frame_cb_) {
+        if (auto frame = MediaFrame::copy(au_.data(), au_.size(), codec_id_,
+                                          au_key_, ext_ts_))
+            frame_cb_(frame);
+    }
+    au_.clear();
+    au_key_ = false;
+}
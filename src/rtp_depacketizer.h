@@ -0,0 +1,39 @@
+#pragma once
+#include "media_frame.h"
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+// Reassembles H.264 (RFC 6184) / H.265 (RFC 7798) RTP payloads into
+// Annex-B access units. Handles single NAL, STAP-A/AP and FU-A/FU packets.
+class RtpDepacketizer {
+public:
+    using FrameCallback = std::function<void(const FramePtr &frame)>;
+
+    explicit RtpDepacketizer(AVCodecID codec_id);
+    void setFrameCallback(FrameCallback cb) { frame_cb_ = std::move(cb); }
+
+    // One RTP packet (header included)
+    void push(const uint8_t *data, size_t size);
+
+private:
+    void flush();
+    void appendNal(const uint8_t *nal, size_t size);
+    void pushH264(const uint8_t *payload, size_t size);
+    void pushH265(const uint8_t *payload, size_t size);
+
+    AVCodecID codec_id_;
+    FrameCallback frame_cb_;
+
+    std::vector<uint8_t> au_; // Annex-B access unit being assembled
+    uint32_t au_ts_ = 0;
+    bool au_key_ = false;
+    bool in_fu_ = false;      // fragmented NAL in progress
+    size_t fu_start_ = 0;     // offset of that NAL's start code in au_
+
+    bool have_seq_ = false;
+    uint16_t last_seq_ = 0;
+    bool have_ts_ = false;
+    uint32_t last_ts_ = 0;
+    int64_t ext_ts_ = 0; // unwrapped 90kHz timestamp
+};
@@ -0,0 +1,429 @@
+#include "rtp_fanout.h"
+#include "webrtc_session.h"
+#include <algorithm>
+#include <iostream>
+
+RtpFanout::RtpFanout(const std::string &source, size_t rendition, bool hevc)
+    : packetizer_(1400, hevc), hevc_(hevc) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{
+        {"source", source},
+        {"rendition", hevc ? "hevc" : std::to_string(rendition)}};
+    frames_metric_ = registry.counter("fanout_frames_total",
+                                      "Frames packetized for the viewers",
+                                      labels);
+    packets_metric_ = registry.counter("fanout_packets_total",
+                                       "RTP packets produced", labels);
+    bytes_metric_ = registry.counter("fanout_bytes_total",
+                                     "RTP bytes produced", labels);
+    packetize_metric_ = registry.histogram(
+        "fanout_packetize_seconds", "Time to packetize one frame", labels);
+    sessions_metric_ =
+        registry.gauge("fanout_sessions", "Attached viewers", labels);
+}
+
+void RtpFanout::addSession(std::shared_ptr<WebRTCSession> session) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    sessions_.push_back(std::move(session));
+    sessions_metric_->set(static_cast<double>(sessions_.size()));
+}
+
+bool RtpFanout::removeSession(const std::shared_ptr<WebRTCSession> &session) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = std::find(sessions_.begin(), sessions_.end(), session);
+    if (it == sessions_.end())
+        return false;
+    sessions_.erase(it);
+    sessions_metric_->set(static_cast<double>(sessions_.size()));
+    return true;
+}
+
+std::vector<std::shared_ptr<WebRTCSession>> RtpFanout::takeSessions() {
+    std::vector<std::shared_ptr<WebRTCSession>> taken;
+    std::lock_guard<std::mutex> lock(mtx_);
+    taken.swap(sessions_);
+    sessions_metric_->set(0);
+    return taken;
+}
+
+size_t RtpFanout::sessionCount() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return sessions_.size();
+}
+
+size_t RtpFanout::gopBytes() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return gop_.bytes();
+}
+
+void RtpFanout::clearGop() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    gop_.clear();
+}
+
+int RtpFanout::minEstimateKbps() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    int lowest = 0;
+    for (const auto &sess : sessions_) {
+        int kbps = sess->estimateKbps();
+        if (kbps > 0 && (lowest == 0 || kbps < lowest))
+            lowest = kbps;
+    }
+    return lowest;
+}
+
+uint32_t RtpFanout::nextTimestamp(int64_t pts) {
+    if (pts < 0) {
+        timestamp_ += 3000; // 90kHz / 30fps
+        return timestamp_;
+    }
+    if (last_pts_ >= 0) {
+        int64_t delta = pts - last_pts_;
+        // 乱序或突变 > 5秒，回退到估算值
+        if (delta < 0 || delta > 90000 * 5) {
+            std::cout << "[RtpFanout] Timestamp jump detected! delta=" << delta
+                      << "\n";
+            delta = 3000;
+        }
+        timestamp_ += static_cast<uint32_t>(delta);
+    }
+    last_pts_ = pts;
+    return timestamp_;
+}
+
+void RtpFanout::deliver(const FramePtr &frame) {
+    auto start = std::chrono::steady_clock::now();
+    auto rtp = std::allocate_shared<RtpFrame>(PoolAllocator<RtpFrame>());
+    rtp->timestamp = nextTimestamp(frame->pts());
+    rtp->is_keyframe = frame->isKeyframe();
+    rtp->codec = hevc_ ? RtpCodec::H265 : RtpCodec::H264;
+    rtp->pts = frame->pts();
+
+    // Packetize once: NALs split and FU-A fragmented into pooled storage
+    packetizer_.packetize(*frame, rtp->timestamp, *rtp);
+    packetize_metric_->recordSince(start);
+    if (frame->trace()) {
+        rtp->trace = frame->trace();
+        rtp->trace->mark(TraceStage::Packetized);
+    }
+    frames_metric_->add();
+    packets_metric_->add(rtp->count());
+    bytes_metric_->add(rtp->bytes);
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    for (auto &sess : sessions_)
+        sess->enqueue(rtp, gop_.frames());
+    gop_.push(rtp);
+}
+
+// Camera codecs a browser can take without a decode
+static bool passthroughCodec(AVCodecID codec_id, RtpCodec &codec) {
+    switch (codec_id) {
+    case AV_CODEC_ID_OPUS:
+        codec = RtpCodec::Opus;
+        return true;
+    case AV_CODEC_ID_PCM_MULAW:
+        codec = RtpCodec::PCMU;
+        return true;
+    case AV_CODEC_ID_PCM_ALAW:
+        codec = RtpCodec::PCMA;
+        return true;
+    default:
+        return false;
+    }
+}
+
+AudioFanout::AudioFanout(const std::string &source) : source_(source) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{{"source", source}};
+    frames_metric_ = registry.counter("audio_fanout_frames_total",
+                                      "Audio frames packetized for the viewers",
+                                      labels);
+    passthrough_metric_ = registry.counter(
+        "audio_fanout_passthrough_frames_total",
+        "Audio frames sent in the camera's own codec", labels);
+    sessions_metric_ = registry.gauge("audio_fanout_sessions",
+                                      "Viewers with an audio track", labels);
+}
+
+void AudioFanout::addSession(std::shared_ptr<WebRTCSession> session) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    sessions_.push_back(std::move(session));
+    sessions_metric_->set(static_cast<double>(sessions_.size()));
+}
+
+bool AudioFanout::removeSession(const std::shared_ptr<WebRTCSession> &session) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    auto it = std::find(sessions_.begin(), sessions_.end(), session);
+    if (it == sessions_.end())
+        return false;
+    sessions_.erase(it);
+    sessions_metric_->set(static_cast<double>(sessions_.size()));
+    return true;
+}
+
+size_t AudioFanout::sessionCount() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    return sessions_.size();
+}
+
+// One codec frame, one packet: audio frames are far below the MTU
+RtpFramePtr AudioFanout::packetize(const MediaFrame &frame, RtpCodec codec) {
+    auto rtp = std::allocate_shared<RtpFrame>(PoolAllocator<RtpFrame>());
+    uint32_t ts = static_cast<uint32_t>(frame.pts());
+    uint8_t header[12] = {0x80,
+                          0,
+                          static_cast<uint8_t>(seq_ >> 8),
+                          static_cast<uint8_t>(seq_),
+                          static_cast<uint8_t>(ts >> 24),
+                          static_cast<uint8_t>(ts >> 16),
+                          static_cast<uint8_t>(ts >> 8),
+                          static_cast<uint8_t>(ts),
+                          0,
+                          0,
+                          0,
+                          0};
+    seq_++;
+    rtp->data.reserve(sizeof(header) + frame.size());
+    rtp->data.insert(rtp->data.end(), header, header + sizeof(header));
+    rtp->data.insert(rtp->data.end(), frame.data(), frame.data() + frame.size());
+    rtp->ends.push_back(static_cast<uint32_t>(rtp->data.size()));
+    rtp->bytes = rtp->data.size();
+    rtp->timestamp = ts;
+    rtp->codec = codec;
+    rtp->pts = frame.pts();
+    frames_metric_->add();
+    return rtp;
+}
+
+void AudioFanout::deliver(const FramePtr &frame, const AudioInfo &info) {
+    RtpCodec source_codec = RtpCodec::PCMU;
+    bool passthrough = passthroughCodec(frame->codecId(), source_codec);
+    // G.711 target for a session that cannot take the camera's codec:
+    // 0 PCMU, 1 PCMA, -1 none (an Opus-only offer, nothing to encode with)
+    auto target = [&](const WebRTCSession &sess) {
+        if (passthrough && sess.audioPayloadType(source_codec) > 0)
+            return -2; // passthrough
+        if (sess.audioPayloadType(RtpCodec::PCMU) > 0)
+            return 0;
+        if (sess.audioPayloadType(RtpCodec::PCMA) > 0)
+            return 1;
+        return -1;
+    };
+
+    std::lock_guard<std::mutex> lock(mtx_);
+    RtpFramePtr direct;
+    bool wanted[2] = {false, false};
+    for (auto &sess : sessions_) {
+        int t = target(*sess);
+        if (t == -2) {
+            if (!direct) {
+                direct = packetize(*frame, source_codec);
+                passthrough_metric_->add();
+            }
+            sess->enqueueAudio(direct);
+        } else if (t >= 0) {
+            wanted[t] = true;
+        }
+    }
+
+    static constexpr AVCodecID kTargets[2] = {AV_CODEC_ID_PCM_MULAW,
+                                              AV_CODEC_ID_PCM_ALAW};
+    static constexpr RtpCodec kCodecs[2] = {RtpCodec::PCMU, RtpCodec::PCMA};
+    for (int t = 0; t < 2; t++) {
+        auto &transcoder = transcoders_[t];
+        if (!wanted[t]) {
+            transcoder.reset(); // last viewer needing it left
+            continue;
+        }
+        if (!transcoder || transcoder->input() != info.codec_id) {
+            transcoder.reset();
+            if (info.codec_id == failed_input_)
+                continue;
+            auto created = std::make_unique<AudioTranscoder>(kTargets[t],
+                                                             source_);
+            if (!created->init(info)) {
+                failed_input_ = info.codec_id;
+                continue;
+            }
+            transcoder = std::move(created);
+        }
+        transcoded_.clear();
+        transcoder->transcode(frame, transcoded_);
+        for (const auto &g711 : transcoded_) {
+            auto rtp = packetize(*g711, kCodecs[t]);
+            for (auto &sess : sessions_)
+                if (target(*sess) == t)
+                    sess->enqueueAudio(rtp);
+        }
+    }
+}
+
+RenditionSet::RenditionSet(size_t count, const std::string &source) {
+    for (size_t i = 0; i < std::max<size_t>(count, 1); i++)
+        fanouts_.push_back(std::make_unique<RtpFanout>(source, i));
+    hevc_ = std::make_unique<RtpFanout>(source, 0, true);
+    audio_ = std::make_unique<AudioFanout>(source);
+    last_report_.resize(fanouts_.size());
+    report_pending_.resize(fanouts_.size());
+}
+
+void RenditionSet::addSession(const std::shared_ptr<WebRTCSession> &session,
+                              size_t index, bool pinned) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (session->hasAudio())
+        audio_->addSession(session);
+    if (collapsed_) {
+        index = 0;
+        session->setRenditionPolicy({}, nullptr); // nothing to switch to
+    } else if (session->acceptsHevc() && !pinned) {
+        // The untranscoded stream is the best rendition there is. Only
+        // until the codec is known: collapse() moves it if it is H.264.
+        session->setRenditionPolicy({}, nullptr);
+        session->setRendition(WebRTCSession::kPassthrough);
+        hevc_->addSession(session);
+        return;
+    }
+    index = std::min(index, fanouts_.size() - 1);
+    session->setRendition(index);
+    fanouts_[index]->addSession(session);
+}
+
+bool RenditionSet::switchSession(
+    const std::shared_ptr<WebRTCSession> &session, size_t index) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (collapsed_)
+        return false;
+    constexpr size_t kPassthrough = WebRTCSession::kPassthrough;
+    if (index == kPassthrough && !session->acceptsHevc())
+        return false;
+    if (index != kPassthrough)
+        index = std::min(index, fanouts_.size() - 1);
+    size_t current = session->rendition();
+    if (current == index)
+        return true;
+    auto at = [this](size_t i) -> RtpFanout & {
+        return i == kPassthrough ? *hevc_ : *fanouts_[i];
+    };
+    // Detached from both fanouts here, so no producer is touching it
+    if (!at(current).removeSession(session))
+        return false;
+    if (current != kPassthrough) {
+        report_pending_[current] = true; // its weakest viewer may have left
+        flushEstimatesLocked();
+    }
+    session->resync();
+    if (index == kPassthrough)
+        session->setRenditionPolicy({}, nullptr);
+    session->setRendition(index);
+    at(index).addSession(session);
+    auto name = [](size_t i) {
+        return i == kPassthrough ? std::string("hevc") : std::to_string(i);
+    };
+    std::cout << "[RtpFanout] Session " << session->id() << " rendition "
+              << name(current) << " -> " << name(index) << "\n";
+    return true;
+}
+
+void RenditionSet::collapse() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (collapsed_)
+        return;
+    collapsed_ = true;
+    // Nothing was delivered before the codec was known, so the sessions
+    // have not started and can simply move
+    auto move = [this](RtpFanout &fanout) {
+        for (auto &session : fanout.takeSessions()) {
+            session->setRendition(0);
+            session->setRenditionPolicy({}, nullptr);
+            fanouts_[0]->addSession(std::move(session));
+        }
+    };
+    for (auto &fanout : fanouts_)
+        move(*fanout);
+    move(*hevc_);
+}
+
+bool RenditionSet::removeSession(
+    const std::shared_ptr<WebRTCSession> &session) {
+    // Under the set's lock, so a concurrent switch cannot re-add it
+    std::lock_guard<std::mutex> lock(mtx_);
+    audio_->removeSession(session);
+    for (size_t i = 0; i < fanouts_.size(); i++) {
+        if (fanouts_[i]->removeSession(session)) {
+            report_pending_[i] = true;
+            flushEstimatesLocked();
+            return true;
+        }
+    }
+    return hevc_->removeSession(session);
+}
+
+size_t RenditionSet::sessionCount() {
+    return ladderSessions() + hevc_->sessionCount();
+}
+
+size_t RenditionSet::ladderSessions() {
+    size_t count = 0;
+    for (auto &fanout : fanouts_)
+        count += fanout->sessionCount();
+    return count;
+}
+
+size_t RenditionSet::gopBytes() {
+    size_t bytes = hevc_->gopBytes();
+    for (auto &fanout : fanouts_)
+        bytes += fanout->gopBytes();
+    return bytes;
+}
+
+void RenditionSet::clearLadderGops() {
+    for (auto &fanout : fanouts_)
+        fanout->clearGop();
+}
+
+void RenditionSet::setBitrateListener(BitrateListener listener) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    bitrate_listener_ = std::move(listener);
+}
+
+void RenditionSet::setKeyframeListener(KeyframeListener listener) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    keyframe_listener_ = std::move(listener);
+}
+
+void RenditionSet::requestKeyframe(size_t rendition) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (keyframe_listener_ && !collapsed_ && rendition < fanouts_.size())
+        keyframe_listener_(rendition);
+}
+
+void RenditionSet::reportEstimate(size_t rendition) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    if (rendition >= fanouts_.size())
+        return;
+    report_pending_[rendition] = true;
+    flushEstimatesLocked();
+}
+
+void RenditionSet::flushEstimates() {
+    std::lock_guard<std::mutex> lock(mtx_);
+    flushEstimatesLocked();
+}
+
+void RenditionSet::flushEstimatesLocked() {
+    if (!bitrate_listener_)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < fanouts_.size(); i++) {
+        if (!report_pending_[i] ||
+            now - last_report_[i] < std::chrono::seconds(1))
+            continue;
+        report_pending_[i] = false;
+        last_report_[i] = now;
+        // Shared encoder: the weakest viewer on it sets the pace, the
+        // others can move up a rendition. Read now, so the latest counts.
+        if (int kbps = fanouts_[i]->minEstimateKbps())
+            bitrate_listener_(i, kbps);
+    }
+}
@@ -0,0 +1,163 @@
+#pragma once
+#include "audio_transcoder.h"
+#include "gop_cache.h"
+#include "media_frame.h"
+#include "metrics.h"
+#include "rtp_frame.h"
+#include "rtp_packetizer.h"
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+class WebRTCSession;
+
+// Per-source packetization stage: runs the H.264 (or, for passthrough,
+// H.265) packetizer once per frame and hands the same packets to every
+// attached session.
+class RtpFanout {
+public:
+    // source, rendition: metric labels; hevc: frames are H.265
+    explicit RtpFanout(const std::string &source = "", size_t rendition = 0,
+                       bool hevc = false);
+
+    void addSession(std::shared_ptr<WebRTCSession> session);
+    // Detach a session; once this returns no deliver() touches it anymore
+    bool removeSession(const std::shared_ptr<WebRTCSession> &session);
+    std::vector<std::shared_ptr<WebRTCSession>> takeSessions();
+    size_t sessionCount();
+    size_t gopBytes();
+    // Forget the cached GOP, e.g. when the producer pauses
+    void clearGop();
+    // Lowest bandwidth estimate among the sessions, 0 if none has one
+    int minEstimateKbps();
+
+    // Packetize Annex-B frame and send to all sessions. Sessions that have
+    // not started yet first get the cached GOP, then the live frame.
+    // Frame pts: 90kHz timestamp from RTSP, or -1 for auto-increment
+    void deliver(const FramePtr &frame);
+
+private:
+    uint32_t nextTimestamp(int64_t pts);
+
+    RtpPacketizer packetizer_;
+    bool hevc_;
+    uint32_t timestamp_ = 0;
+    int64_t last_pts_ = -1;
+
+    GopCache gop_;
+    std::vector<std::shared_ptr<WebRTCSession>> sessions_;
+    std::mutex mtx_;
+
+    std::shared_ptr<Counter> frames_metric_;
+    std::shared_ptr<Counter> packets_metric_;
+    std::shared_ptr<Counter> bytes_metric_;
+    std::shared_ptr<Histogram> packetize_metric_;
+    std::shared_ptr<Gauge> sessions_metric_;
+};
+
+// Per-source audio stage, on the pacer thread. Camera frames go out as they
+// are, one RTP packet each, to the viewers that offered the camera's codec
+// (Opus, PCMU, PCMA); the others get G.711 from an AudioTranscoder that
+// exists only while one of them is attached.
+class AudioFanout {
+public:
+    // source: metric label
+    explicit AudioFanout(const std::string &source = "");
+
+    void addSession(std::shared_ptr<WebRTCSession> session);
+    bool removeSession(const std::shared_ptr<WebRTCSession> &session);
+    size_t sessionCount();
+
+    // One audio frame (90kHz PTS); info: the source's audio stream
+    void deliver(const FramePtr &frame, const AudioInfo &info);
+
+private:
+    RtpFramePtr packetize(const MediaFrame &frame, RtpCodec codec);
+
+    std::string source_;
+    uint16_t seq_ = 0;
+    std::vector<std::shared_ptr<WebRTCSession>> sessions_;
+    // Indexed by target: 0 PCMU, 1 PCMA
+    std::unique_ptr<AudioTranscoder> transcoders_[2];
+    AVCodecID failed_input_ = AV_CODEC_ID_NONE; // no transcoder for it
+    std::vector<FramePtr> transcoded_;          // reused per frame
+    std::mutex mtx_;
+
+    std::shared_ptr<Counter> frames_metric_;
+    std::shared_ptr<Counter> passthrough_metric_;
+    std::shared_ptr<Gauge> sessions_metric_;
+};
+
+// A source's outputs: one RtpFanout per ladder rendition, 0 being the
+// highest. Sessions move between them when their rendition changes. H.265
+// sources also get a passthrough fanout for viewers that can decode H.265;
+// the ladder is then only needed while H.264-only viewers are attached.
+// Viewers that negotiated audio are also on the source's AudioFanout,
+// whatever their rendition.
+class RenditionSet {
+public:
+    // source: metric label (camera URL without credentials)
+    explicit RenditionSet(size_t count, const std::string &source = "");
+
+    size_t size() const { return fanouts_.size(); }
+    RtpFanout &fanout(size_t index) { return *fanouts_[index]; }
+    RtpFanout &hevc() { return *hevc_; }
+    AudioFanout &audio() { return *audio_; }
+
+    // Attach a session on rendition `index` (clamped to the ladder).
+    // Unless pinned there, sessions that accept H.265 go to the passthrough
+    // fanout instead; collapse() moves them back if the source is H.264.
+    void addSession(const std::shared_ptr<WebRTCSession> &session,
+                    size_t index, bool pinned = false);
+    // Move a session (index may be WebRTCSession::kPassthrough for one
+    // that accepts H.265); it restarts on the new rendition's cached GOP
+    bool switchSession(const std::shared_ptr<WebRTCSession> &session,
+                       size_t index);
+    // The source is H.264 and passed through: only rendition 0 exists
+    // from now on
+    void collapse();
+    // Detach a session from whichever rendition it is on
+    bool removeSession(const std::shared_ptr<WebRTCSession> &session);
+    size_t sessionCount();
+    // Sessions on the ladder, i.e. those the transcoder is running for
+    size_t ladderSessions();
+    size_t gopBytes(); // cached GOPs of all renditions
+    // The transcoder paused: its GOPs would restart viewers on stale frames
+    void clearLadderGops();
+
+    // A viewer's estimate changed: at most once a second per rendition,
+    // hand the rendition's lowest estimate to the listener (the encoder).
+    // Changes inside the window are not lost: the latest goes out when it
+    // ends, on the next report or flushEstimates(). A viewer leaving a
+    // rendition counts as a change.
+    using BitrateListener = std::function<void(size_t rendition, int kbps)>;
+    void setBitrateListener(BitrateListener listener);
+    void reportEstimate(size_t rendition);
+    // Periodic (lifecycle tick): send what the window held back
+    void flushEstimates();
+
+    // A viewer sent PLI/FIR: hand its rendition to the listener (the
+    // encoder, which coalesces and rate-limits). Passthrough renditions
+    // are the camera's own GOP and cannot be asked for an IDR.
+    using KeyframeListener = std::function<void(size_t rendition)>;
+    void setKeyframeListener(KeyframeListener listener);
+    void requestKeyframe(size_t rendition);
+
+private:
+    // Under mtx_: report pending renditions whose window has ended
+    void flushEstimatesLocked();
+
+    std::vector<std::unique_ptr<RtpFanout>> fanouts_;
+    std::unique_ptr<RtpFanout> hevc_;
+    std::unique_ptr<AudioFanout> audio_;
+    std::vector<std::chrono::steady_clock::time_point> last_report_;
+    std::vector<bool> report_pending_;
+    bool collapsed_ = false;
+    BitrateListener bitrate_listener_;
+    KeyframeListener keyframe_listener_;
+    std::mutex mtx_;
+};
@@ -0,0 +1,35 @@
+#pragma once
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "buffer_pool.h"
+#include "frame_trace.h"
+
+// Payload of an RtpFrame; sessions map it to the payload type they
+// negotiated
+enum class RtpCodec : uint8_t { H264, H265, Opus, PCMU, PCMA };
+
+// One access unit packetized into RTP. Headers carry the fan-out's own
+// SSRC/sequence/timestamp; each session rewrites them on send. Packets
+// sit back to back in one pooled buffer, so a frame is two pooled
+// allocations however many packets it has.
+struct RtpFrame {
+    std::vector<uint8_t, PoolAllocator<uint8_t>> data;
+    std::vector<uint32_t, PoolAllocator<uint32_t>> ends; // packet i ends at
+    uint32_t timestamp = 0; // source RTP timestamp (90kHz)
+    size_t bytes = 0;       // sum of packet sizes
+    bool is_keyframe = false;
+    RtpCodec codec = RtpCodec::H264;
+    int64_t pts = -1; // source PTS (90kHz), shared by audio and video
+    TracePtr trace; // sampled frames only, stamped up to Packetized
+
+    size_t count() const { return ends.size(); }
+    const uint8_t *packet(size_t i) const {
+        return data.data() + (i ? ends[i - 1] : 0);
+    }
+    size_t packetSize(size_t i) const {
+        return ends[i] - (i ? ends[i - 1] : 0);
+    }
+};
+using RtpFramePtr = std::shared_ptr<const RtpFrame>;
@@ -0,0 +1,87 @@
+#include "rtp_packetizer.h"
+#include <algorithm>
+
+static constexpr size_t kHeaderSize = 12;
+static constexpr uint8_t kFuA = 28;  // H.264
+static constexpr uint8_t kFuHevc = 49; // H.265
+
+RtpPacketizer::RtpPacketizer(size_t max_payload, bool hevc)
+    : max_payload_(std::max<size_t>(max_payload, 16)), hevc_(hevc) {}
+
+void RtpPacketizer::writeHeader(RtpFrame &rtp, uint32_t timestamp,
+                                bool marker) {
+    const uint8_t header[kHeaderSize] = {
+        0x80,
+        static_cast<uint8_t>((marker ? 0x80 : 0) | 96),
+        static_cast<uint8_t>(seq_ >> 8),
+        static_cast<uint8_t>(seq_),
+        static_cast<uint8_t>(timestamp >> 24),
+        static_cast<uint8_t>(timestamp >> 16),
+        static_cast<uint8_t>(timestamp >> 8),
+        static_cast<uint8_t>(timestamp),
+        0, 0, 0, 1};
+    seq_++;
+    rtp.data.insert(rtp.data.end(), header, header + kHeaderSize);
+}
+
+void RtpPacketizer::packetize(const MediaFrame &frame, uint32_t timestamp,
+                              RtpFrame &rtp) {
+    const uint8_t *d = frame.data();
+    // The frame's NAL index: scanned once, whichever stage asked first
+    const NalList &nals = frame.nals();
+
+    // Fragments carry the NAL header (1 byte H.264, 2 bytes H.265) in
+    // front of the first one only, rebuilt from the FU headers
+    const size_t nal_header = hevc_ ? 2 : 1;
+    const size_t fu_header = nal_header + 1;
+    const size_t fragment = max_payload_ - fu_header;
+
+    // Size everything first: one allocation each for bytes and offsets
+    size_t packets = 0, bytes = 0;
+    for (const NalUnit &nal : nals) {
+        size_t size = nal.size;
+        if (size <= max_payload_) {
+            packets++;
+            bytes += kHeaderSize + size;
+        } else {
+            size_t k = (size - nal_header + fragment - 1) / fragment;
+            packets += k;
+            bytes += k * (kHeaderSize + fu_header) + size - nal_header;
+        }
+    }
+    rtp.data.reserve(bytes);
+    rtp.ends.reserve(packets);
+
+    size_t written = 0;
+    for (const NalUnit &unit : nals) {
+        const uint8_t *nal = d + unit.offset;
+        size_t size = unit.size;
+        if (size <= max_payload_) {
+            writeHeader(rtp, timestamp, ++written == packets);
+            rtp.data.insert(rtp.data.end(), nal, nal + size);
+            rtp.ends.push_back(static_cast<uint32_t>(rtp.data.size()));
+            continue;
+        }
+        // H.264 FU-A: indicator (F, NRI, 28) + header (S, E, type).
+        // H.265 FU: payload header (F, 49, layer, TID) + header (S, E, type)
+        uint8_t fu[3];
+        uint8_t type = unit.type;
+        if (hevc_) {
+            fu[0] = static_cast<uint8_t>((nal[0] & 0x81) | (kFuHevc << 1));
+            fu[1] = nal[1];
+        } else {
+            fu[0] = static_cast<uint8_t>((nal[0] & 0xE0) | kFuA);
+        }
+        for (size_t pos = nal_header; pos < size; pos += fragment) {
+            size_t len = std::min(fragment, size - pos);
+            fu[fu_header - 1] = static_cast<uint8_t>(
+                (pos == nal_header ? 0x80 : 0) |
+                (pos + len == size ? 0x40 : 0) | type);
+            writeHeader(rtp, timestamp, ++written == packets);
+            rtp.data.insert(rtp.data.end(), fu, fu + fu_header);
+            rtp.data.insert(rtp.data.end(), nal + pos, nal + pos + len);
+            rtp.ends.push_back(static_cast<uint32_t>(rtp.data.size()));
+        }
+    }
+    rtp.bytes = rtp.data.size();
+}
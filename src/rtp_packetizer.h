@@ -0,0 +1,26 @@
+#pragma once
+#include "media_frame.h"
+#include "rtp_frame.h"
+#include <cstdint>
+
+// Splits Annex-B access units into RTP: H.264 (RFC 6184, packetization
+// mode 1: single NAL unit packets, FU-A above max_payload) or H.265
+// (RFC 7798: single NAL unit packets, FUs above max_payload). Writes straight
+// into the RtpFrame's pooled storage, sized in a first pass, so a frame
+// costs no allocation per packet. NAL boundaries come from the frame's own
+// index (MediaFrame::nals), not a scan of their own. The marker bit ends
+// the access unit; SSRC and payload type are placeholders the sessions
+// overwrite.
+class RtpPacketizer {
+public:
+    explicit RtpPacketizer(size_t max_payload = 1400, bool hevc = false);
+
+    void packetize(const MediaFrame &frame, uint32_t timestamp, RtpFrame &rtp);
+
+private:
+    void writeHeader(RtpFrame &rtp, uint32_t timestamp, bool marker);
+
+    size_t max_payload_;
+    bool hevc_;
+    uint16_t seq_ = 0;
+};
@@ -0,0 +1,602 @@
+#include "rtsp_client.h"
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
+#include <future>
+#include <iostream>
+#include <netdb.h>
+#include <sstream>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+extern "C" {
+#include <libavutil/base64.h>
+#include <libavutil/md5.h>
+}
+
+static std::string lower(std::string s) {
+    std::transform(s.begin(), s.end(), s.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    return s;
+}
+
+static std::string trim(const std::string &s) {
+    size_t b = s.find_first_not_of(" \t\r\n");
+    size_t e = s.find_last_not_of(" \t\r\n");
+    return b == std::string::npos ? "" : s.substr(b, e - b + 1);
+}
+
+static std::string percentDecode(const std::string &s) {
+    std::string out;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (s[i] == '%' && i + 2 < s.size()) {
+            out += static_cast<char>(
+                std::strtol(s.substr(i + 1, 2).c_str(), nullptr, 16));
+            i += 2;
+        } else {
+            out += s[i];
+        }
+    }
+    return out;
+}
+
+static std::string md5Hex(const std::string &s) {
+    uint8_t digest[16];
+    av_md5_sum(digest, reinterpret_cast<const uint8_t *>(s.data()), s.size());
+    char hex[33];
+    for (int i = 0; i < 16; i++)
+        snprintf(hex + i * 2, 3, "%02x", digest[i]);
+    return std::string(hex, 32);
+}
+
+// key="value" or key=value from an auth challenge
+static std::string authParam(const std::string &h, const std::string &key) {
+    size_t p = lower(h).find(key + "=");
+    if (p == std::string::npos)
+        return "";
+    p += key.size() + 1;
+    if (p < h.size() && h[p] == '"') {
+        size_t e = h.find('"', p + 1);
+        return h.substr(p + 1, e == std::string::npos ? std::string::npos
+                                                      : e - p - 1);
+    }
+    size_t e = h.find_first_of(", ", p);
+    return h.substr(p, e == std::string::npos ? std::string::npos : e - p);
+}
+
+static void appendParamSet(std::vector<uint8_t> &out, const std::string &b64) {
+    std::vector<uint8_t> buf(b64.size());
+    int n = av_base64_decode(buf.data(), b64.c_str(), static_cast<int>(buf.size()));
+    if (n <= 0)
+        return;
+    static const uint8_t sc[4] = {0, 0, 0, 1};
+    out.insert(out.end(), sc, sc + 4);
+    out.insert(out.end(), buf.begin(), buf.begin() + n);
+}
+
+static std::string resolveUrl(const std::string &base, const std::string &ctrl) {
+    if (ctrl.empty() || ctrl == "*")
+        return base;
+    if (ctrl.rfind("rtsp://", 0) == 0)
+        return ctrl;
+    if (!base.empty() && base.back() == '/')
+        return base + ctrl;
+    return base + "/" + ctrl;
+}
+
+std::string RtspClient::Response::header(const std::string &key) const {
+    auto it = headers.find(key);
+    return it == headers.end() ? "" : it->second;
+}
+
+RtspClient::RtspClient(EventLoop &loop, std::string url)
+    : loop_(loop), url_(std::move(url)) {}
+
+RtspClient::~RtspClient() = default;
+
+void RtspClient::start() {
+    std::weak_ptr<RtspClient> weak = shared_from_this();
+    loop_.post([weak] {
+        auto self = weak.lock();
+        if (!self || self->state_ != State::Idle)
+            return;
+        if (!self->parseUrl()) {
+            self->fail("unsupported URL " + self->url_, true);
+            return;
+        }
+        self->doConnect();
+    });
+}
+
+void RtspClient::stop() {
+    if (loop_.inLoopThread()) {
+        teardown();
+        state_ = State::Closed;
+        return;
+    }
+    std::promise<void> done;
+    auto self = shared_from_this();
+    loop_.post([self, &done] {
+        self->teardown();
+        self->state_ = State::Closed;
+        done.set_value();
+    });
+    done.get_future().wait();
+}
+
+bool RtspClient::parseUrl() {
+    const std::string scheme = "rtsp://";
+    if (url_.rfind(scheme, 0) != 0)
+        return false;
+    size_t slash = url_.find('/', scheme.size());
+    std::string authority = url_.substr(scheme.size(), slash - scheme.size());
+    std::string path = slash == std::string::npos ? "/" : url_.substr(slash);
+
+    size_t at = authority.rfind('@');
+    if (at != std::string::npos) {
+        std::string userinfo = authority.substr(0, at);
+        authority = authority.substr(at + 1);
+        size_t colon = userinfo.find(':');
+        user_ = percentDecode(userinfo.substr(0, colon));
+        if (colon != std::string::npos)
+            pass_ = percentDecode(userinfo.substr(colon + 1));
+    }
+
+    size_t colon = authority.rfind(':');
+    size_t bracket = authority.rfind(']');
+    if (colon != std::string::npos &&
+        (bracket == std::string::npos || colon > bracket)) {
+        host_ = authority.substr(0, colon);
+        port_ = authority.substr(colon + 1);
+    } else {
+        host_ = authority;
+    }
+    if (!host_.empty() && host_.front() == '[')
+        host_ = host_.substr(1, host_.size() - 2);
+    request_url_ = scheme + authority + path;
+    return !host_.empty();
+}
+
+void RtspClient::doConnect() {
+    // Name resolution blocks the loop briefly; cameras are usually numeric
+    addrinfo hints{}, *res = nullptr;
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host_.c_str(), port_.c_str(), &hints, &res) != 0 || !res) {
+        fail("cannot resolve " + host_);
+        return;
+    }
+    fd_ = socket(res->ai_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ < 0) {
+        freeaddrinfo(res);
+        fail("socket failed");
+        return;
+    }
+    int ret = connect(fd_, res->ai_addr, res->ai_addrlen);
+    freeaddrinfo(res);
+    if (ret < 0 && errno != EINPROGRESS) {
+        fail(std::string("connect failed: ") + strerror(errno));
+        return;
+    }
+
+    state_ = State::Connecting;
+    std::weak_ptr<RtspClient> weak = shared_from_this();
+    loop_.add(fd_, EPOLLIN | EPOLLOUT, [weak](uint32_t events) {
+        if (auto self = weak.lock())
+            self->onEvents(events);
+    });
+    armTimeout(std::chrono::seconds(5));
+}
+
+void RtspClient::armTimeout(std::chrono::milliseconds ms) {
+    if (timeout_timer_)
+        loop_.cancelTimer(timeout_timer_);
+    std::weak_ptr<RtspClient> weak = shared_from_this();
+    timeout_timer_ = loop_.addTimer(ms, [weak] {
+        if (auto self = weak.lock()) {
+            self->timeout_timer_ = 0;
+            self->fail("timeout");
+        }
+    });
+}
+
+void RtspClient::onEvents(uint32_t events) {
+    if (state_ == State::Connecting) {
+        if (!(events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+            return;
+        int err = 0;
+        socklen_t len = sizeof(err);
+        getsockopt(fd_, SOL_SOCKET, SO_ERROR, &err, &len);
+        if (err != 0) {
+            fail(std::string("connect failed: ") + strerror(err));
+            return;
+        }
+        loop_.modify(fd_, EPOLLIN);
+        state_ = State::Describe;
+        sendRequest("DESCRIBE", request_url_, "Accept: application/sdp\r\n");
+        return;
+    }
+    if (events & EPOLLIN)
+        onReadable();
+    if (fd_ >= 0 && (events & EPOLLOUT))
+        flushWrite();
+    if (fd_ >= 0 && (events & (EPOLLERR | EPOLLHUP)) && !(events & EPOLLIN))
+        fail("socket error");
+}
+
+void RtspClient::onReadable() {
+    char buf[65536];
+    while (fd_ >= 0) {
+        ssize_t n = recv(fd_, buf, sizeof(buf), 0);
+        if (n > 0) {
+            rbuf_.append(buf, static_cast<size_t>(n));
+            continue;
+        }
+        if (n == 0) {
+            fail("closed by server");
+            return;
+        }
+        if (errno == EINTR)
+            continue;
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            fail(std::string("recv: ") + strerror(errno));
+            return;
+        }
+        break;
+    }
+    if (state_ == State::Playing)
+        armTimeout(std::chrono::seconds(10)); // data watchdog
+    if (!parseInput())
+        fail("protocol error");
+}
+
+void RtspClient::flushWrite() {
+    while (!wbuf_.empty()) {
+        ssize_t n = send(fd_, wbuf_.data(), wbuf_.size(), MSG_NOSIGNAL);
+        if (n > 0) {
+            wbuf_.erase(0, static_cast<size_t>(n));
+            continue;
+        }
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            loop_.modify(fd_, EPOLLIN | EPOLLOUT);
+            return;
+        }
+        fail(std::string("send: ") + strerror(errno));
+        return;
+    }
+    loop_.modify(fd_, EPOLLIN);
+}
+
+std::string RtspClient::authHeader(const std::string &method,
+                                   const std::string &uri) {
+    if (digest_) {
+        std::string ha1 = md5Hex(user_ + ":" + realm_ + ":" + pass_);
+        std::string ha2 = md5Hex(method + ":" + uri);
+        std::string h = "Authorization: Digest username=\"" + user_ +
+                        "\", realm=\"" + realm_ + "\", nonce=\"" + nonce_ +
+                        "\", uri=\"" + uri + "\"";
+        if (qop_ == "auth") {
+            char nc[9];
+            snprintf(nc, sizeof(nc), "%08x", ++nc_);
+            std::string cnonce = md5Hex(std::to_string(cseq_) + nonce_).substr(0, 16);
+            h += ", qop=auth, nc=" + std::string(nc) + ", cnonce=\"" + cnonce +
+                 "\", response=\"" +
+                 md5Hex(ha1 + ":" + nonce_ + ":" + nc + ":" + cnonce +
+                        ":auth:" + ha2) +
+                 "\"";
+        } else {
+            h += ", response=\"" + md5Hex(ha1 + ":" + nonce_ + ":" + ha2) + "\"";
+        }
+        return h + "\r\n";
+    }
+    if (basic_) {
+        std::string cred = user_ + ":" + pass_;
+        std::vector<char> out(AV_BASE64_SIZE(cred.size()));
+        av_base64_encode(out.data(), static_cast<int>(out.size()),
+                         reinterpret_cast<const uint8_t *>(cred.data()),
+                         static_cast<int>(cred.size()));
+        return "Authorization: Basic " + std::string(out.data()) + "\r\n";
+    }
+    return "";
+}
+
+void RtspClient::sendRequest(const std::string &method, const std::string &uri,
+                             const std::string &extra_headers) {
+    last_method_ = method;
+    last_uri_ = uri;
+    last_extra_ = extra_headers;
+    std::ostringstream req;
+    req << method << " " << uri << " RTSP/1.0\r\n"
+        << "CSeq: " << ++cseq_ << "\r\n"
+        << "User-Agent: rtsp2webrtc\r\n"
+        << authHeader(method, uri);
+    if (!session_.empty())
+        req << "Session: " << session_ << "\r\n";
+    req << extra_headers << "\r\n";
+    wbuf_ += req.str();
+    flushWrite();
+}
+
+bool RtspClient::parseInput() {
+    size_t pos = 0;
+    while (pos < rbuf_.size() && fd_ >= 0) {
+        size_t avail = rbuf_.size() - pos;
+        const char *p = rbuf_.data() + pos;
+        if (p[0] == '$') { // interleaved binary frame
+            if (avail < 4)
+                break;
+            int channel = static_cast<uint8_t>(p[1]);
+            size_t len = static_cast<uint8_t>(p[2]) << 8 | static_cast<uint8_t>(p[3]);
+            if (avail < 4 + len)
+                break;
+            if (channel == rtp_channel_ && depacketizer_)
+                depacketizer_->push(reinterpret_cast<const uint8_t *>(p + 4), len);
+            pos += 4 + len;
+            continue;
+        }
+        if (avail < 5)
+            break;
+        if (memcmp(p, "RTSP/", 5) != 0) {
+            pos++; // resync
+            continue;
+        }
+        size_t hdr_end = rbuf_.find("\r\n\r\n", pos);
+        if (hdr_end == std::string::npos) {
+            if (avail > 65536)
+                return false;
+            break;
+        }
+
+        Response resp;
+        std::istringstream hs(rbuf_.substr(pos, hdr_end - pos));
+        std::string line;
+        std::getline(hs, line);
+        std::istringstream status(line);
+        std::string version;
+        status >> version >> resp.status;
+        while (std::getline(hs, line)) {
+            size_t colon = line.find(':');
+            if (colon == std::string::npos)
+                continue;
+            resp.headers.emplace(lower(trim(line.substr(0, colon))),
+                                 trim(line.substr(colon + 1)));
+        }
+        size_t body_len = 0;
+        std::string cl = resp.header("content-length");
+        if (!cl.empty())
+            body_len = std::strtoul(cl.c_str(), nullptr, 10);
+        if (rbuf_.size() < hdr_end + 4 + body_len)
+            break;
+        resp.body = rbuf_.substr(hdr_end + 4, body_len);
+        pos = hdr_end + 4 + body_len;
+        handleResponse(resp);
+    }
+    if (fd_ >= 0)
+        rbuf_.erase(0, pos);
+    return true;
+}
+
+void RtspClient::handleResponse(const Response &resp) {
+    if (resp.status == 401 && !auth_retried_ && !user_.empty()) {
+        auto range = resp.headers.equal_range("www-authenticate");
+        for (auto it = range.first; it != range.second; ++it) {
+            std::string challenge = lower(it->second);
+            if (challenge.rfind("digest", 0) == 0) {
+                digest_ = true;
+                realm_ = authParam(it->second, "realm");
+                nonce_ = authParam(it->second, "nonce");
+                qop_ = authParam(it->second, "qop").find("auth") !=
+                               std::string::npos
+                           ? "auth"
+                           : "";
+            } else if (challenge.rfind("basic", 0) == 0 && !digest_) {
+                basic_ = true;
+            }
+        }
+        auth_retried_ = true;
+        sendRequest(last_method_, last_uri_, last_extra_);
+        return;
+    }
+    if (state_ == State::Playing)
+        return; // keepalive replies
+    if (resp.status != 200) {
+        fail(last_method_ + " failed: " + std::to_string(resp.status));
+        return;
+    }
+    auth_retried_ = false;
+
+    switch (state_) {
+    case State::Describe: {
+        std::string base = resp.header("content-base");
+        if (base.empty())
+            base = resp.header("content-location");
+        if (base.empty())
+            base = request_url_;
+        if (!handleSdp(resp.body, base))
+            return;
+        state_ = State::Setup;
+        sendRequest("SETUP", control_url_,
+                    "Transport: RTP/AVP/TCP;unicast;interleaved=0-1\r\n");
+        break;
+    }
+    case State::Setup: {
+        std::string session = resp.header("session");
+        size_t semi = session.find(';');
+        session_ = trim(session.substr(0, semi));
+        if (semi != std::string::npos) {
+            std::string t = authParam(session.substr(semi), "timeout");
+            if (!t.empty())
+                session_timeout_s_ = std::max(10, std::atoi(t.c_str()));
+        }
+        std::string transport = resp.header("transport");
+        size_t il = transport.find("interleaved=");
+        if (il != std::string::npos)
+            rtp_channel_ = std::atoi(transport.c_str() + il + 12);
+        state_ = State::Play;
+        sendRequest("PLAY", play_url_, "Range: npt=0.000-\r\n");
+        break;
+    }
+    case State::Play: {
+        state_ = State::Playing;
+        std::cout << "[RtspClient] Playing " << request_url_ << " ("
+                  << avcodec_get_name(info_.codec_id) << ")\n";
+        armTimeout(std::chrono::seconds(10));
+        keepalive();
+        if (open_cb_)
+            open_cb_(info_);
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+bool RtspClient::handleSdp(const std::string &sdp, const std::string &base) {
+    std::istringstream ss(sdp);
+    std::string line, session_control, media_control, fmtp;
+    std::string video_pt;
+    bool in_media = false, in_video = false, seen_video = false;
+    while (std::getline(ss, line)) {
+        line = trim(line);
+        if (line.rfind("m=", 0) == 0) {
+            in_media = true;
+            in_video = !seen_video && line.rfind("m=video", 0) == 0;
+            if (in_video) {
+                seen_video = true;
+                std::istringstream ms(line);
+                std::string m, port, proto;
+                ms >> m >> port >> proto >> video_pt;
+            }
+            continue;
+        }
+        if (line.rfind("a=control:", 0) == 0) {
+            if (!in_media)
+                session_control = line.substr(10);
+            else if (in_video)
+                media_control = line.substr(10);
+        } else if (in_video && line.rfind("a=rtpmap:" + video_pt + " ", 0) == 0) {
+            std::string enc = lower(line.substr(10 + video_pt.size()));
+            if (enc.rfind("h264/", 0) == 0)
+                info_.codec_id = AV_CODEC_ID_H264;
+            else if (enc.rfind("h265/", 0) == 0)
+                info_.codec_id = AV_CODEC_ID_HEVC;
+        } else if (in_video && line.rfind("a=fmtp:" + video_pt + " ", 0) == 0) {
+            fmtp = line.substr(8 + video_pt.size());
+        }
+    }
+    if (info_.codec_id == AV_CODEC_ID_NONE) {
+        fail("no H.264/H.265 video in SDP", true);
+        return false;
+    }
+
+    // Parameter sets from fmtp, as Annex-B like FFmpeg's RTSP extradata
+    std::map<std::string, std::string> params;
+    std::istringstream fs(fmtp);
+    std::string kv;
+    while (std::getline(fs, kv, ';')) {
+        size_t eq = kv.find('=');
+        if (eq != std::string::npos)
+            params[lower(trim(kv.substr(0, eq)))] = trim(kv.substr(eq + 1));
+    }
+    if (info_.codec_id == AV_CODEC_ID_H264) {
+        std::istringstream sets(params["sprop-parameter-sets"]);
+        std::string set;
+        while (std::getline(sets, set, ','))
+            appendParamSet(info_.extradata, set);
+    } else {
+        for (const char *key : {"sprop-vps", "sprop-sps", "sprop-pps"}) {
+            std::istringstream sets(params[key]);
+            std::string set;
+            while (std::getline(sets, set, ','))
+                appendParamSet(info_.extradata, set);
+        }
+    }
+
+    std::string session_base = resolveUrl(base, session_control);
+    control_url_ = resolveUrl(session_base, media_control);
+    play_url_ = session_base;
+
+    depacketizer_ = std::make_unique<RtpDepacketizer>(info_.codec_id);
+    depacketizer_->setFrameCallback([this](const FramePtr &frame) {
+        if (frame_cb_)
+            frame_cb_(frame);
+    });
+    return true;
+}
+
+void RtspClient::keepalive() {
+    std::weak_ptr<RtspClient> weak = shared_from_this();
+    auto interval = std::chrono::seconds(std::max(5, session_timeout_s_ / 2));
+    keepalive_timer_ = loop_.addTimer(interval, [weak] {
+        auto self = weak.lock();
+        if (!self || self->state_ != State::Playing)
+            return;
+        self->sendRequest("GET_PARAMETER", self->play_url_);
+        self->keepalive();
+    });
+}
+
+void RtspClient::fail(const std::string &why, bool unsupported) {
+    if (state_ == State::Closed)
+        return;
+    std::cerr << "[RtspClient] " << request_url_ << ": " << why << "\n";
+    teardown();
+    auto delay = !unsupported && retry_cb_ ? retry_cb_()
+                                           : std::chrono::milliseconds(-1);
+    if (delay.count() >= 0) {
+        scheduleRetry(delay);
+        return;
+    }
+    state_ = State::Closed;
+    if (close_cb_)
+        close_cb_(unsupported);
+}
+
+void RtspClient::scheduleRetry(std::chrono::milliseconds delay) {
+    std::cout << "[RtspClient] " << request_url_ << ": reconnecting in "
+              << delay.count() << " ms\n";
+    // Fresh session; the auth scheme learned so far is kept
+    state_ = State::Idle;
+    session_.clear();
+    auth_retried_ = false;
+    rtp_channel_ = 0;
+    info_ = {};
+    depacketizer_.reset();
+    std::weak_ptr<RtspClient> weak = shared_from_this();
+    retry_timer_ = loop_.addTimer(delay, [weak] {
+        auto self = weak.lock();
+        if (!self || self->state_ != State::Idle)
+            return;
+        self->retry_timer_ = 0;
+        self->doConnect();
+    });
+}
+
+void RtspClient::teardown() {
+    if (timeout_timer_)
+        loop_.cancelTimer(timeout_timer_);
+    if (keepalive_timer_)
+        loop_.cancelTimer(keepalive_timer_);
+    if (retry_timer_)
+        loop_.cancelTimer(retry_timer_);
+    timeout_timer_ = keepalive_timer_ = retry_timer_ = 0;
+    if (fd_ < 0)
+        return;
+    if (state_ == State::Playing) {
+        // Best effort, the socket is closed right after
+        std::string req = "TEARDOWN " + play_url_ + " RTSP/1.0\r\nCSeq: " +
+                          std::to_string(++cseq_) + "\r\n" +
+                          authHeader("TEARDOWN", play_url_) +
+                          "Session: " + session_ + "\r\n\r\n";
+        (void)!send(fd_, req.data(), req.size(), MSG_NOSIGNAL);
+    }
+    loop_.remove(fd_);
+    close(fd_);
+    fd_ = -1;
+    rbuf_.clear();
+    wbuf_.clear();
+}
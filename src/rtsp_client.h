@@ -0,0 +1,100 @@
+#pragma once
+#include "event_loop.h"
+#include "media_frame.h"
+#include "rtp_depacketizer.h"
+#include <chrono>
+#include <functional>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+// Non-blocking RTSP client (RTP over TCP interleaved) driven by an
+// EventLoop. Supports H.264/H.265 video with Basic/Digest auth; anything
+// else is reported as unsupported so the caller can fall back to FFmpeg.
+class RtspClient : public std::enable_shared_from_this<RtspClient> {
+public:
+    struct StreamInfo {
+        AVCodecID codec_id = AV_CODEC_ID_NONE;
+        std::vector<uint8_t> extradata; // Annex-B SPS/PPS(/VPS) from SDP
+    };
+    using OpenCallback = std::function<void(const StreamInfo &info)>;
+    using FrameCallback = std::function<void(const FramePtr &frame)>;
+    // unsupported: stream is reachable but not handled by this client
+    using CloseCallback = std::function<void(bool unsupported)>;
+    // Asked after a transient failure: delay before connecting again, or
+    // negative to give up (close)
+    using RetryCallback = std::function<std::chrono::milliseconds()>;
+
+    RtspClient(EventLoop &loop, std::string url);
+    ~RtspClient();
+
+    // Set callbacks before start(); they run on the loop thread
+    void onOpen(OpenCallback cb) { open_cb_ = std::move(cb); }
+    void onFrame(FrameCallback cb) { frame_cb_ = std::move(cb); }
+    void onClose(CloseCallback cb) { close_cb_ = std::move(cb); }
+    // Without one every failure closes. onOpen runs again once reconnected.
+    void onRetry(RetryCallback cb) { retry_cb_ = std::move(cb); }
+
+    void start();
+    // Blocks until torn down unless called on the loop thread
+    void stop();
+
+private:
+    enum class State { Idle, Connecting, Describe, Setup, Play, Playing, Closed };
+
+    struct Response {
+        int status = 0;
+        std::multimap<std::string, std::string> headers; // lower-case keys
+        std::string body;
+        std::string header(const std::string &key) const;
+    };
+
+    bool parseUrl();
+    void doConnect();
+    void onEvents(uint32_t events);
+    void onReadable();
+    void flushWrite();
+    void sendRequest(const std::string &method, const std::string &uri,
+                     const std::string &extra_headers = "");
+    bool parseInput();
+    void handleResponse(const Response &resp);
+    bool handleSdp(const std::string &sdp, const std::string &base);
+    std::string authHeader(const std::string &method, const std::string &uri);
+    void armTimeout(std::chrono::milliseconds ms);
+    void keepalive();
+    void fail(const std::string &why, bool unsupported = false);
+    void scheduleRetry(std::chrono::milliseconds delay);
+    void teardown();
+
+    EventLoop &loop_;
+    std::string url_;
+    std::string request_url_; // url_ without credentials
+    std::string host_, port_ = "554", user_, pass_;
+
+    State state_ = State::Idle;
+    int fd_ = -1;
+    std::string rbuf_, wbuf_;
+    int cseq_ = 0;
+    std::string last_method_, last_uri_, last_extra_;
+    bool auth_retried_ = false;
+
+    std::string realm_, nonce_, qop_;
+    bool digest_ = false, basic_ = false;
+    int nc_ = 0;
+
+    std::string control_url_, play_url_, session_;
+    int session_timeout_s_ = 60;
+    int rtp_channel_ = 0;
+    StreamInfo info_;
+    std::unique_ptr<RtpDepacketizer> depacketizer_;
+
+    EventLoop::TimerId timeout_timer_ = 0;
+    EventLoop::TimerId keepalive_timer_ = 0;
+    EventLoop::TimerId retry_timer_ = 0;
+
+    OpenCallback open_cb_;
+    FrameCallback frame_cb_;
+    CloseCallback close_cb_;
+    RetryCallback retry_cb_;
+};
@@ -1,5 +1,5 @@
 #include "rtsp_reader.h"
-#include <chrono>
+#include <algorithm>
 #include <cstring>
 #include <iostream>
 
@@ -7,152 +7,400 @@ extern "C" {
 #include <libavutil/error.h>
 }
 
-RTSPReader::RTSPReader(const std::string &url) : url_(url) {}
+// Local files (and other plain paths) end at EOF; anything with a scheme
+// is a network source worth reconnecting to
+static bool isLiveUrl(const std::string &url) {
+    return url.find("://") != std::string::npos && url.rfind("file:", 0) != 0;
+}
+
+RTSPReader::RTSPReader(const std::string &url, IngestReactor *reactor)
+    : url_(url), live_(isLiveUrl(url)), reactor_(reactor),
+      label_(redactCredentials(url)) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{{"source", label_}};
+    frames_metric_ = registry.counter("rtsp_ingest_frames_total",
+                                      "Access units read from the camera",
+                                      labels);
+    bytes_metric_ = registry.counter("rtsp_ingest_bytes_total",
+                                     "Access unit bytes read from the camera",
+                                     labels);
+    keyframes_metric_ = registry.counter(
+        "rtsp_ingest_keyframes_total", "Keyframes read from the camera", labels);
+    audio_frames_metric_ = registry.counter(
+        "rtsp_ingest_audio_frames_total", "Audio frames read from the camera",
+        labels);
+    errors_metric_ = registry.counter(
+        "rtsp_ingest_errors_total", "Failed opens and read errors", labels);
+    reconnects_metric_ = registry.counter(
+        "rtsp_ingest_reconnects_total",
+        "Connections re-established after the source dropped", labels);
+}
 
 RTSPReader::~RTSPReader() { stop(); }
 
+std::shared_ptr<const std::vector<uint8_t>> RTSPReader::extradata() const {
+    std::lock_guard<std::mutex> lock(extradata_mtx_);
+    if (!extradata_)
+        return std::make_shared<const std::vector<uint8_t>>();
+    return extradata_;
+}
+
+std::shared_ptr<const AudioInfo> RTSPReader::audioInfo() const {
+    std::lock_guard<std::mutex> lock(extradata_mtx_);
+    if (!audio_info_)
+        return std::make_shared<const AudioInfo>();
+    return audio_info_;
+}
+
 void RTSPReader::start() {
     if (running_)
         return;
+    // A previous run that ended on its own
+    if (thread_.joinable())
+        thread_.join();
+    if (client_) {
+        client_->stop();
+        client_.reset();
+    }
     running_ = true;
-    thread_ = std::thread(&RTSPReader::readLoop, this);
+    if (relay_)
+        thread_ = std::thread(&RTSPReader::relayLoop, this);
+    else if (reactor_)
+        startClient();
+    else
+        thread_ = std::thread(&RTSPReader::readLoop, this);
 }
 
 void RTSPReader::stop() {
     running_ = false;
+    {
+        // Wake a backoff wait without losing the notification
+        std::lock_guard<std::mutex> lock(wait_mtx_);
+    }
+    wait_cv_.notify_all();
+    if (relay_)
+        relay_->interrupt();
+    // Once stop() returns no client callback is running or pending
+    if (client_) {
+        client_->stop();
+        client_.reset();
+    }
     if (thread_.joinable())
         thread_.join();
 }
 
+void RTSPReader::startClient() {
+    client_ = std::make_shared<RtspClient>(reactor_->pick(), url_);
+    // Callbacks run on the client's loop thread
+    client_->onOpen([this](const RtspClient::StreamInfo &info) {
+        setStreamInfo(info.codec_id, info.extradata);
+        opened(" (reactor)");
+    });
+    client_->onFrame([this](const FramePtr &frame) { emit(frame); });
+    // The client reconnects by itself while this returns a delay
+    client_->onRetry([this] {
+        errors_metric_->add();
+        return running_ ? backoff_.next() : std::chrono::milliseconds(-1);
+    });
+    client_->onClose([this](bool unsupported) {
+        if (unsupported && running_) {
+            std::cout << "[RTSPReader] Falling back to FFmpeg ingest\n";
+            thread_ = std::thread(&RTSPReader::readLoop, this);
+            return;
+        }
+        running_ = false;
+    });
+    client_->start();
+}
+
+void RTSPReader::setStreamInfo(AVCodecID codec_id,
+                               std::vector<uint8_t> extradata) {
+    codec_id_ = codec_id;
+    std::lock_guard<std::mutex> lock(extradata_mtx_);
+    extradata_ =
+        std::make_shared<const std::vector<uint8_t>>(std::move(extradata));
+}
+
+// Start of a connection: the next frame begins a new source timeline
+void RTSPReader::opened(const char *via) {
+    if (connected_before_)
+        reconnects_metric_->add();
+    connected_before_ = true;
+    stream_start_ = true;
+    std::cout << "[RTSPReader] Stream opened: "
+              << avcodec_get_name(codec_id_) << via << "\n";
+}
+
+bool RTSPReader::waitReconnect() {
+    auto delay = backoff_.next();
+    if (!running_ || !live_ || delay.count() < 0)
+        return false;
+    std::cout << "[RTSPReader] Reconnecting to " << label_ << " in "
+              << delay.count() << " ms\n";
+    std::unique_lock<std::mutex> lock(wait_mtx_);
+    wait_cv_.wait_for(lock, delay, [this] { return !running_; });
+    return running_;
+}
+
 void RTSPReader::readLoop() {
+    // Supervise: each pass is one connection; a live source that fails to
+    // open or drops is retried until stop() or out of attempts
+    do {
+        readStream();
+    } while (waitReconnect());
+    running_ = false;
+}
+
+static int interruptCallback(void *opaque) {
+    return !static_cast<std::atomic<bool> *>(opaque)->load();
+}
+
+void RTSPReader::readStream() {
     // Open RTSP
     AVDictionary *opts = nullptr;
     av_dict_set(&opts, "rtsp_transport", "tcp", 0);
-    av_dict_set(&opts, "stimeout", "5000000", 0); // 5s timeout
+    // Socket I/O timeout (FFmpeg 5+, was stimeout): a camera that goes
+    // silent ends the read and gets reconnected instead of hanging
+    av_dict_set(&opts, "timeout", "5000000", 0); // 5s timeout
 
+    // stop() aborts a blocking open or read instead of waiting it out
+    fmt_ctx_ = avformat_alloc_context();
+    fmt_ctx_->interrupt_callback = {interruptCallback, &running_};
     int ret = avformat_open_input(&fmt_ctx_, url_.c_str(), nullptr, &opts);
     av_dict_free(&opts);
     if (ret < 0) {
         char err[AV_ERROR_MAX_STRING_SIZE];
         av_strerror(ret, err, sizeof(err));
-        std::cerr << "[RTSPReader] Failed to open " << url_ << ": " << err << "\n";
-        running_ = false;
+        std::cerr << "[RTSPReader] Failed to open " << label_ << ": " << err
+                  << "\n";
+        errors_metric_->add();
         return;
     }
 
     if (avformat_find_stream_info(fmt_ctx_, nullptr) < 0) {
         std::cerr << "[RTSPReader] Failed to find stream info\n";
+        errors_metric_->add();
         avformat_close_input(&fmt_ctx_);
-        running_ = false;
         return;
     }
 
     // Find video stream
+    video_stream_idx_ = -1;
     for (unsigned i = 0; i < fmt_ctx_->nb_streams; i++) {
         if (fmt_ctx_->streams[i]->codecpar->codec_type == AVMEDIA_TYPE_VIDEO) {
             video_stream_idx_ = i;
-            codec_id_ = fmt_ctx_->streams[i]->codecpar->codec_id;
-            // Copy extradata (SPS/PPS)
-            auto *par = fmt_ctx_->streams[i]->codecpar;
-            if (par->extradata && par->extradata_size > 0) {
-                extradata_.assign(par->extradata,
-                                  par->extradata + par->extradata_size);
-            }
             break;
         }
     }
 
     if (video_stream_idx_ < 0) {
         std::cerr << "[RTSPReader] No video stream found\n";
+        errors_metric_->add();
         avformat_close_input(&fmt_ctx_);
-        running_ = false;
         return;
     }
 
-    std::cout << "[RTSPReader] Stream opened: "
-              << avcodec_get_name(codec_id_) << "\n";
+    // Copy extradata (SPS/PPS)
+    auto *par = fmt_ctx_->streams[video_stream_idx_]->codecpar;
+    std::vector<uint8_t> extradata;
+    if (par->extradata && par->extradata_size > 0)
+        extradata.assign(par->extradata, par->extradata + par->extradata_size);
+    setStreamInfo(par->codec_id, std::move(extradata));
+    audio_stream_idx_ = findAudioStream();
+    opened("");
 
-    // Read loop with real-time pacing
+    // Drain the socket as fast as packets arrive; real-time pacing happens
+    // downstream (Pacer), so a sleep here can never stall the receive buffer
     AVPacket *pkt = av_packet_alloc();
-    int64_t first_pts = AV_NOPTS_VALUE;
-    std::chrono::steady_clock::time_point first_send_time;
+    AVCodecID codec_id = par->codec_id;
+    // PTS go out at 90kHz whatever the input's time base (RTSP already is)
+    AVRational time_base = fmt_ctx_->streams[video_stream_idx_]->time_base;
+    AVRational audio_time_base =
+        audio_stream_idx_ >= 0 ? fmt_ctx_->streams[audio_stream_idx_]->time_base
+                               : AVRational{1, 90000};
+    int64_t first_pts = AV_NOPTS_VALUE, last_pts = 0, pts_offset = 0;
+    int64_t interval = 3000; // last frame duration, 30 fps until known
 
     while (running_) {
         ret = av_read_frame(fmt_ctx_, pkt);
+        if (ret == AVERROR_EOF && loops_ != 0 &&
+            av_seek_frame(fmt_ctx_, video_stream_idx_, 0,
+                          AVSEEK_FLAG_BACKWARD) >= 0) {
+            // Next pass continues one frame interval after the last frame
+            if (loops_ > 0)
+                loops_--;
+            pts_offset = last_pts + interval - first_pts;
+            first_pts = AV_NOPTS_VALUE;
+            continue;
+        }
         if (ret < 0) {
-            if (ret == AVERROR_EOF)
+            if (ret == AVERROR_EOF) {
                 std::cout << "[RTSPReader] EOF\n";
-            else
+            } else if (running_) {
                 std::cerr << "[RTSPReader] Read error\n";
+                errors_metric_->add();
+            }
             break;
         }
-        if (pkt->stream_index == video_stream_idx_ && nal_cb_) {
+        if (pkt->stream_index == video_stream_idx_) {
             bool is_keyframe = (pkt->flags & AV_PKT_FLAG_KEY) != 0;
-            // PTS in stream time_base (90kHz for RTSP video)
             int64_t pts = pkt->pts != AV_NOPTS_VALUE ? pkt->pts : pkt->dts;
-
-            // Pacing: don't send faster than real-time to avoid burst drops
             if (pts != AV_NOPTS_VALUE) {
-                if (first_pts == AV_NOPTS_VALUE) {
+                pts = av_rescale_q(pts, time_base, {1, 90000});
+                if (first_pts == AV_NOPTS_VALUE)
                     first_pts = pts;
-                    first_send_time = std::chrono::steady_clock::now();
-                } else {
-                    auto elapsed_pts_ms = (pts - first_pts) / 90; // 90kHz → ms
-                    auto elapsed_real = std::chrono::steady_clock::now() - first_send_time;
-                    auto elapsed_real_ms = std::chrono::duration_cast<
-                        std::chrono::milliseconds>(elapsed_real).count();
-                    auto ahead_ms = elapsed_pts_ms - elapsed_real_ms;
-                    if (ahead_ms > 5) {
-                        std::this_thread::sleep_for(
-                            std::chrono::milliseconds(ahead_ms - 2));
-                    }
-                }
+                pts += pts_offset;
+                if (pts > last_pts && last_pts > 0 && pts - last_pts < 90000)
+                    interval = pts - last_pts;
+                last_pts = std::max(last_pts, pts);
+            } else {
+                pts = -1;
             }
-
-            nal_cb_(pkt->data, pkt->size, codec_id_, is_keyframe, pts);
+            if (auto frame = MediaFrame::fromPacket(pkt, codec_id,
+                                                    is_keyframe, pts))
+                emit(frame);
+        } else if (pkt->stream_index == audio_stream_idx_ &&
+                   pkt->pts != AV_NOPTS_VALUE) {
+            // Same clock as the video (the RTCP sender reports already
+            // aligned both streams' RTP timestamps), same loop offset
+            int64_t pts = av_rescale_q(pkt->pts, audio_time_base,
+                                       {1, 90000}) +
+                          pts_offset;
+            auto *apar = fmt_ctx_->streams[audio_stream_idx_]->codecpar;
+            if (auto frame =
+                    MediaFrame::fromPacket(pkt, apar->codec_id, false, pts))
+                emitAudio(frame);
         }
         av_packet_unref(pkt);
     }
     av_packet_free(&pkt);
     avformat_close_input(&fmt_ctx_);
-    running_ = false;
 }
 
-// Parse Annex-B byte stream, split into individual NAL units
-void RTSPReader::parseAnnexB(const uint8_t *data, size_t size,
-                              bool is_keyframe) {
-    size_t i = 0;
-    while (i < size) {
-        // Find start code (0x000001 or 0x00000001)
-        size_t sc_len = 0;
-        if (i + 3 <= size && data[i] == 0 && data[i + 1] == 0 &&
-            data[i + 2] == 1) {
-            sc_len = 3;
-        } else if (i + 4 <= size && data[i] == 0 && data[i + 1] == 0 &&
-                   data[i + 2] == 0 && data[i + 3] == 1) {
-            sc_len = 4;
+// Audio is demuxed only when someone takes it; the snapshot is replaced on
+// every connection, since a camera may drop or change its audio
+int RTSPReader::findAudioStream() {
+    int idx = -1;
+    AudioInfo info;
+    if (audio_cb_) {
+        idx = av_find_best_stream(fmt_ctx_, AVMEDIA_TYPE_AUDIO, -1,
+                                  video_stream_idx_, nullptr, 0);
+        if (idx >= 0) {
+            auto *par = fmt_ctx_->streams[idx]->codecpar;
+            info.codec_id = par->codec_id;
+            info.sample_rate = par->sample_rate;
+            info.channels = par->ch_layout.nb_channels;
+            if (par->extradata && par->extradata_size > 0)
+                info.extradata.assign(par->extradata,
+                                      par->extradata + par->extradata_size);
+            std::cout << "[RTSPReader] Audio stream: "
+                      << avcodec_get_name(info.codec_id) << " "
+                      << info.sample_rate << "Hz x" << info.channels << "\n";
         } else {
-            i++;
-            continue;
+            idx = -1;
         }
+    }
+    std::lock_guard<std::mutex> lock(extradata_mtx_);
+    audio_info_ = std::make_shared<const AudioInfo>(std::move(info));
+    return idx;
+}
 
-        size_t nal_start = i + sc_len;
+void RTSPReader::relayLoop() {
+    do {
+        if (!relay_->connect()) {
+            errors_metric_->add();
+            continue;
+        }
+        std::cout << "[RTSPReader] Relaying from origin "
+                  << relay_->origin().str() << "\n";
 
-        // Find next start code
-        size_t nal_end = size;
-        for (size_t j = nal_start + 1; j + 2 < size; j++) {
-            if (data[j] == 0 && data[j + 1] == 0 &&
-                (data[j + 2] == 1 ||
-                 (j + 3 < size && data[j + 2] == 0 && data[j + 3] == 1))) {
-                nal_end = j;
-                break;
+        // The origin sends the stream info before the first (key)frame and
+        // again whenever it changes
+        RelayClient::Message msg;
+        bool first_info = true;
+        while (running_ && relay_->read(msg)) {
+            if (msg.type == RelayClient::Type::Info) {
+                setStreamInfo(msg.codec, std::move(msg.data));
+                if (first_info)
+                    opened(" (relay)");
+                first_info = false;
+            } else if (auto frame = MediaFrame::copy(
+                           msg.data.data(), msg.data.size(), codec_id_,
+                           msg.keyframe, msg.pts)) {
+                emit(frame);
             }
         }
+        if (running_) {
+            std::cerr << "[RTSPReader] Relay from " << relay_->origin().str()
+                      << " closed\n";
+            errors_metric_->add();
+        }
+    } while (waitReconnect());
+    running_ = false;
+}
 
-        if (nal_end > nal_start) {
-            nal_cb_(data + nal_start, nal_end - nal_start, codec_id_,
-                    is_keyframe, AV_NOPTS_VALUE);
+// After a reconnect the source's clock starts over (or jumped while we were
+// away). Continue ours from the last frame plus the time spent reconnecting,
+// so the pacer and every session's RTP timestamps stay monotonic. Deltas
+// before the first keyframe reference pictures of the old connection.
+FramePtr RTSPReader::retime(const FramePtr &frame) {
+    auto now = std::chrono::steady_clock::now();
+    if (stream_start_) {
+        if (last_pts_ >= 0 && !frame->isKeyframe())
+            return nullptr;
+        stream_start_ = false;
+        backoff_.reset();
+        if (last_pts_ >= 0 && frame->pts() >= 0) {
+            auto gap = std::chrono::duration_cast<std::chrono::milliseconds>(
+                           now - last_frame_time_)
+                           .count() *
+                       90;
+            pts_offset_ =
+                last_pts_ + std::max<int64_t>(gap, 3000) - frame->pts();
+        }
+    }
+    if (frame->pts() < 0)
+        return frame;
+    int64_t pts = frame->pts() + pts_offset_;
+    last_pts_ = std::max(last_pts_, pts);
+    last_frame_time_ = now;
+    return pts_offset_ ? frame->withPts(pts) : frame;
+}
+
+void RTSPReader::emit(const FramePtr &source_frame) {
+    FramePtr frame = retime(source_frame);
+    if (!frame)
+        return;
+    frames_metric_->add();
+    bytes_metric_->add(frame->size());
+    if (frame->isKeyframe())
+        keyframes_metric_->add();
+    if (!nal_cb_)
+        return;
+    if (auto trace = Tracer::global().sample(label_, frame_seq_++)) {
+        if (auto traced = frame->withTrace(std::move(trace))) {
+            nal_cb_(traced);
+            return;
         }
-        i = nal_end;
+    }
+    nal_cb_(frame);
+}
+
+// Audio follows the video's timeline: nothing until the connection's first
+// video frame has set the offset, then the same offset applies
+void RTSPReader::emitAudio(const FramePtr &frame) {
+    if (stream_start_ || !audio_cb_)
+        return;
+    audio_frames_metric_->add();
+    audio_cb_(pts_offset_ ? frame->withPts(frame->pts() + pts_offset_)
+                          : frame);
+}
+
+// Split an access unit into its NAL units (start codes stripped), views
+// into the same buffer, using the frame's NAL index
+void RTSPReader::parseAnnexB(const FramePtr &frame) {
+    for (const NalUnit &nal : frame->nals()) {
+        if (auto unit = frame->slice(nal.offset, nal.size))
+            nal_cb_(unit);
     }
 }
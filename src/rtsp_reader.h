@@ -1,8 +1,17 @@
 #pragma once
+#include "backoff.h"
+#include "event_loop.h"
+#include "media_frame.h"
+#include "metrics.h"
+#include "relay.h"
+#include "rtsp_client.h"
 #include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <cstdint>
 #include <functional>
 #include <memory>
+#include <mutex>
 #include <string>
 #include <thread>
 #include <vector>
@@ -12,38 +21,102 @@ extern "C" {
 #include <libavformat/avformat.h>
 }
 
-// Callback: receives NAL units (without start code), codec_id, keyframe flag, and PTS (90kHz)
-using NalCallback = std::function<void(const uint8_t *data, size_t size,
-                                       AVCodecID codec_id, bool is_keyframe,
-                                       int64_t pts)>;
+// Callback: receives one access unit (Annex-B) carrying codec_id, keyframe
+// flag and PTS (90kHz). The frame references the demuxer's packet buffer.
+using NalCallback = std::function<void(const FramePtr &frame)>;
 
 class RTSPReader {
 public:
-    RTSPReader(const std::string &url);
+    // reactor: if set, ingest through a non-blocking RtspClient on the shared
+    // loops instead of a dedicated FFmpeg thread (falls back to FFmpeg for
+    // streams the client does not support)
+    RTSPReader(const std::string &url, IngestReactor *reactor = nullptr);
     ~RTSPReader();
 
     // Set callback before start()
     void setNalCallback(NalCallback cb) { nal_cb_ = std::move(cb); }
+    // The camera's audio, one codec frame per call on the video's PTS
+    // clock. FFmpeg ingest only (the native client and the relay carry
+    // video). Without a callback audio is not demuxed. Before start().
+    void setAudioCallback(NalCallback cb) { audio_cb_ = std::move(cb); }
+    // Local files (benchmarks): play `times` more times after the first
+    // pass, -1 forever. Timestamps keep increasing across passes.
+    void setLoop(int times) { loops_ = times; }
+    // Cluster edge: take the stream from the origin node that owns the URL
+    // instead of the camera. Call before start().
+    void setRelay(const RelayEndpoint &origin) {
+        relay_ = std::make_unique<RelayClient>(origin, url_);
+    }
+    // Live sources (camera, origin) that fail to open or drop are reopened
+    // after a jittered backoff; timestamps continue across reconnects.
+    // Local files end at EOF. Call before start().
+    void setReconnect(const ReconnectOptions &options) {
+        backoff_ = Backoff(options);
+    }
 
-    // Get SPS/PPS extradata (available after start, once first packet arrives)
-    const std::vector<uint8_t> &extradata() const { return extradata_; }
+    // Get SPS/PPS extradata (available after start, once first packet
+    // arrives). May change on reconnect, hence a snapshot; any thread.
+    std::shared_ptr<const std::vector<uint8_t>> extradata() const;
     AVCodecID codecId() const { return codec_id_; }
+    // Audio stream of the current connection (codec NONE if it has none)
+    std::shared_ptr<const AudioInfo> audioInfo() const;
 
+    // Also restarts a reader that stopped (gave up, EOF)
     void start();
     void stop();
     bool running() const { return running_; }
 
 private:
     void readLoop();
-    void parseAnnexB(const uint8_t *data, size_t size, bool is_keyframe);
+    void readStream();
+    void relayLoop();
+    void startClient();
+    void parseAnnexB(const FramePtr &frame);
+    void setStreamInfo(AVCodecID codec_id, std::vector<uint8_t> extradata);
+    void opened(const char *via);
+    bool waitReconnect();
+    FramePtr retime(const FramePtr &frame);
+    void emit(const FramePtr &frame);
+    void emitAudio(const FramePtr &frame);
+    int findAudioStream();
 
     std::string url_;
     AVFormatContext *fmt_ctx_ = nullptr;
     int video_stream_idx_ = -1;
-    AVCodecID codec_id_ = AV_CODEC_ID_NONE;
-    std::vector<uint8_t> extradata_;
+    int audio_stream_idx_ = -1;
+    std::atomic<AVCodecID> codec_id_{AV_CODEC_ID_NONE};
+    mutable std::mutex extradata_mtx_;
+    std::shared_ptr<const std::vector<uint8_t>> extradata_;
+    std::shared_ptr<const AudioInfo> audio_info_;
+    bool live_; // network source: reconnect instead of ending
 
+    int loops_ = 0;
     NalCallback nal_cb_;
+    NalCallback audio_cb_;
     std::atomic<bool> running_{false};
     std::thread thread_;
+
+    // Reconnect state, on whichever thread ingests (reader thread or the
+    // client's loop)
+    Backoff backoff_;
+    std::mutex wait_mtx_;
+    std::condition_variable wait_cv_;
+    bool connected_before_ = false;
+    bool stream_start_ = false; // next frame is the first of a connection
+    int64_t pts_offset_ = 0;    // added to the source's PTS
+    int64_t last_pts_ = -1;     // last PTS emitted
+    std::chrono::steady_clock::time_point last_frame_time_;
+
+    IngestReactor *reactor_ = nullptr;
+    std::shared_ptr<RtspClient> client_;
+    std::unique_ptr<RelayClient> relay_;
+
+    std::string label_; // url without credentials
+    uint64_t frame_seq_ = 0; // trace sampling
+    std::shared_ptr<Counter> frames_metric_;
+    std::shared_ptr<Counter> bytes_metric_;
+    std::shared_ptr<Counter> keyframes_metric_;
+    std::shared_ptr<Counter> audio_frames_metric_;
+    std::shared_ptr<Counter> errors_metric_;
+    std::shared_ptr<Counter> reconnects_metric_;
 };
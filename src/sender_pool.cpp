@@ -0,0 +1,80 @@
+#include "sender_pool.h"
+#include "webrtc_session.h"
+#include <algorithm>
+
+// Frames sent per session per round, so one deep queue cannot starve the
+// other sessions on the same worker
+static constexpr size_t kDrainBudget = 8;
+
+SenderWorker::SenderWorker() : thread_(&SenderWorker::run, this) {}
+
+SenderWorker::~SenderWorker() {
+    {
+        std::lock_guard<std::mutex> lock(mtx_);
+        stop_ = true;
+    }
+    cv_.notify_one();
+    if (thread_.joinable())
+        thread_.join();
+}
+
+void SenderWorker::add(const std::shared_ptr<WebRTCSession> &session) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    sessions_.push_back(session);
+}
+
+void SenderWorker::wake() {
+    if (!pending_.exchange(true, std::memory_order_acq_rel)) {
+        std::lock_guard<std::mutex> lock(mtx_);
+        cv_.notify_one();
+    }
+}
+
+void SenderWorker::run() {
+    std::vector<std::shared_ptr<WebRTCSession>> active;
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mtx_);
+            cv_.wait(lock, [this] {
+                return stop_ || pending_.load(std::memory_order_acquire);
+            });
+            if (stop_)
+                return;
+            // Clear before draining so pushes made meanwhile wake us again
+            pending_.store(false, std::memory_order_release);
+
+            sessions_.erase(std::remove_if(sessions_.begin(), sessions_.end(),
+                                           [](const auto &w) {
+                                               return w.expired();
+                                           }),
+                            sessions_.end());
+            active.clear();
+            for (auto &w : sessions_)
+                if (auto s = w.lock())
+                    active.push_back(std::move(s));
+        }
+
+        bool more = true;
+        while (more) {
+            more = false;
+            for (auto &s : active)
+                more = s->drain(kDrainBudget) || more;
+        }
+        active.clear();
+    }
+}
+
+SenderPool::SenderPool(size_t threads) {
+    if (threads == 0)
+        threads = std::max(1u, std::thread::hardware_concurrency());
+    for (size_t i = 0; i < threads; i++)
+        workers_.push_back(std::make_shared<SenderWorker>());
+}
+
+SenderPool::~SenderPool() = default;
+
+void SenderPool::attach(const std::shared_ptr<WebRTCSession> &session) {
+    auto &worker = workers_[next_++ % workers_.size()];
+    worker->add(session);
+    session->setSender(worker);
+}
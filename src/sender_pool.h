@@ -0,0 +1,45 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class WebRTCSession;
+
+// One sender thread draining the queues of the sessions assigned to it
+class SenderWorker {
+public:
+    SenderWorker();
+    ~SenderWorker();
+
+    void add(const std::shared_ptr<WebRTCSession> &session);
+    // Called by producers after queueing; cheap when already pending
+    void wake();
+
+private:
+    void run();
+
+    std::vector<std::weak_ptr<WebRTCSession>> sessions_;
+    std::mutex mtx_;
+    std::condition_variable cv_;
+    std::atomic<bool> pending_{false};
+    bool stop_ = false;
+    std::thread thread_;
+};
+
+// Fixed pool of sender threads. The reader only pushes into per-session
+// rings; a congested viewer can then only delay its own queue.
+class SenderPool {
+public:
+    explicit SenderPool(size_t threads = 0); // 0: one per core
+    ~SenderPool();
+
+    // Assign session to a worker (round-robin)
+    void attach(const std::shared_ptr<WebRTCSession> &session);
+
+private:
+    std::vector<std::shared_ptr<SenderWorker>> workers_;
+    std::atomic<size_t> next_{0};
+};
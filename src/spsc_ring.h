@@ -0,0 +1,53 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <vector>
+
+// Bounded lock-free single-producer/single-consumer ring.
+// Capacity is rounded up to a power of two.
+template <typename T> class SpscRing {
+public:
+    explicit SpscRing(size_t capacity) : slots_(roundUp(capacity)) {
+        mask_ = slots_.size() - 1;
+    }
+
+    // Producer only. Returns false when full.
+    bool push(T value) {
+        size_t head = head_.load(std::memory_order_relaxed);
+        if (head - tail_.load(std::memory_order_acquire) == slots_.size())
+            return false;
+        slots_[head & mask_] = std::move(value);
+        head_.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    // Consumer only. Returns false when empty.
+    bool pop(T &out) {
+        size_t tail = tail_.load(std::memory_order_relaxed);
+        if (tail == head_.load(std::memory_order_acquire))
+            return false;
+        out = std::move(slots_[tail & mask_]);
+        slots_[tail & mask_] = T(); // release what the slot held
+        tail_.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+    size_t size() const {
+        return head_.load(std::memory_order_acquire) -
+               tail_.load(std::memory_order_acquire);
+    }
+    size_t capacity() const { return slots_.size(); }
+
+private:
+    static size_t roundUp(size_t n) {
+        size_t cap = 1;
+        while (cap < n)
+            cap <<= 1;
+        return cap;
+    }
+
+    std::vector<T> slots_;
+    size_t mask_ = 0;
+    alignas(64) std::atomic<size_t> head_{0};
+    alignas(64) std::atomic<size_t> tail_{0};
+};
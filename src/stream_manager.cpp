@@ -1,156 +1,518 @@
 #include "stream_manager.h"
 #include <algorithm>
-#include <cstdio>
+#include <cstring>
 #include <iostream>
-#include <thread>
 
-StreamManager::StreamManager() {}
+// Lifecycle pass interval: closed sessions are handled as they are
+// reported, this only bounds idle detection and the memory gauges
+static constexpr auto kLifecycleTick = std::chrono::seconds(1);
+// A suspended transcoder is kept this long before its codecs are freed, so
+// a viewer reloading the page does not pay for a new decoder and encoders
+static constexpr auto kTranscoderLinger = std::chrono::seconds(10);
+
+// Pacer thread, every video frame: track the parameter sets (SPS/PPS, and
+// VPS for H.265) and make sure each keyframe carries them, once per frame
+// however many sessions and renditions there are. The reader's extradata
+// is only consulted for keyframes, the only frames that may need it.
+static FramePtr withParameterSets(StreamSource &src, const FramePtr &frame) {
+    std::shared_ptr<const std::vector<uint8_t>> extra;
+    if (frame->isKeyframe())
+        extra = src.reader->extradata();
+    FramePtr out = src.params.process(frame, extra);
+    if (src.params.version() != src.params_version) {
+        src.params_version = src.params.version();
+        std::cout << "[StreamManager] Parameter sets changed: " << src.label
+                  << "\n";
+    }
+    return out;
+}
+
+// Pacer thread: decoder and encoders for the ladder, from the source's
+// current parameter sets
+static void createTranscoder(StreamSource &src, CoreBudget *budget) {
+    auto transcoder = std::make_unique<Transcoder>(src.transcode_options,
+                                                   budget, src.label);
+    // Transcoder output → sessions (before init starts the encode threads)
+    StreamSource *src_ptr = &src;
+    transcoder->setOutputCallback(
+        [src_ptr](size_t rendition, const FramePtr &h264) {
+            src_ptr->renditions->fanout(rendition).deliver(h264);
+        });
+    const auto &extra = src.params.annexB();
+    AVCodecParameters *params = avcodec_parameters_alloc();
+    params->codec_id = AV_CODEC_ID_HEVC;
+    params->codec_type = AVMEDIA_TYPE_VIDEO;
+    if (!extra.empty()) {
+        params->extradata = static_cast<uint8_t *>(
+            av_mallocz(extra.size() + AV_INPUT_BUFFER_PADDING_SIZE));
+        memcpy(params->extradata, extra.data(), extra.size());
+        params->extradata_size = static_cast<int>(extra.size());
+    }
+    transcoder->init(params);
+    avcodec_parameters_free(&params);
+    src.transcoder_version = src.params_version;
+    std::lock_guard<std::mutex> lock(src.transcoder_mtx);
+    src.transcoder = std::move(transcoder);
+}
+
+// Pacer thread, H.265 frame: passthrough viewers get it as is; the
+// transcoder runs only while a viewer on the ladder needs H.264
+static void deliverHevc(StreamSource &src, CoreBudget *budget,
+                        const FramePtr &frame) {
+    RenditionSet &set = *src.renditions;
+    if (set.hevc().sessionCount())
+        set.hevc().deliver(frame);
+
+    auto now = std::chrono::steady_clock::now();
+    if (src.transcoder && src.transcoder_version != src.params_version &&
+        frame->isKeyframe()) {
+        // New parameter sets (e.g. resolution): the scalers and encoders
+        // were sized for the old ones. Start over on this keyframe.
+        std::unique_ptr<Transcoder> released;
+        {
+            std::lock_guard<std::mutex> lock(src.transcoder_mtx);
+            released.swap(src.transcoder);
+        }
+        src.transcoding = false;
+        std::cout << "[StreamManager] Transcoder restarted for new "
+                     "parameter sets: "
+                  << src.label << "\n";
+    }
+    if (set.ladderSessions()) {
+        if (!src.transcoding) {
+            // Decoding can only start at an IRAP picture
+            if (!frame->isKeyframe())
+                return;
+            if (src.transcoder) {
+                // The ladder GOPs were dropped: viewers wait for an IDR
+                src.transcoder->requestKeyframe();
+                std::cout << "[StreamManager] Transcoding resumed: "
+                          << src.label << "\n";
+            } else {
+                createTranscoder(src, budget);
+            }
+            src.transcoding = true;
+        }
+        src.transcoder->feed(frame);
+    } else if (src.transcoding) {
+        src.transcoding = false;
+        src.suspended_since = now;
+        set.clearLadderGops();
+        std::cout << "[StreamManager] Transcoding suspended, no H.264 "
+                     "viewers: "
+                  << src.label << "\n";
+    } else if (src.transcoder && now - src.suspended_since >= kTranscoderLinger) {
+        std::unique_ptr<Transcoder> released;
+        {
+            std::lock_guard<std::mutex> lock(src.transcoder_mtx);
+            released.swap(src.transcoder);
+        }
+        std::cout << "[StreamManager] Transcoder released: " << src.label
+                  << "\n";
+    }
+}
+
+StreamSource::StreamSource(const std::string &label)
+    : label(label), params(label) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{{"source", label}};
+    viewers_metric = registry.gauge("source_viewers",
+                                    "Sessions attached to the source", labels);
+    auto memory = [&](const char *component) {
+        MetricLabels l = labels;
+        l.emplace_back("component", component);
+        return registry.gauge("source_memory_bytes",
+                              "Memory held for the source", l);
+    };
+    jitter_bytes_metric = memory("jitter");
+    gop_bytes_metric = memory("gop");
+    transcoder_bytes_metric = memory("transcoder");
+}
+
+StreamSource::~StreamSource() {
+    // Before the members go: no new frame may enter, no paced frame may
+    // reach a dying transcoder, and no encoder thread may reach the fanout
+    if (reader)
+        reader->stop();
+    if (paced)
+        paced->close();
+    if (renditions) {
+        renditions->setBitrateListener(nullptr);
+        renditions->setKeyframeListener(nullptr);
+    }
+    std::lock_guard<std::mutex> lock(transcoder_mtx);
+    transcoder.reset();
+}
+
+StreamManager::StreamManager()
+    : pacer_(std::make_unique<Pacer>(0)),
+      core_budget_(std::make_unique<CoreBudget>(0)) {
+    lifecycle_thread_ = std::thread(&StreamManager::lifecycleLoop, this);
+}
 
 StreamManager::~StreamManager() {
+    {
+        std::lock_guard<std::mutex> lock(lifecycle_mtx_);
+        lifecycle_stop_ = true;
+    }
+    lifecycle_cv_.notify_one();
+    if (lifecycle_thread_.joinable())
+        lifecycle_thread_.join();
+    relay_server_.reset();
     std::lock_guard<std::mutex> lock(sources_mtx_);
     for (auto &[url, src] : sources_) {
         src->reader->stop();
     }
 }
 
-std::string StreamManager::createSession(const std::string &rtsp_url,
-                                          const std::string &sdp_offer) {
-    // Create source first to obtain stream info (SPS/PPS)
-    StreamSource &source = getOrCreateSource(rtsp_url);
-
-    // Wait for extradata (SPS/PPS) — available once RTSP stream opens
-    std::string profile;
-    for (int i = 0; i < 50; i++) {
-        const auto &extra = source.reader->extradata();
-        if (!extra.empty()) {
-            // Find SPS NAL (type 7) in Annex-B, extract profile-level-id
-            for (size_t j = 0; j + 7 < extra.size(); j++) {
-                if (extra[j]==0 && extra[j+1]==0 && extra[j+2]==0 && extra[j+3]==1
-                    && (extra[j+4] & 0x1F) == 7) {
-                    char buf[7];
-                    snprintf(buf, sizeof(buf), "%02x%02x%02x",
-                             extra[j+5], extra[j+6], extra[j+7]);
-                    profile = buf;
-                    std::cout << "[SPS] profile-level-id=" << profile << "\n";
-                    break;
-                }
-            }
-            break;
-        }
-        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+void StreamManager::setIngestThreads(size_t threads) {
+    if (threads > 0)
+        reactor_ = std::make_unique<IngestReactor>(threads);
+}
+
+void StreamManager::setPacing(size_t threads, const PacerOptions &options) {
+    pacer_ = std::make_unique<Pacer>(threads, options);
+}
+
+void StreamManager::setTranscodeCores(size_t cores) {
+    core_budget_ = std::make_unique<CoreBudget>(cores);
+}
+
+void StreamManager::setIcePorts(uint16_t base, size_t count, bool udp_mux) {
+    ice_port_ = base;
+    ice_port_count_ = std::max<size_t>(
+        std::min<size_t>(count, 65536 - size_t(base)), 1);
+    ice_udp_mux_ = udp_mux;
+}
+
+bool StreamManager::enableCluster(const RelayEndpoint &self,
+                                  const std::vector<RelayEndpoint> &nodes) {
+    self_node_ = self.str();
+    bool has_self = false;
+    for (const auto &node : nodes) {
+        ring_.add(node.str());
+        has_self = has_self || node.str() == self_node_;
     }
+    if (!has_self)
+        ring_.add(self_node_);
 
+    // Edges only ask the node their ring names, so serve from the camera
+    relay_server_ = std::make_unique<RelayServer>(
+        self.port, [this](const std::string &url, int fd) {
+            std::lock_guard<std::mutex> lock(sources_mtx_);
+            getOrCreateSource(url, nullptr, true).relay->addSubscriber(fd);
+        });
+    return relay_server_->listening();
+}
+
+std::shared_ptr<WebRTCSession>
+StreamManager::createSession(const std::string &rtsp_url,
+                             const std::string &sdp_offer, std::string &answer,
+                             const TranscoderOptions *transcode,
+                             int rendition) {
     auto session = std::make_shared<WebRTCSession>();
-    std::string answer = session->handleOffer(sdp_offer, public_ip_, profile);
+    auto port = static_cast<uint16_t>(
+        ice_port_ + next_ice_port_.fetch_add(1, std::memory_order_relaxed) %
+                        ice_port_count_);
+    answer = session->handleOffer(sdp_offer, public_ip_, port, ice_udp_mux_);
+    attachSession(rtsp_url, session, transcode, rendition);
+    return session;
+}
+
+void StreamManager::attachSession(
+    const std::string &rtsp_url, const std::shared_ptr<WebRTCSession> &session,
+    const TranscoderOptions *transcode, int rendition) {
+    // Starts the reader if needed; frames reach the session whenever the
+    // stream opens, so there is nothing to wait for here
+    std::lock_guard<std::mutex> sources_lock(sources_mtx_);
+    StreamSource &source = getOrCreateSource(rtsp_url, transcode);
+
+    // Estimate-driven switching and encoder retargeting; the callbacks run
+    // on libdatachannel threads
+    std::vector<int> ladder_kbps;
+    for (const auto &r : source.transcode_options.ladder)
+        ladder_kbps.push_back(r.bitrate_kbps);
+    std::weak_ptr<RenditionSet> weak_set = source.renditions;
+    std::weak_ptr<WebRTCSession> weak = session;
+    session->setRenditionPolicy(std::move(ladder_kbps),
+                                [weak_set, weak](size_t index) {
+                                    auto set = weak_set.lock();
+                                    auto self = weak.lock();
+                                    if (set && self)
+                                        set->switchSession(self, index);
+                                });
+    session->setAutoRendition(rendition < 0);
+    session->onEstimate([weak_set, weak] {
+        auto set = weak_set.lock();
+        auto self = weak.lock();
+        if (set && self)
+            set->reportEstimate(self->rendition());
+    });
+    session->onKeyframeRequest([weak_set, weak] {
+        auto set = weak_set.lock();
+        auto self = weak.lock();
+        if (set && self)
+            set->requestKeyframe(self->rendition());
+    });
 
+    sender_pool_.attach(session);
+    source.renditions->addSession(
+        session, rendition < 0 ? 0 : size_t(rendition), rendition >= 0);
     {
-        std::lock_guard<std::mutex> lock(source.sessions_mtx);
-        source.sessions.push_back(session);
+        std::lock_guard<std::mutex> lock(sessions_mtx_);
+        sessions_[session->id()] = {session, source.renditions};
     }
-
-    return answer;
+    // Registered last: a session that already failed is reaped right away
+    session->onClosed([this, id = session->id()] { sessionClosed(id); });
 }
 
-StreamSource &StreamManager::getOrCreateSource(const std::string &rtsp_url) {
+bool StreamManager::sourceRunning(const std::string &rtsp_url) {
     std::lock_guard<std::mutex> lock(sources_mtx_);
+    auto it = sources_.find(rtsp_url);
+    return it != sources_.end() && it->second->reader->running();
+}
+
+std::shared_ptr<WebRTCSession>
+StreamManager::findSession(const std::string &id) {
+    std::lock_guard<std::mutex> lock(sessions_mtx_);
+    auto it = sessions_.find(id);
+    if (it == sessions_.end())
+        return nullptr;
+    return it->second.session.lock();
+}
+
+bool StreamManager::setRendition(const std::string &id, int rendition) {
+    std::shared_ptr<WebRTCSession> session;
+    std::shared_ptr<RenditionSet> set;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mtx_);
+        auto it = sessions_.find(id);
+        if (it == sessions_.end())
+            return false;
+        session = it->second.session.lock();
+        set = it->second.renditions.lock();
+    }
+    if (!session || !set)
+        return false;
+    session->setAutoRendition(rendition < 0);
+    if (rendition >= 0)
+        set->switchSession(session, size_t(rendition));
+    else if (session->acceptsHevc())
+        set->switchSession(session, WebRTCSession::kPassthrough);
+    return true;
+}
 
+StreamSource &
+StreamManager::getOrCreateSource(const std::string &rtsp_url,
+                                 const TranscoderOptions *transcode,
+                                 bool origin) {
     auto it = sources_.find(rtsp_url);
-    if (it != sources_.end())
+    if (it != sources_.end()) {
+        it->second->idle_since = {}; // a viewer or edge is on its way
+        // Reader gave up (or a file ended): a new viewer revives it, with
+        // the same sessions and timeline
+        if (!it->second->reader->running()) {
+            std::cout << "[StreamManager] Restarting source: "
+                      << redactCredentials(rtsp_url) << "\n";
+            it->second->reader->start();
+        }
         return *it->second;
+    }
 
-    auto src = std::make_unique<StreamSource>();
-    src->reader = std::make_unique<RTSPReader>(rtsp_url);
-
-    // Set NAL callback — dispatches to all sessions
+    // Metric label: the URL may carry camera credentials
+    std::string label = redactCredentials(rtsp_url);
+    auto src = std::make_unique<StreamSource>(label);
+    src->transcode_options = transcode ? *transcode : transcode_defaults_;
+    src->renditions = std::make_shared<RenditionSet>(
+        src->transcode_options.ladder.size(), label);
+    src->reader = std::make_unique<RTSPReader>(rtsp_url, reactor_.get());
+    src->reader->setLoop(input_loops_);
+    src->reader->setReconnect(reconnect_);
+    src->relay = std::make_shared<RelayFeed>(label);
     StreamSource *src_ptr = src.get();
-    src->reader->setNalCallback(
-        [src_ptr](const uint8_t *data, size_t size, AVCodecID codec_id,
-                  bool is_keyframe, int64_t pts) {
-            if (codec_id == AV_CODEC_ID_HEVC) {
-                // Need transcoding
-                if (!src_ptr->transcoder) {
-                    src_ptr->transcoder = std::make_unique<Transcoder>();
-                    auto *reader = src_ptr->reader.get();
-                    AVCodecParameters *params = avcodec_parameters_alloc();
-                    params->codec_id = AV_CODEC_ID_HEVC;
-                    params->codec_type = AVMEDIA_TYPE_VIDEO;
-                    if (!reader->extradata().empty()) {
-                        params->extradata = static_cast<uint8_t *>(
-                            av_malloc(reader->extradata().size() +
-                                      AV_INPUT_BUFFER_PADDING_SIZE));
-                        memcpy(params->extradata, reader->extradata().data(),
-                               reader->extradata().size());
-                        params->extradata_size =
-                            static_cast<int>(reader->extradata().size());
-                    }
-                    src_ptr->transcoder->init(params);
-                    avcodec_parameters_free(&params);
-
-                    // Set transcoder output → sessions
-                    src_ptr->transcoder->setOutputCallback(
-                        [src_ptr](const uint8_t *h264_data, size_t h264_size,
-                                  bool kf) {
-                            std::lock_guard<std::mutex> lock(
-                                src_ptr->sessions_mtx);
-                            for (auto &sess : src_ptr->sessions) {
-                                sess->sendFrame(h264_data, h264_size, kf);
-                            }
-                        });
-                }
-                src_ptr->transcoder->feed(data, size, 0, 0);
-            } else {
-                // H.264 — direct pass-through
-                if (is_keyframe) {
-                    std::string types;
-                    for (size_t i = 0; i+4 < size; i++)
-                        if (data[i]==0 && data[i+1]==0 && data[i+2]==0 && data[i+3]==1)
-                            types += std::to_string(data[i+4] & 0x1F) + " ";
-                    std::cout << "[H264] Keyframe NALs: " << types << "size=" << size << "\n";
-                }
+    src->renditions->setBitrateListener(
+        [src_ptr](size_t rendition, int kbps) {
+            std::lock_guard<std::mutex> lock(src_ptr->transcoder_mtx);
+            if (src_ptr->transcoder)
+                src_ptr->transcoder->setBitrate(rendition, kbps);
+        });
+    src->renditions->setKeyframeListener([src_ptr](size_t rendition) {
+        std::lock_guard<std::mutex> lock(src_ptr->transcoder_mtx);
+        if (src_ptr->transcoder && src_ptr->transcoding)
+            src_ptr->transcoder->requestKeyframe(rendition);
+    });
+    std::string owner = origin ? self_node_ : ring_.owner(rtsp_url);
+    RelayEndpoint owner_endpoint;
+    if (!owner.empty() && owner != self_node_ &&
+        RelayEndpoint::parse(owner, owner_endpoint))
+        src->reader->setRelay(owner_endpoint);
 
-                const auto &extra = src_ptr->reader->extradata();
-                if (is_keyframe && !extra.empty()) {
-                    std::vector<uint8_t> buf(extra.size() + size);
-                    memcpy(buf.data(), extra.data(), extra.size());
-                    memcpy(buf.data() + extra.size(), data, size);
-                    std::lock_guard<std::mutex> lock(src_ptr->sessions_mtx);
-                    for (auto &sess : src_ptr->sessions)
-                        sess->sendFrame(buf.data(), buf.size(), true, pts);
-                } else {
-                    std::lock_guard<std::mutex> lock(src_ptr->sessions_mtx);
-                    for (auto &sess : src_ptr->sessions)
-                        sess->sendFrame(data, size, is_keyframe, pts);
+    // Reader → jitter buffer; the pacer releases frames on their PTS
+    // schedule and dispatches them to all sessions
+    CoreBudget *budget = core_budget_.get();
+    src->paced = pacer_->createStream(
+        [src_ptr, budget](const FramePtr &frame) {
+            if (const auto &trace = frame->trace())
+                trace->mark(TraceStage::Paced);
+            if (isAudioCodec(frame->codecId())) {
+                // Same jitter buffer as the video, so both leave on the
+                // one PTS schedule
+                src_ptr->renditions->audio().deliver(
+                    frame, *src_ptr->reader->audioInfo());
+            } else if (frame->codecId() == AV_CODEC_ID_HEVC) {
+                deliverHevc(*src_ptr, budget,
+                            withParameterSets(*src_ptr, frame));
+            } else {
+                // H.264 — direct pass-through, no ladder
+                if (!src_ptr->passthrough) {
+                    src_ptr->passthrough = true;
+                    src_ptr->renditions->collapse();
                 }
+                src_ptr->renditions->fanout(0).deliver(
+                    withParameterSets(*src_ptr, frame));
             }
         });
+    // Edges get the frames as read, before pacing: they pace themselves
+    src->reader->setNalCallback([paced = src->paced, relay = src->relay,
+                                 reader = src->reader.get()](
+                                    const FramePtr &frame) {
+        relay->push(frame, *reader->extradata());
+        paced->push(frame);
+    });
+    // Audio stays on this node: edges relay video only
+    if (audio_)
+        src->reader->setAudioCallback(
+            [paced = src->paced](const FramePtr &frame) { paced->push(frame); });
 
     src->reader->start();
-    std::cout << "[StreamManager] Started source: " << rtsp_url << "\n";
+    std::cout << "[StreamManager] Started source: " << rtsp_url;
+    if (owner_endpoint.port)
+        std::cout << " (via origin " << owner << ")";
+    std::cout << "\n";
 
     auto &ref = *src;
     sources_[rtsp_url] = std::move(src);
     return ref;
 }
 
+void StreamManager::sessionClosed(const std::string &id) {
+    // libdatachannel thread: only hand it over, the teardown may block
+    {
+        std::lock_guard<std::mutex> lock(lifecycle_mtx_);
+        closed_sessions_.push_back(id);
+    }
+    lifecycle_cv_.notify_one();
+}
+
+void StreamManager::lifecycleLoop() {
+    std::unique_lock<std::mutex> lock(lifecycle_mtx_);
+    while (!lifecycle_stop_) {
+        lifecycle_cv_.wait_for(lock, kLifecycleTick, [this] {
+            return lifecycle_stop_ || !closed_sessions_.empty();
+        });
+        if (lifecycle_stop_)
+            break;
+        lock.unlock();
+        cleanup();
+        lock.lock();
+    }
+}
+
 void StreamManager::cleanup() {
-    std::lock_guard<std::mutex> lock(sources_mtx_);
-    for (auto it = sources_.begin(); it != sources_.end();) {
-        auto &src = it->second;
-        {
-            std::lock_guard<std::mutex> slock(src->sessions_mtx);
-            // Remove dead sessions
-            src->sessions.erase(
-                std::remove_if(src->sessions.begin(), src->sessions.end(),
-                               [](const auto &s) { return !s->isOpen(); }),
-                src->sessions.end());
+    std::vector<std::string> closed;
+    {
+        std::lock_guard<std::mutex> lock(lifecycle_mtx_);
+        closed.swap(closed_sessions_);
+    }
+
+    // Released after the locks: closing a PeerConnection or joining reader
+    // and codec threads may wait on threads that wait on these locks
+    std::vector<std::shared_ptr<WebRTCSession>> dead_sessions;
+    std::vector<std::unique_ptr<StreamSource>> dead_sources;
+    {
+        std::lock_guard<std::mutex> lock(sessions_mtx_);
+        for (const auto &id : closed) {
+            auto it = sessions_.find(id);
+            if (it == sessions_.end())
+                continue;
+            auto session = it->second.session.lock();
+            auto set = it->second.renditions.lock();
+            if (session && set)
+                set->removeSession(session);
+            if (session)
+                dead_sessions.push_back(std::move(session));
+            sessions_.erase(it);
         }
-        // If no sessions and reader stopped, remove source
-        if (src->sessions.empty() && !src->reader->running()) {
-            std::cout << "[StreamManager] Removing source: " << it->first
-                      << "\n";
-            it = sources_.erase(it);
-        } else {
+        for (auto it = sessions_.begin(); it != sessions_.end();) {
+            if (it->second.session.expired())
+                it = sessions_.erase(it);
+            else
+                ++it;
+        }
+    }
+    for (const auto &session : dead_sessions)
+        std::cout << "[StreamManager] Session closed: " << session->id()
+                  << "\n";
+
+    auto now = std::chrono::steady_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(sources_mtx_);
+        for (auto it = sources_.begin(); it != sources_.end();) {
+            auto &src = *it->second;
+            src.renditions->flushEstimates();
+            SourceStats stats = collectStats(src, now);
+            src.viewers_metric->set(static_cast<double>(stats.viewers));
+            src.jitter_bytes_metric->set(
+                static_cast<double>(stats.jitter_bytes));
+            src.gop_bytes_metric->set(static_cast<double>(stats.gop_bytes));
+            src.transcoder_bytes_metric->set(
+                static_cast<double>(stats.transcoder_bytes));
+
+            if (stats.viewers || stats.edges) {
+                src.idle_since = {};
+            } else if (src.idle_since == decltype(now){}) {
+                src.idle_since = now;
+            } else if (now - src.idle_since >= idle_grace_) {
+                std::cout << "[StreamManager] Removing idle source: "
+                          << src.label << "\n";
+                dead_sources.push_back(std::move(it->second));
+                it = sources_.erase(it);
+                continue;
+            }
             ++it;
         }
     }
+    dead_sessions.clear();
+    dead_sources.clear();
+}
+
+SourceStats
+StreamManager::collectStats(const StreamSource &src,
+                            std::chrono::steady_clock::time_point now) {
+    SourceStats stats;
+    stats.source = src.label;
+    stats.running = src.reader->running();
+    stats.viewers = src.renditions->sessionCount();
+    stats.edges = src.relay->subscriberCount();
+    if (src.idle_since != decltype(now){})
+        stats.idle_seconds =
+            std::chrono::duration<double>(now - src.idle_since).count();
+    stats.jitter_bytes = src.paced->bytes();
+    stats.gop_bytes = src.renditions->gopBytes();
+    stats.transcoding = src.transcoding;
+    {
+        std::lock_guard<std::mutex> lock(src.transcoder_mtx);
+        if (src.transcoder)
+            stats.transcoder_bytes = src.transcoder->memoryBytes();
+    }
+    return stats;
+}
+
+std::vector<SourceStats> StreamManager::sourceStats() {
+    auto now = std::chrono::steady_clock::now();
+    std::vector<SourceStats> stats;
+    std::lock_guard<std::mutex> lock(sources_mtx_);
+    for (const auto &[url, src] : sources_)
+        stats.push_back(collectStats(*src, now));
+    return stats;
 }
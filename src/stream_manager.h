@@ -1,18 +1,73 @@
 #pragma once
+#include "pacer.h"
+#include "parameter_sets.h"
+#include "relay.h"
+#include "rtp_fanout.h"
 #include "rtsp_reader.h"
+#include "sender_pool.h"
 #include "transcoder.h"
 #include "webrtc_session.h"
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
 #include <memory>
 #include <mutex>
 #include <string>
+#include <thread>
 #include <unordered_map>
 #include <vector>
 
 struct StreamSource {
+    explicit StreamSource(const std::string &label);
+    ~StreamSource();
+
+    std::string label; // URL without credentials
+
     std::unique_ptr<RTSPReader> reader;
-    std::unique_ptr<Transcoder> transcoder; // non-null if H.265
-    std::vector<std::shared_ptr<WebRTCSession>> sessions;
-    std::mutex sessions_mtx;
+    // Edge nodes subscribed to this source (cluster origin)
+    std::shared_ptr<RelayFeed> relay;
+    std::shared_ptr<PacedStream> paced; // jitter buffer, reader → pacer
+    // H.265 only, and only while H.264-only viewers need it: created and
+    // released by the pacer thread, which alone feeds it. Others (stats,
+    // bitrate retargeting) use it under transcoder_mtx.
+    std::unique_ptr<Transcoder> transcoder;
+    mutable std::mutex transcoder_mtx;
+    std::atomic<bool> transcoding{false}; // being fed, not suspended
+    std::chrono::steady_clock::time_point suspended_since{}; // pacer thread
+    TranscoderOptions transcode_options;
+    // In-band and extradata parameter sets; pacer thread only, like the
+    // versions: the one last logged and the one the transcoder was built on
+    ParameterSetTracker params;
+    uint64_t params_version = 0;
+    uint64_t transcoder_version = 0;
+    // One RtpFanout per ladder rendition, plus the H.265 passthrough one;
+    // packetizes once, owns the sessions
+    std::shared_ptr<RenditionSet> renditions;
+    bool passthrough = false; // pacer thread only
+
+    // Lifecycle, under StreamManager::sources_mtx_
+    std::chrono::steady_clock::time_point idle_since{}; // epoch: in use
+    std::shared_ptr<Gauge> viewers_metric;
+    std::shared_ptr<Gauge> jitter_bytes_metric;
+    std::shared_ptr<Gauge> gop_bytes_metric;
+    std::shared_ptr<Gauge> transcoder_bytes_metric;
+};
+
+// Snapshot of one source for /api/sources
+struct SourceStats {
+    std::string source; // URL without credentials
+    bool running = false;
+    size_t viewers = 0;
+    size_t edges = 0;        // relay subscribers (cluster origin)
+    double idle_seconds = 0; // without viewers or edges so far
+    bool transcoding = false; // H.264-only viewers on an H.265 source
+    // Memory held for the source
+    size_t jitter_bytes = 0;     // frames waiting in the pacer
+    size_t gop_bytes = 0;        // cached GOPs of every rendition
+    size_t transcoder_bytes = 0; // decoded/scaled pictures, estimated
+    size_t totalBytes() const {
+        return jitter_bytes + gop_bytes + transcoder_bytes;
+    }
 };
 
 class StreamManager {
@@ -21,19 +76,128 @@ public:
     ~StreamManager();
 
     void setPublicIP(const std::string &ip) { public_ip_ = ip; }
+    // Local ICE ports: sessions are spread round-robin over `count` ports
+    // from `base` (distinct per process on one host). udp_mux: all sessions
+    // on a port share one UDP socket, so viewers are not limited by free
+    // ports or sockets; more ports spread receive work over more threads.
+    // Without it each port serves one session at a time.
+    void setIcePorts(uint16_t base, size_t count, bool udp_mux);
+
+    // Origin/edge cluster: each URL is pulled only by the node it hashes to
+    // on `nodes` (consistent hashing, same list on every node); the others
+    // subscribe to that node over the relay. self: this node's relay
+    // address, listened on. Call before the first session.
+    bool enableCluster(const RelayEndpoint &self,
+                       const std::vector<RelayEndpoint> &nodes);
+
+    // Multiplex all RTSP readers over `threads` event loops instead of one
+    // thread per camera. Call before the first session.
+    void setIngestThreads(size_t threads);
 
-    // Create a new WebRTC session for the given RTSP URL
-    // Returns SDP answer
-    std::string createSession(const std::string &rtsp_url,
-                              const std::string &sdp_offer);
+    // Real-time pacing of every source on `threads` timer-wheel threads
+    // (0: one per core). Call before the first session.
+    void setPacing(size_t threads, const PacerOptions &options);
 
-    // Cleanup dead sessions periodically
+    // Codec threads shared by all transcoders (0: one per core), and the
+    // threading used by sources that do not specify their own
+    void setTranscodeCores(size_t cores);
+    void setTranscodeDefaults(const TranscoderOptions &options) {
+        transcode_defaults_ = options;
+    }
+
+    // Create a new WebRTC session for the given RTSP URL. Never blocks on
+    // the RTSP stream opening or on ICE gathering: `answer` is filled right
+    // away and later candidates trickle through the returned session.
+    // `transcode` applies only if this call starts the source. rendition:
+    // ladder index to pin the viewer to, or -1 to follow REMB.
+    std::shared_ptr<WebRTCSession>
+    createSession(const std::string &rtsp_url, const std::string &sdp_offer,
+                  std::string &answer,
+                  const TranscoderOptions *transcode = nullptr,
+                  int rendition = -1);
+
+    // Attach an already set up session (e.g. WebRTCSession::setSink) to
+    // the source, starting it if needed. createSession() without the SDP.
+    void attachSession(const std::string &rtsp_url,
+                       const std::shared_ptr<WebRTCSession> &session,
+                       const TranscoderOptions *transcode = nullptr,
+                       int rendition = -1);
+
+    // Local files: replay each input `times` more times (-1: forever).
+    // Call before the first session.
+    void setInputLoops(int times) { input_loops_ = times; }
+    // Demux the cameras' audio and send it to viewers that negotiated an
+    // audio track (default on). Call before the first session.
+    void setAudio(bool enabled) { audio_ = enabled; }
+    // Reconnect policy of every live source. Call before the first session.
+    void setReconnect(const ReconnectOptions &options) {
+        reconnect_ = options;
+    }
+    // False once the source's reader stopped (EOF, out of reconnect
+    // attempts) or if unknown; true while reconnecting
+    bool sourceRunning(const std::string &rtsp_url);
+
+    // Look up a live session by WebRTCSession::id() (trickle ICE)
+    std::shared_ptr<WebRTCSession> findSession(const std::string &id);
+
+    // Pin a session to a ladder index, or -1 to go back to REMB-driven
+    // switching. False if the session is gone.
+    bool setRendition(const std::string &id, int rendition);
+
+    // Lifecycle: a session is torn down as soon as its PeerConnection fails
+    // or closes; a source without viewers or edges for `grace` is stopped
+    // (reader, transcoder, caches). A background thread does both; cleanup()
+    // runs the same pass at once.
+    void setIdleGrace(std::chrono::milliseconds grace) { idle_grace_ = grace; }
     void cleanup();
 
+    // Per-source viewers and memory accounting (also exported as metrics)
+    std::vector<SourceStats> sourceStats();
+
 private:
-    StreamSource &getOrCreateSource(const std::string &rtsp_url);
+    // origin: always pull from the camera (a relay subscription), whatever
+    // the ring says
+    // Caller holds sources_mtx_, so the source cannot be reaped before the
+    // viewer or edge is attached
+    StreamSource &getOrCreateSource(const std::string &rtsp_url,
+                                    const TranscoderOptions *transcode,
+                                    bool origin = false);
+    void sessionClosed(const std::string &id);
+    void lifecycleLoop();
+    SourceStats collectStats(const StreamSource &src,
+                             std::chrono::steady_clock::time_point now);
 
+    // Declared before sources_ so they outlive every source and session
+    SenderPool sender_pool_;
+    // Closed-session notices, from libdatachannel threads
+    std::vector<std::string> closed_sessions_;
+    bool lifecycle_stop_ = false;
+    std::mutex lifecycle_mtx_;
+    std::condition_variable lifecycle_cv_;
+    std::chrono::milliseconds idle_grace_{30000};
+    std::unique_ptr<IngestReactor> reactor_;
+    std::unique_ptr<Pacer> pacer_;
+    std::unique_ptr<CoreBudget> core_budget_;
+    TranscoderOptions transcode_defaults_;
     std::unordered_map<std::string, std::unique_ptr<StreamSource>> sources_;
     std::mutex sources_mtx_;
+    struct SessionEntry {
+        std::weak_ptr<WebRTCSession> session;
+        std::weak_ptr<RenditionSet> renditions;
+    };
+    std::unordered_map<std::string, SessionEntry> sessions_;
+    std::mutex sessions_mtx_;
     std::string public_ip_;
+    uint16_t ice_port_ = 9000;
+    size_t ice_port_count_ = 1;
+    bool ice_udp_mux_ = true;
+    std::atomic<size_t> next_ice_port_{0};
+    int input_loops_ = 0;
+    bool audio_ = true;
+    ReconnectOptions reconnect_;
+    HashRing ring_;
+    std::string self_node_;
+    std::thread lifecycle_thread_;
+    // Last: its accept thread creates sources
+    std::unique_ptr<RelayServer> relay_server_;
 };
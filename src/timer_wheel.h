@@ -0,0 +1,104 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+// Hierarchical timing wheel with 1-tick resolution: a 256-slot inner wheel
+// plus three 64-slot outer wheels (~2^26 ticks). Entries cascade inward as
+// the wheel turns, so insert and expiry are O(1). Single-threaded.
+template <typename T> class TimerWheel {
+public:
+    explicit TimerWheel(uint64_t now = 0) : current_(now) {}
+
+    void insert(uint64_t expiry, T value) {
+        if (expiry <= current_)
+            expiry = current_ + 1;
+        place(expiry, std::move(value));
+        size_++;
+    }
+
+    // Turn the wheel up to `now`, calling fn(value) for every expired entry
+    template <typename Fn> void advance(uint64_t now, Fn &&fn) {
+        if (size_ == 0 && current_ < now) {
+            current_ = now; // nothing to cascade, jump straight there
+            return;
+        }
+        while (current_ < now) {
+            current_++;
+            size_t idx = current_ & kInnerMask;
+            if (idx == 0)
+                cascade(1);
+            auto due = std::move(inner_[idx]);
+            inner_[idx].clear();
+            size_ -= due.size();
+            for (auto &e : due)
+                fn(e.second);
+        }
+    }
+
+    size_t size() const { return size_; }
+    uint64_t now() const { return current_; }
+
+    // Tick advance() next has work at, 0 if empty: the earliest inner
+    // expiry before the next inner wrap, else that wrap (an outer slot may
+    // cascade there). Never later than the earliest expiry, so sleeping
+    // until it misses nothing.
+    uint64_t nextExpiry() const {
+        if (size_ == 0)
+            return 0;
+        uint64_t wrap = (current_ | kInnerMask) + 1;
+        for (uint64_t tick = current_ + 1; tick < wrap; tick++) {
+            if (!inner_[tick & kInnerMask].empty())
+                return tick;
+        }
+        return wrap;
+    }
+
+private:
+    static constexpr int kInnerBits = 8;
+    static constexpr int kOuterBits = 6;
+    static constexpr int kLevels = 3;
+    static constexpr uint64_t kInnerMask = (1u << kInnerBits) - 1;
+    static constexpr uint64_t kOuterMask = (1u << kOuterBits) - 1;
+    using Slot = std::vector<std::pair<uint64_t, T>>;
+
+    static int shift(int level) {
+        return kInnerBits + (level - 1) * kOuterBits;
+    }
+
+    void place(uint64_t expiry, T value) {
+        uint64_t delta = expiry - current_;
+        if (delta < (1u << kInnerBits)) {
+            inner_[expiry & kInnerMask].emplace_back(expiry, std::move(value));
+            return;
+        }
+        for (int level = 1; level <= kLevels; level++) {
+            if (delta < (uint64_t(1) << (shift(level) + kOuterBits)) ||
+                level == kLevels) {
+                size_t idx = (expiry >> shift(level)) & kOuterMask;
+                outer_[level - 1][idx].emplace_back(expiry, std::move(value));
+                return;
+            }
+        }
+    }
+
+    // Move the current slot of `level` one level in, recursing when that
+    // level itself wraps
+    void cascade(int level) {
+        if (level > kLevels)
+            return;
+        size_t idx = (current_ >> shift(level)) & kOuterMask;
+        if (idx == 0)
+            cascade(level + 1);
+        auto entries = std::move(outer_[level - 1][idx]);
+        outer_[level - 1][idx].clear();
+        for (auto &e : entries)
+            place(e.first, std::move(e.second));
+    }
+
+    uint64_t current_;
+    size_t size_ = 0;
+    Slot inner_[1u << kInnerBits];
+    Slot outer_[kLevels][1u << kOuterBits];
+};
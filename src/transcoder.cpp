@@ -1,26 +1,160 @@
 #include "transcoder.h"
+#include <algorithm>
+#include <chrono>
+#include <climits>
 #include <iostream>
+#include <string>
 
 extern "C" {
 #include <libavutil/imgutils.h>
 #include <libavutil/opt.h>
 }
 
-Transcoder::Transcoder() {
-    frame_ = av_frame_alloc();
-    enc_pkt_ = av_packet_alloc();
+// Compressed packets buffered ahead of the decoder (~1 s at 30 fps)
+static constexpr size_t kInputDepth = 32;
+// Threads per codec when the source leaves it on auto
+static constexpr size_t kAutoThreads = 4;
+// Input, decoder and encoder timestamps: the RTP video clock
+static constexpr AVRational kTimeBase{1, 90000};
+
+// Feed time rides through both codecs in AVPacket/AVFrame::opaque
+// (AV_CODEC_FLAG_COPY_OPAQUE), so reordering and skipped frames cannot
+// mismatch it
+static int64_t monotonicUs() {
+    return std::chrono::duration_cast<std::chrono::microseconds>(
+               std::chrono::steady_clock::now().time_since_epoch())
+        .count();
+}
+
+// A sampled frame's trace rides along in opaque_ref the same way
+static AVBufferRef *boxTrace(TracePtr trace) {
+    auto *box = new TracePtr(std::move(trace));
+    AVBufferRef *ref = av_buffer_create(
+        reinterpret_cast<uint8_t *>(box), sizeof(*box),
+        [](void *, uint8_t *data) { delete reinterpret_cast<TracePtr *>(data); },
+        nullptr, 0);
+    if (!ref)
+        delete box;
+    return ref;
+}
+
+static TracePtr unboxTrace(const AVBufferRef *ref) {
+    return ref ? *reinterpret_cast<const TracePtr *>(ref->data) : nullptr;
+}
+
+CoreBudget::CoreBudget(size_t cores) {
+    if (cores == 0)
+        cores = std::max(1u, std::thread::hardware_concurrency());
+    available_ = cores;
+}
+
+size_t CoreBudget::acquire(size_t want, size_t min) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    size_t granted = std::max(min, std::min(want, available_));
+    if (granted > available_) {
+        overdraft_ += granted - available_;
+        available_ = 0;
+    } else {
+        available_ -= granted;
+    }
+    return granted;
+}
+
+void CoreBudget::release(size_t n) {
+    std::lock_guard<std::mutex> lock(mtx_);
+    size_t repay = std::min(n, overdraft_);
+    overdraft_ -= repay;
+    available_ += n - repay;
+}
+
+std::vector<Rendition> parseLadder(const std::string &spec) {
+    std::vector<Rendition> ladder;
+    size_t pos = 0;
+    while (pos < spec.size()) {
+        size_t end = spec.find(',', pos);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string step = spec.substr(pos, end - pos);
+        Rendition r;
+        r.height = std::atoi(step.c_str());
+        size_t colon = step.find(':');
+        if (colon != std::string::npos)
+            r.bitrate_kbps = std::atoi(step.c_str() + colon + 1);
+        ladder.push_back(r);
+        pos = end + 1;
+    }
+    if (ladder.empty())
+        ladder.emplace_back();
+    return ladder;
+}
+
+Transcoder::Stage::~Stage() {
+    decoded.close();
+    converted.close();
+    av_packet_free(&enc_pkt);
+    if (enc_ctx)
+        avcodec_free_context(&enc_ctx);
+    if (sws_ctx)
+        sws_freeContext(sws_ctx);
+}
+
+Transcoder::Transcoder(const TranscoderOptions &options, CoreBudget *budget,
+                       const std::string &source)
+    : options_(options), budget_(budget), input_(kInputDepth) {
+    auto &registry = MetricsRegistry::global();
+    MetricLabels labels{{"source", source}};
+    fed_metric_ = registry.counter("transcode_input_frames_total",
+                                   "H.265 frames queued for decoding", labels);
+    dropped_metric_ = registry.counter(
+        "transcode_input_dropped_total",
+        "H.265 frames dropped because the decoder fell behind", labels);
+    input_depth_ = registry.gauge("transcode_input_depth",
+                                  "Frames waiting for the decoder", labels);
+
+    if (options_.ladder.empty())
+        options_.ladder.emplace_back();
+    for (const auto &r : options_.ladder) {
+        stages_.push_back(std::make_unique<Stage>(r, options_.queue_depth));
+        Stage &stage = *stages_.back();
+        stage.enc_pkt = av_packet_alloc();
+        MetricLabels stage_labels = labels;
+        stage_labels.emplace_back("rendition",
+                                  std::to_string(stages_.size() - 1));
+        stage.skipped = registry.counter(
+            "transcode_skipped_frames_total",
+            "Decoded frames a rendition was too slow to encode", stage_labels);
+        stage.latency = registry.histogram(
+            "transcode_latency_seconds",
+            "From feed to encoded H.264 packet", stage_labels);
+        stage.keyframe_requests = registry.counter(
+            "transcode_keyframe_requests_total",
+            "Viewers' PLI/FIR for a rendition", stage_labels);
+        stage.forced_keyframes = registry.counter(
+            "transcode_forced_keyframes_total",
+            "IDRs encoded for viewers' PLI/FIR, requests coalesced",
+            stage_labels);
+    }
 }
 
 Transcoder::~Transcoder() {
-    av_frame_free(&frame_);
-    av_frame_free(&sw_frame_);
-    av_packet_free(&enc_pkt_);
+    stop();
+    stages_.clear();
     if (dec_ctx_)
         avcodec_free_context(&dec_ctx_);
-    if (enc_ctx_)
-        avcodec_free_context(&enc_ctx_);
-    if (sws_ctx_)
-        sws_freeContext(sws_ctx_);
+    if (budget_)
+        budget_->release(granted_);
+}
+
+void Transcoder::stop() {
+    input_.close();
+    for (auto &stage : stages_) {
+        stage->decoded.close();
+        stage->converted.close();
+    }
+    for (auto &t : threads_)
+        if (t.joinable())
+            t.join();
+    threads_.clear();
 }
 
 bool Transcoder::init(const AVCodecParameters *hevc_params) {
@@ -29,116 +163,389 @@ bool Transcoder::init(const AVCodecParameters *hevc_params) {
         std::cerr << "[Transcoder] HEVC decoder not found\n";
         return false;
     }
+
+    // Reserve codec threads up front, at least one per codec
+    size_t want_dec = options_.decode_threads > 0
+                          ? static_cast<size_t>(options_.decode_threads)
+                          : kAutoThreads;
+    size_t want_enc = options_.encode_threads > 0
+                          ? static_cast<size_t>(options_.encode_threads)
+                          : kAutoThreads;
+    size_t dec_threads = budget_ ? budget_->acquire(want_dec, 1) : want_dec;
+    granted_ = budget_ ? dec_threads : 0;
+    std::string enc_threads;
+    for (auto &stage : stages_) {
+        size_t n = budget_ ? budget_->acquire(want_enc, 1) : want_enc;
+        granted_ += budget_ ? n : 0;
+        stage->encode_threads = static_cast<int>(n);
+        enc_threads += (enc_threads.empty() ? "" : ",") + std::to_string(n);
+    }
+
     dec_ctx_ = avcodec_alloc_context3(decoder);
     if (hevc_params)
         avcodec_parameters_to_context(dec_ctx_, hevc_params);
+    dec_threads_ = dec_threads;
+    dec_ctx_->thread_count = static_cast<int>(dec_threads);
+    dec_ctx_->thread_type = options_.decode_thread_type;
+    dec_ctx_->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+    dec_ctx_->pkt_timebase = kTimeBase;
     if (avcodec_open2(dec_ctx_, decoder, nullptr) < 0) {
         std::cerr << "[Transcoder] Failed to open HEVC decoder\n";
         return false;
     }
+    if (dec_ctx_->framerate.num > 0 && dec_ctx_->framerate.den > 0)
+        frame_interval_ = av_rescale_q(1, av_inv_q(dec_ctx_->framerate),
+                                       kTimeBase);
+    std::cout << "[Transcoder] Threads: decode=" << dec_threads
+              << " encode=" << enc_threads << "\n";
 
+    threads_.emplace_back(&Transcoder::decodeLoop, this);
+    for (size_t i = 0; i < stages_.size(); i++) {
+        threads_.emplace_back(&Transcoder::convertLoop, this,
+                              std::ref(*stages_[i]));
+        threads_.emplace_back(&Transcoder::encodeLoop, this, i);
+    }
     initialized_ = true;
     return true;
 }
 
-void Transcoder::feed(const uint8_t *data, size_t size, int64_t pts,
-                      int64_t dts) {
+void Transcoder::feed(const FramePtr &frame) {
     if (!initialized_)
         return;
 
-    AVPacket *pkt = av_packet_alloc();
-    pkt->data = const_cast<uint8_t *>(data);
-    pkt->size = static_cast<int>(size);
-    pkt->pts = pts;
-    pkt->dts = dts;
+    // Deltas after a gap would not decode anyway
+    if (dropping_ && !frame->isKeyframe()) {
+        dropped_metric_->add();
+        return;
+    }
+    if (!input_.tryPush({frame, monotonicUs()})) {
+        if (!dropping_)
+            std::cerr << "[Transcoder] Decoder behind, dropping to next "
+                         "keyframe\n";
+        dropping_ = true;
+        dropped_metric_->add();
+        return;
+    }
+    dropping_ = false;
+    fed_metric_->add();
+    input_depth_->set(static_cast<double>(input_.size()));
+}
 
-    int ret = avcodec_send_packet(dec_ctx_, pkt);
-    av_packet_free(&pkt);
-    if (ret < 0)
+void Transcoder::setBitrate(size_t rendition, int kbps) {
+    if (rendition >= stages_.size())
+        return;
+    Stage &stage = *stages_[rendition];
+    int configured = stage.config.bitrate_kbps;
+    if (configured <= 0)
         return;
+    stage.target_kbps = std::clamp(kbps, configured / 4, configured);
+}
 
-    while (true) {
-        ret = avcodec_receive_frame(dec_ctx_, frame_);
-        if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-            break;
+void Transcoder::requestKeyframe() {
+    for (auto &stage : stages_)
+        stage->force_keyframe.store(true, std::memory_order_relaxed);
+}
+
+void Transcoder::requestKeyframe(size_t rendition) {
+    if (rendition >= stages_.size())
+        return;
+    Stage &stage = *stages_[rendition];
+    stage.keyframe_requests->add();
+    stage.keyframe_wanted.store(true, std::memory_order_relaxed);
+}
+
+// HEVC keeps up to 16 references, 6 is typical; x264 ultrafast/zerolatency
+// holds one reference plus the picture being encoded per thread
+static constexpr size_t kDecoderReferences = 6;
+static constexpr size_t kEncoderReferences = 1;
+
+static size_t pictureBytes(const AVFrame *frame) {
+    int size = av_image_get_buffer_size(
+        static_cast<AVPixelFormat>(frame->format), frame->width,
+        frame->height, 1);
+    return size > 0 ? static_cast<size_t>(size) : 0;
+}
+
+size_t Transcoder::memoryBytes() const {
+    size_t decoded = picture_bytes_.load(std::memory_order_relaxed);
+    size_t total = decoded * (kDecoderReferences + dec_threads_);
+    for (const auto &stage : stages_) {
+        size_t picture = stage->picture_bytes.load(std::memory_order_relaxed);
+        // Queued decoded frames are extra references to decoder pictures
+        total += decoded * stage->decoded.size();
+        size_t ring = stage->ring_size.load(std::memory_order_relaxed);
+        total += picture * (ring + kEncoderReferences +
+                            static_cast<size_t>(stage->encode_threads));
+    }
+    return total;
+}
+
+void Transcoder::decodeLoop() {
+    AVPacket *pkt = av_packet_alloc();
+    AVFramePtr decoded(av_frame_alloc());
+    int64_t last_pts = AV_NOPTS_VALUE;
+    Input input;
+    while (input_.pop(input)) {
+        input_depth_->set(static_cast<double>(input_.size()));
+        // Share the frame's buffer with the decoder instead of copying it
+        if (!input.frame->toPacket(pkt))
+            continue;
+        // Decode order is not known here (no DTS over RTP); the decoder
+        // reorders and hands each picture back with its own PTS
+        int64_t pts = input.frame->pts();
+        pkt->pts = pts >= 0 ? pts : AV_NOPTS_VALUE;
+        pkt->dts = AV_NOPTS_VALUE;
+        pkt->opaque = reinterpret_cast<void *>(static_cast<intptr_t>(
+            input.fed_us));
+        if (const auto &trace = input.frame->trace())
+            pkt->opaque_ref = boxTrace(trace);
+        int ret = avcodec_send_packet(dec_ctx_, pkt);
+        av_packet_unref(pkt);
+        input.frame.reset();
         if (ret < 0)
-            break;
+            continue;
 
-        // Lazy-init encoder + swscale on first decoded frame
-        if (!enc_ctx_) {
-            const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
-            if (!encoder) {
-                std::cerr << "[Transcoder] H.264 encoder not found\n";
-                av_frame_unref(frame_);
-                return;
+        // EAGAIN, EOF or error ends the batch
+        while (avcodec_receive_frame(dec_ctx_, decoded.get()) >= 0) {
+            TracePtr trace = unboxTrace(decoded->opaque_ref);
+            if (trace)
+                trace->mark(TraceStage::Decoded);
+            picture_bytes_.store(pictureBytes(decoded.get()),
+                                 std::memory_order_relaxed);
+            decoded->pts = decoded->best_effort_timestamp;
+            if (decoded->pts != AV_NOPTS_VALUE) {
+                // Follows variable frame rate; gaps (loss, reconnect) and
+                // reordering glitches are not a frame duration
+                if (last_pts != AV_NOPTS_VALUE) {
+                    int64_t delta = decoded->pts - last_pts;
+                    if (delta > 0 && delta < kTimeBase.den)
+                        frame_interval_.store(delta,
+                                              std::memory_order_relaxed);
+                }
+                last_pts = decoded->pts;
             }
-            enc_ctx_ = avcodec_alloc_context3(encoder);
-            enc_ctx_->width = frame_->width;
-            enc_ctx_->height = frame_->height;
-            enc_ctx_->pix_fmt = AV_PIX_FMT_YUV420P;
-            enc_ctx_->time_base = {1, 30};
-            enc_ctx_->framerate = {30, 1};
-            enc_ctx_->gop_size = 60;
-            enc_ctx_->max_b_frames = 0;
-
-            av_opt_set(enc_ctx_->priv_data, "preset", "ultrafast", 0);
-            av_opt_set(enc_ctx_->priv_data, "tune", "zerolatency", 0);
-            av_opt_set(enc_ctx_->priv_data, "profile", "baseline", 0);
-
-            if (avcodec_open2(enc_ctx_, encoder, nullptr) < 0) {
-                std::cerr << "[Transcoder] Failed to open H.264 encoder\n";
-                avcodec_free_context(&enc_ctx_);
-                av_frame_unref(frame_);
-                return;
+            // Every rendition gets a reference, not a copy. A rendition
+            // that cannot keep up skips the frame instead of stalling the
+            // decoder for the others (its encoder then just sees fewer).
+            for (size_t i = 0; i < stages_.size(); i++) {
+                AVFramePtr ref(av_frame_clone(decoded.get()));
+                if (!ref)
+                    continue;
+                if (trace) {
+                    av_buffer_unref(&ref->opaque_ref);
+                    ref->opaque_ref =
+                        boxTrace(trace->fork("r" + std::to_string(i)));
+                }
+                if (!stages_[i]->decoded.tryPush(std::move(ref)))
+                    stages_[i]->skipped->add();
             }
+            av_frame_unref(decoded.get());
+        }
+    }
+    av_packet_free(&pkt);
+}
 
-            // Setup swscale if needed
-            auto src_fmt = static_cast<AVPixelFormat>(frame_->format);
-            if (src_fmt != AV_PIX_FMT_YUV420P) {
-                sws_ctx_ = sws_getContext(
-                    frame_->width, frame_->height, src_fmt, frame_->width,
-                    frame_->height, AV_PIX_FMT_YUV420P, SWS_FAST_BILINEAR,
-                    nullptr, nullptr, nullptr);
-                sw_frame_ = av_frame_alloc();
-                sw_frame_->format = AV_PIX_FMT_YUV420P;
-                sw_frame_->width = frame_->width;
-                sw_frame_->height = frame_->height;
-                av_frame_get_buffer(sw_frame_, 0);
+void Transcoder::convertLoop(Stage &stage) {
+    AVFramePtr frame;
+    while (stage.decoded.pop(frame)) {
+        auto src_fmt = static_cast<AVPixelFormat>(frame->format);
+        TracePtr trace = unboxTrace(frame->opaque_ref);
+        if (stage.width == 0) {
+            // Keep aspect ratio, even dimensions, never upscale
+            stage.width = frame->width;
+            stage.height = frame->height;
+            int h = stage.config.height;
+            if (h > 0 && h < frame->height) {
+                stage.height = h & ~1;
+                stage.width = static_cast<int>(int64_t(frame->width) * h /
+                                               frame->height) &
+                              ~1;
             }
+            stage.picture_bytes.store(size_t(stage.width) * stage.height * 3 /
+                                          2,
+                                      std::memory_order_relaxed);
+        }
 
-            std::cout << "[Transcoder] Initialized: " << frame_->width << "x"
-                      << frame_->height << " fmt=" << frame_->format << "\n";
+        if (src_fmt == AV_PIX_FMT_YUV420P && stage.width == frame->width &&
+            stage.height == frame->height) {
+            if (trace)
+                trace->mark(TraceStage::Converted);
+            if (!stage.converted.push(std::move(frame)))
+                break;
+            continue;
         }
 
-        // Convert pixel format if needed
-        AVFrame *enc_frame = frame_;
-        if (sws_ctx_ && sw_frame_) {
-            sws_scale(sws_ctx_, frame_->data, frame_->linesize, 0,
-                      frame_->height, sw_frame_->data, sw_frame_->linesize);
-            sw_frame_->pts = frame_->pts;
-            enc_frame = sw_frame_;
+        // Lazy-init swscale plus a small ring of output frames: one per
+        // queue slot, one being encoded, one being written
+        if (!stage.sws_ctx) {
+            int flags = stage.width == frame->width ? SWS_FAST_BILINEAR
+                                                    : SWS_BILINEAR;
+            stage.sws_ctx = sws_getContext(
+                frame->width, frame->height, src_fmt, stage.width,
+                stage.height, AV_PIX_FMT_YUV420P, flags, nullptr, nullptr,
+                nullptr);
+            for (size_t i = 0; i < options_.queue_depth + 2; i++) {
+                AVFramePtr out(av_frame_alloc());
+                out->format = AV_PIX_FMT_YUV420P;
+                out->width = stage.width;
+                out->height = stage.height;
+                av_frame_get_buffer(out.get(), 0);
+                stage.sws_pool.push_back(std::move(out));
+            }
+            stage.ring_size.store(stage.sws_pool.size(),
+                                  std::memory_order_relaxed);
         }
 
-        // Encode
-        ret = avcodec_send_frame(enc_ctx_, enc_frame);
-        if (ret < 0) {
-            av_frame_unref(frame_);
+        auto &pool = stage.sws_pool;
+        AVFrame *out = pool[stage.sws_next++ % pool.size()].get();
+        // Copies only if the encoder still holds the previous contents
+        if (av_frame_make_writable(out) < 0)
             continue;
+        sws_scale(stage.sws_ctx, frame->data, frame->linesize, 0,
+                  frame->height, out->data, out->linesize);
+        out->pts = frame->pts;
+        out->opaque = frame->opaque;
+        av_buffer_replace(&out->opaque_ref, frame->opaque_ref);
+        frame.reset();
+        if (trace)
+            trace->mark(TraceStage::Converted);
+
+        AVFramePtr ref(av_frame_alloc());
+        av_frame_ref(ref.get(), out);
+        if (!stage.converted.push(std::move(ref)))
+            break;
+    }
+}
+
+bool Transcoder::openEncoder(Stage &stage, const AVFrame *frame) {
+    const AVCodec *encoder = avcodec_find_encoder(AV_CODEC_ID_H264);
+    if (!encoder) {
+        std::cerr << "[Transcoder] H.264 encoder not found\n";
+        return false;
+    }
+    auto *enc = avcodec_alloc_context3(encoder);
+    enc->width = frame->width;
+    enc->height = frame->height;
+    enc->pix_fmt = AV_PIX_FMT_YUV420P;
+    // Input PTS as is; the frame rate only guides rate control, so a VFR
+    // camera is timed by its PTS, not by a nominal rate
+    enc->time_base = kTimeBase;
+    int64_t interval = frame_interval_.load(std::memory_order_relaxed);
+    av_reduce(&enc->framerate.num, &enc->framerate.den, kTimeBase.den,
+              interval, INT_MAX);
+    enc->gop_size = 60;
+    enc->max_b_frames = 0;
+    enc->thread_count = stage.encode_threads;
+    enc->thread_type = options_.encode_thread_type;
+    enc->flags |= AV_CODEC_FLAG_COPY_OPAQUE;
+    if (stage.config.bitrate_kbps > 0) {
+        // Capped VBR with a 1 s buffer, so the rendition really fits links
+        // of that size
+        enc->bit_rate = int64_t(stage.config.bitrate_kbps) * 1000;
+        enc->rc_max_rate = enc->bit_rate;
+        enc->rc_buffer_size = static_cast<int>(enc->bit_rate);
+    }
+
+    av_opt_set(enc->priv_data, "preset", "ultrafast", 0);
+    av_opt_set(enc->priv_data, "tune", "zerolatency", 0);
+    av_opt_set(enc->priv_data, "profile", "baseline", 0);
+    // An I picture type is honoured as an IDR, not just a recovery point
+    av_opt_set(enc->priv_data, "forced-idr", "1", 0);
+
+    if (avcodec_open2(enc, encoder, nullptr) < 0) {
+        std::cerr << "[Transcoder] Failed to open H.264 encoder\n";
+        avcodec_free_context(&enc);
+        return false;
+    }
+    stage.enc_ctx = enc;
+    stage.applied_kbps = stage.config.bitrate_kbps;
+    std::cout << "[Transcoder] Initialized: " << frame->width << "x"
+              << frame->height;
+    if (stage.config.bitrate_kbps > 0)
+        std::cout << " @ " << stage.config.bitrate_kbps << " kbps";
+    std::cout << "\n";
+    return true;
+}
+
+void Transcoder::encodeLoop(size_t index) {
+    Stage &stage = *stages_[index];
+    AVFramePtr frame;
+    while (stage.converted.pop(frame)) {
+        if (!stage.enc_ctx && !openEncoder(stage, frame.get()))
+            return;
+
+        // libx264 picks up bit_rate/VBV changes on the next frame
+        int target = stage.target_kbps.load(std::memory_order_relaxed);
+        if (target > 0 && target != stage.applied_kbps) {
+            stage.enc_ctx->bit_rate = int64_t(target) * 1000;
+            stage.enc_ctx->rc_max_rate = stage.enc_ctx->bit_rate;
+            stage.enc_ctx->rc_buffer_size =
+                static_cast<int>(stage.enc_ctx->bit_rate);
+            if (stage.applied_kbps > 0)
+                std::cout << "[Transcoder] Rendition " << index << " -> "
+                          << target << " kbps\n";
+            stage.applied_kbps = target;
         }
 
-        while (true) {
-            ret = avcodec_receive_packet(enc_ctx_, enc_pkt_);
-            if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
-                break;
-            if (ret < 0)
-                break;
+        // x264 needs strictly increasing PTS: unknown or repeated ones are
+        // placed one frame interval after the previous frame
+        if (stage.last_pts != AV_NOPTS_VALUE &&
+            (frame->pts == AV_NOPTS_VALUE || frame->pts <= stage.last_pts))
+            frame->pts = stage.last_pts +
+                         frame_interval_.load(std::memory_order_relaxed);
+        else if (frame->pts == AV_NOPTS_VALUE)
+            frame->pts = 0;
+        stage.last_pts = frame->pts;
+
+        // Viewers' requests wait out the interval since the last IDR (on
+        // the PTS clock, so no timer); meanwhile they pile up into one
+        const int64_t min_interval =
+            int64_t(options_.min_keyframe_interval_ms) * kTimeBase.den / 1000;
+        bool idr = stage.force_keyframe.exchange(false,
+                                                 std::memory_order_relaxed);
+        if (!idr && stage.keyframe_wanted.load(std::memory_order_relaxed) &&
+            (stage.last_idr_pts == AV_NOPTS_VALUE ||
+             frame->pts < stage.last_idr_pts ||
+             frame->pts - stage.last_idr_pts >= min_interval)) {
+            idr = true;
+            stage.forced_keyframes->add();
+        }
+        if (idr) {
+            stage.keyframe_wanted.store(false, std::memory_order_relaxed);
+            frame->pict_type = AV_PICTURE_TYPE_I;
+        }
 
+        int ret = avcodec_send_frame(stage.enc_ctx, frame.get());
+        frame.reset();
+        if (ret < 0)
+            continue;
+
+        // EAGAIN, EOF or error ends the batch
+        while (avcodec_receive_packet(stage.enc_ctx, stage.enc_pkt) >= 0) {
+            if (auto fed = reinterpret_cast<intptr_t>(stage.enc_pkt->opaque))
+                stage.latency->record(static_cast<uint64_t>(
+                    std::max<int64_t>(monotonicUs() - fed, 0)));
+            bool kf = (stage.enc_pkt->flags & AV_PKT_FLAG_KEY) != 0;
+            if (kf) {
+                // Forced or the GOP's own: it serves pending requests too
+                stage.last_idr_pts = stage.enc_pkt->pts;
+                stage.keyframe_wanted.store(false, std::memory_order_relaxed);
+            }
             if (output_cb_) {
-                bool kf = (enc_pkt_->flags & AV_PKT_FLAG_KEY) != 0;
-                output_cb_(enc_pkt_->data, enc_pkt_->size, kf);
+                // No B-frames: output PTS is the input picture's
+                int64_t pts = stage.enc_pkt->pts != AV_NOPTS_VALUE
+                                  ? stage.enc_pkt->pts
+                                  : -1;
+                auto out = MediaFrame::fromPacket(stage.enc_pkt,
+                                                  AV_CODEC_ID_H264, kf, pts);
+                if (auto trace = unboxTrace(stage.enc_pkt->opaque_ref)) {
+                    trace->mark(TraceStage::Encoded);
+                    out = out ? out->withTrace(std::move(trace)) : out;
+                }
+                if (out)
+                    output_cb_(index, out);
             }
-            av_packet_unref(enc_pkt_);
+            av_packet_unref(stage.enc_pkt);
         }
-        av_frame_unref(frame_);
     }
 }
@@ -1,6 +1,14 @@
 #pragma once
+#include "bounded_queue.h"
+#include "media_frame.h"
+#include "metrics.h"
+#include <atomic>
 #include <cstdint>
 #include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
 #include <vector>
 
 extern "C" {
@@ -8,28 +16,161 @@ extern "C" {
 #include <libswscale/swscale.h>
 }
 
-// Transcodes H.265 NAL units to H.264
+// Global cap on codec threads, so many HEVC cameras cannot oversubscribe the
+// box. Each transcoder takes its share at init and returns it on destruction.
+class CoreBudget {
+public:
+    explicit CoreBudget(size_t cores = 0); // 0: one per core
+
+    // Grant up to `want` threads, at least `min` even if over budget
+    size_t acquire(size_t want, size_t min);
+    void release(size_t n);
+
+private:
+    size_t available_;
+    size_t overdraft_ = 0; // granted beyond the budget via `min`
+    std::mutex mtx_;
+};
+
+// One step of the output ladder
+struct Rendition {
+    int height = 0;       // 0 or >= source height: source size
+    int bitrate_kbps = 0; // 0: encoder default (CRF)
+};
+
+// Per-source transcoding: FFmpeg threading knobs and the rendition ladder
+struct TranscoderOptions {
+    int decode_threads = 0; // 0: auto, capped by the CoreBudget
+    int decode_thread_type = FF_THREAD_FRAME | FF_THREAD_SLICE;
+    int encode_threads = 0;
+    int encode_thread_type = FF_THREAD_SLICE; // x264 sliced threads, no lag
+    size_t queue_depth = 4; // frames between decode/convert/encode
+    // Viewers' PLI/FIR: at most one forced IDR per rendition this often
+    int min_keyframe_interval_ms = 500;
+    // Highest quality first; the source is decoded once for all of them
+    std::vector<Rendition> ladder{Rendition{}};
+};
+
+// "0:4000,720:2000,360:600" → ladder of height:kbps (0 = source height,
+// kbps optional)
+std::vector<Rendition> parseLadder(const std::string &spec);
+
+// Transcodes H.265 NAL units to an H.264 ladder on a pipeline:
+// decode → per rendition convert (swscale) → encode, each stage on its own
+// thread with a bounded queue in between, so the stages overlap instead of
+// adding up. Decoding happens once however many renditions there are.
+// Timestamps are carried through at 90kHz: every output frame keeps the
+// PTS of the input frame it was decoded from, whatever the frame rate.
 class Transcoder {
 public:
+    // rendition: index into TranscoderOptions::ladder
     using OutputCallback =
-        std::function<void(const uint8_t *data, size_t size, bool is_keyframe)>;
+        std::function<void(size_t rendition, const FramePtr &frame)>;
 
-    Transcoder();
+    // source: label for the metrics (camera URL without credentials)
+    explicit Transcoder(const TranscoderOptions &options = {},
+                        CoreBudget *budget = nullptr,
+                        const std::string &source = "");
     ~Transcoder();
 
     bool init(const AVCodecParameters *hevc_params);
     void setOutputCallback(OutputCallback cb) { output_cb_ = std::move(cb); }
 
-    // Feed H.265 packet (raw Annex-B with start codes)
-    void feed(const uint8_t *data, size_t size, int64_t pts, int64_t dts);
+    // Feed H.265 packet (raw Annex-B with start codes, 90kHz PTS or -1,
+    // then the output is timed at the stream's frame rate). Never blocks: if
+    // the decoder falls behind, input is dropped up to the next keyframe.
+    // The decoder takes a reference to the frame's buffer, no copy.
+    void feed(const FramePtr &frame);
+
+    size_t renditionCount() const { return stages_.size(); }
+
+    // Retarget a rendition's encoder to the viewers' bandwidth, within
+    // [1/4, 1] of its configured bitrate. Renditions without a configured
+    // bitrate run CRF and are left alone. Applied on the next frame.
+    void setBitrate(size_t rendition, int kbps);
+
+    // Make every rendition's next encoded frame an IDR, e.g. after the
+    // input resumed and the viewers' caches were dropped. Any thread.
+    void requestKeyframe();
+    // A viewer of this rendition lost a picture (PLI/FIR). Its next frame
+    // becomes an IDR, or if one went out less than min_keyframe_interval_ms
+    // ago, the first frame past that; requests until then are served by
+    // the same IDR, so many viewers cost one. Any thread.
+    void requestKeyframe(size_t rendition);
+
+    // Raw pictures held for this source: decoder references and threads,
+    // frames queued between stages, each rendition's scaler ring and
+    // encoder. An estimate (codec internals are opaque); any thread.
+    size_t memoryBytes() const;
 
 private:
-    AVCodecContext *dec_ctx_ = nullptr;
-    AVCodecContext *enc_ctx_ = nullptr;
-    SwsContext *sws_ctx_ = nullptr;
-    AVFrame *frame_ = nullptr;
-    AVFrame *sw_frame_ = nullptr; // for pixel format conversion
-    AVPacket *enc_pkt_ = nullptr;
+    struct FrameDeleter {
+        void operator()(AVFrame *f) const { av_frame_free(&f); }
+    };
+    using AVFramePtr = std::unique_ptr<AVFrame, FrameDeleter>;
+
+    // Compressed input and when it was fed, for the latency histograms
+    struct Input {
+        FramePtr frame;
+        int64_t fed_us = 0;
+    };
+
+    // Scale + encode for one rendition
+    struct Stage {
+        Stage(const Rendition &r, size_t depth)
+            : config(r), decoded(depth), converted(depth) {}
+        ~Stage();
+
+        Rendition config;
+        int encode_threads = 1;
+        SwsContext *sws_ctx = nullptr;    // convert thread
+        int width = 0, height = 0;        // output size, convert thread
+        std::vector<AVFramePtr> sws_pool; // convert thread, reused outputs
+        size_t sws_next = 0;
+        AVCodecContext *enc_ctx = nullptr; // encode thread
+        AVPacket *enc_pkt = nullptr;
+        // Decoded frames this rendition was too slow for
+        std::shared_ptr<Counter> skipped;
+        std::shared_ptr<Histogram> latency; // feed → encoded packet
+        std::atomic<int> target_kbps{0}; // 0: configured bitrate
+        std::atomic<bool> force_keyframe{false};
+        std::atomic<bool> keyframe_wanted{false}; // rate limited
+        int64_t last_idr_pts = AV_NOPTS_VALUE;    // encode thread
+        std::shared_ptr<Counter> keyframe_requests;
+        std::shared_ptr<Counter> forced_keyframes;
+        int64_t last_pts = AV_NOPTS_VALUE; // encode thread, sent to x264
+        std::atomic<size_t> picture_bytes{0}; // output picture, convert thread
+        std::atomic<size_t> ring_size{0};     // sws_pool.size()
+        int applied_kbps = 0;            // encode thread
+        BoundedQueue<AVFramePtr> decoded;
+        BoundedQueue<AVFramePtr> converted;
+    };
+
+    void decodeLoop();
+    void convertLoop(Stage &stage);
+    void encodeLoop(size_t index);
+    bool openEncoder(Stage &stage, const AVFrame *frame);
+    void stop();
+
+    TranscoderOptions options_;
+    CoreBudget *budget_;
+    size_t granted_ = 0; // threads taken from budget_
+
+    AVCodecContext *dec_ctx_ = nullptr; // decode thread
+    size_t dec_threads_ = 1;
+    std::atomic<size_t> picture_bytes_{0}; // decoded picture, decode thread
+    // Frame duration in 90kHz ticks: from the stream's timing info, then
+    // from decoded PTS. Encoder rate-control hint and PTS fallback.
+    static constexpr int64_t kDefaultInterval = 3000; // 30 fps
+    std::atomic<int64_t> frame_interval_{kDefaultInterval};
+    std::vector<std::unique_ptr<Stage>> stages_;
     OutputCallback output_cb_;
     bool initialized_ = false;
+
+    bool dropping_ = false; // feed side
+    BoundedQueue<Input> input_;
+    std::shared_ptr<Counter> fed_metric_;
+    std::shared_ptr<Counter> dropped_metric_;
+    std::shared_ptr<Gauge> input_depth_;
+    std::vector<std::thread> threads_;
 };
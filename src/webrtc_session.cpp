@@ -1,38 +1,103 @@
 #include "webrtc_session.h"
-#include <cstring>
-#include <future>
+#include <algorithm>
+#include <cstdio>
 #include <iostream>
+#include <random>
 #include <sstream>
 
-WebRTCSession::WebRTCSession() {}
+WebRTCSession::WebRTCSession() {
+  std::random_device rd;
+  std::mt19937_64 rng((static_cast<uint64_t>(rd()) << 32) | rd());
+  char buf[17];
+  snprintf(buf, sizeof(buf), "%016llx",
+           static_cast<unsigned long long>(rng()));
+  id_ = buf;
+
+  auto &registry = MetricsRegistry::global();
+  MetricLabels labels{{"session", id_}};
+  frames_sent_ = registry.counter("webrtc_frames_sent_total",
+                                  "Frames sent to the viewer", labels);
+  packets_sent_ = registry.counter("webrtc_packets_sent_total",
+                                   "RTP packets sent to the viewer", labels);
+  bytes_sent_ = registry.counter("webrtc_bytes_sent_total",
+                                 "RTP bytes sent to the viewer", labels);
+  send_failures_ = registry.counter("webrtc_send_failures_total",
+                                    "RTP packets the track did not send",
+                                    labels);
+  dropped_ = registry.counter(
+      "webrtc_dropped_frames_total",
+      "Frames skipped for the viewer (queue full or congested)", labels);
+  nacked_ = registry.counter("webrtc_nack_packets_total",
+                             "Packets the viewer asked to retransmit", labels);
+  keyframe_requests_ = registry.counter("webrtc_keyframe_requests_total",
+                                        "PLI and FIR from the viewer", labels);
+  audio_packets_sent_ = registry.counter(
+      "webrtc_audio_packets_sent_total", "Audio RTP packets sent to the viewer",
+      labels);
+  send_time_ = registry.histogram("webrtc_send_seconds",
+                                  "Time to send one frame's packets", labels);
+  queue_depth_ = registry.gauge("webrtc_queue_depth",
+                                "Frames waiting for the sender", labels);
+  rendition_metric_ = registry.gauge("webrtc_rendition",
+                                     "Ladder index the viewer is on", labels);
+  estimate_metric_ = registry.gauge(
+      "webrtc_estimate_bps", "Bandwidth estimate for the viewer", labels);
+  loss_metric_ = registry.gauge(
+      "webrtc_loss_ratio", "Fraction lost in the last receiver report", labels);
+  rtt_metric_ = registry.gauge("webrtc_rtt_seconds",
+                               "Round trip from the last receiver report",
+                               labels);
+  jitter_metric_ = registry.gauge(
+      "webrtc_jitter_seconds", "Interarrival jitter seen by the viewer",
+      labels);
+}
 
 WebRTCSession::~WebRTCSession() {
   if (pc_)
     pc_->close();
 }
 
+// Payload type of the first rtpmap line for `encoding` (e.g. "PCMU/8000"),
+// -1 if the offer has none
+static int findRtpmap(const std::string &sdp, const std::string &encoding) {
+  std::istringstream iss(sdp);
+  std::string line;
+  while (std::getline(iss, line)) {
+    if (line.rfind("a=rtpmap:", 0) == 0 &&
+        line.find(" " + encoding) != std::string::npos)
+      return std::stoi(line.substr(line.find(':') + 1));
+  }
+  return -1;
+}
+
 std::string WebRTCSession::handleOffer(const std::string &sdp_offer,
                                        const std::string &public_ip,
-                                       const std::string &profile_level_id) {
+                                       uint16_t ice_port, bool udp_mux) {
   rtc::Configuration config;
   config.iceServers.emplace_back("stun:stun.l.google.com:19302");
 
-  // Fixed port for SSH forwarding scenarios
-  config.portRangeBegin = 9000;
-  config.portRangeEnd = 9000;
+  // Fixed port for SSH forwarding scenarios; the public_ip candidate
+  // advertises the same one
+  config.portRangeBegin = ice_port;
+  config.portRangeEnd = ice_port;
   config.enableIceTcp = true;
+  config.enableIceUdpMux = udp_mux;
 
   pc_ = std::make_shared<rtc::PeerConnection>(config);
 
-  // Parse offer to find video section's mid
+  // Parse offer to find the video (and audio) sections' mids
   rtc::Description parsed_offer(sdp_offer, "offer");
-  std::string video_mid = "0"; // fallback
+  video_mid_ = "0"; // fallback
+  std::string audio_mid;
+  bool have_video = false;
   for (int i = 0; i < parsed_offer.mediaCount(); ++i) {
     auto entry = parsed_offer.media(i);
     if (auto *media_ptr = std::get_if<rtc::Description::Media *>(&entry)) {
-      if ((*media_ptr)->type() == "video") {
-        video_mid = (*media_ptr)->mid();
-        break;
+      if ((*media_ptr)->type() == "video" && !have_video) {
+        video_mid_ = (*media_ptr)->mid();
+        have_video = true;
+      } else if ((*media_ptr)->type() == "audio" && audio_mid.empty()) {
+        audio_mid = (*media_ptr)->mid();
       }
     }
   }
@@ -81,13 +146,50 @@ std::string WebRTCSession::handleOffer(const std::string &sdp_offer,
   }
   std::cout << "[WebRTC] H264 PT=" << h264_pt << " fmtp=" << h264_fmtp << "\n";
 
+  // H.265 offered too (Safari, Chrome with hardware decode): HEVC cameras
+  // are then passed through to this viewer instead of transcoded
+  int h265_pt = -1;
+  std::string h265_fmtp;
+  {
+    std::istringstream iss(sdp_offer);
+    std::string line;
+    while (std::getline(iss, line)) {
+      if (line.find("a=rtpmap:") != std::string::npos &&
+          line.find("H265/90000") != std::string::npos) {
+        h265_pt = std::stoi(line.substr(line.find(':') + 1));
+        break;
+      }
+    }
+    if (h265_pt > 0) {
+      std::string prefix = "a=fmtp:" + std::to_string(h265_pt) + " ";
+      iss.clear();
+      iss.str(sdp_offer);
+      while (std::getline(iss, line)) {
+        if (line.rfind(prefix, 0) == 0) {
+          h265_fmtp = line.substr(prefix.size());
+          if (!h265_fmtp.empty() && h265_fmtp.back() == '\r')
+            h265_fmtp.pop_back();
+          break;
+        }
+      }
+      std::cout << "[WebRTC] H265 PT=" << h265_pt << " fmtp=" << h265_fmtp
+                << "\n";
+    }
+  }
+
   // Create H.264 track with matching mid and PT from offer
-  rtc::Description::Video media(video_mid,
+  rtc::Description::Video media(video_mid_,
                                 rtc::Description::Direction::SendOnly);
   if (!h264_fmtp.empty())
     media.addH264Codec(h264_pt, h264_fmtp);
   else
     media.addH264Codec(h264_pt);
+  if (h265_pt > 0) {
+    if (!h265_fmtp.empty())
+      media.addH265Codec(h265_pt, h265_fmtp);
+    else
+      media.addH265Codec(h265_pt);
+  }
   media.setBitrate(4000); // kbps
   media.addSSRC(42, "rtsp2webrtc", "stream0", "video0");
 
@@ -100,149 +202,627 @@ std::string WebRTCSession::handleOffer(const std::string &sdp_offer,
       h264_pt,       // payloadType from offer
       rtc::H264RtpPacketizer::defaultClockRate);
   rtp_config_ = rtp;
+  payload_type_ = static_cast<uint8_t>(h264_pt);
+  h265_pt_ = h265_pt;
 
-  auto packetizer = std::make_shared<rtc::H264RtpPacketizer>(
-      rtc::NalUnit::Separator::StartSequence, rtp, 1400);
-
+  // Packets arrive already packetized from the source's RtpFanout,
+  // so the chain only needs SR reporting and NACK retransmission
   sr_reporter_ = std::make_shared<rtc::RtcpSrReporter>(rtp);
-  packetizer->addToChain(sr_reporter_);
 
   auto nack_responder = std::make_shared<rtc::RtcpNackResponder>(2048);
   sr_reporter_->addToChain(nack_responder);
 
-  track_->setMediaHandler(packetizer);
+  // Receiver reports + REMB feed this viewer's bandwidth estimate
+  std::weak_ptr<WebRTCSession> weak = weak_from_this();
+  RtcpFeedbackHandler::Listener listener;
+  listener.on_report = [weak](const RtcpFeedbackHandler::ReportBlock &rb) {
+    if (auto self = weak.lock())
+      self->onReport(rb);
+  };
+  listener.on_remb = [weak](uint64_t bitrate) {
+    if (auto self = weak.lock())
+      self->onRemb(bitrate);
+  };
+  listener.on_keyframe_request = [weak] {
+    if (auto self = weak.lock()) {
+      self->keyframe_requests_->add();
+      KeyframeCallback cb;
+      {
+        std::lock_guard<std::mutex> lock(self->feedback_mtx_);
+        cb = self->keyframe_cb_;
+      }
+      if (cb)
+        cb();
+    }
+  };
+  listener.on_nack = [weak](size_t lost) {
+    if (auto self = weak.lock())
+      self->nacked_->add(lost);
+  };
+  sr_reporter_->addToChain(
+      std::make_shared<RtcpFeedbackHandler>(rtp->ssrc, std::move(listener)));
+  estimate_kbps_ = estimator_.estimateKbps();
+  estimate_metric_->set(estimate_kbps_ * 1000.0);
+
+  track_->setMediaHandler(sr_reporter_);
+  start_ts_ = rtp->startTimestamp;
+
+  // Audio: every passthrough codec the browser offered, so the camera's
+  // Opus/G.711 goes out untouched whatever it turns out to be
+  if (!audio_mid.empty()) {
+    opus_pt_ = findRtpmap(sdp_offer, "opus/48000");
+    pcmu_pt_ = findRtpmap(sdp_offer, "PCMU/8000");
+    pcma_pt_ = findRtpmap(sdp_offer, "PCMA/8000");
+  }
+  if (opus_pt_ > 0 || pcmu_pt_ > 0 || pcma_pt_ > 0) {
+    rtc::Description::Audio audio(audio_mid,
+                                  rtc::Description::Direction::SendOnly);
+    if (opus_pt_ > 0)
+      audio.addOpusCodec(opus_pt_);
+    if (pcmu_pt_ > 0)
+      audio.addPCMUCodec(pcmu_pt_);
+    if (pcma_pt_ > 0)
+      audio.addPCMACodec(pcma_pt_);
+    audio.addSSRC(43, "rtsp2webrtc", "stream0", "audio0");
+    audio_track_ = pc_->addTrack(audio);
+    // The RTP config (clock rate) waits for the first frame: which codec
+    // is sent depends on the camera, not on the offer
+    audio_start_ts_ = static_cast<uint32_t>(std::random_device{}());
+    std::cout << "[WebRTC] Audio opus=" << opus_pt_ << " PCMU=" << pcmu_pt_
+              << " PCMA=" << pcma_pt_ << "\n";
+  }
+
+  public_ip_ = public_ip;
+  ice_port_ = ice_port;
 
-  // Wait for ICE gathering to complete before returning answer
-  std::promise<void> gathering_done;
-  auto gathering_future = gathering_done.get_future();
+  // Never block on ICE gathering: candidates are trickled as they come and
+  // the full answer is handed to onGatheringComplete() listeners
 
-  pc_->onStateChange([](rtc::PeerConnection::State state) {
+  pc_->onStateChange([weak](rtc::PeerConnection::State state) {
     std::cout << "[WebRTC] State: " << static_cast<int>(state) << "\n";
+    // Disconnected may still recover; ICE reports Failed if it does not
+    if (state != rtc::PeerConnection::State::Failed &&
+        state != rtc::PeerConnection::State::Closed)
+      return;
+    if (auto self = weak.lock())
+      self->notifyClosed();
+  });
+
+  pc_->onLocalCandidate([weak](rtc::Candidate candidate) {
+    if (auto self = weak.lock()) {
+      std::lock_guard<std::mutex> lock(self->ice_mtx_);
+      self->local_candidates_.push_back(std::move(candidate));
+    }
   });
 
   pc_->onGatheringStateChange(
-      [&gathering_done](rtc::PeerConnection::GatheringState state) {
+      [weak](rtc::PeerConnection::GatheringState state) {
         std::cout << "[WebRTC] Gathering: " << static_cast<int>(state) << "\n";
-        if (state == rtc::PeerConnection::GatheringState::Complete) {
-          gathering_done.set_value();
+        if (state != rtc::PeerConnection::GatheringState::Complete)
+          return;
+        auto self = weak.lock();
+        if (!self)
+          return;
+        std::vector<AnswerCallback> cbs;
+        {
+          std::lock_guard<std::mutex> lock(self->ice_mtx_);
+          self->gathering_complete_ = true;
+          cbs.swap(self->answer_cbs_);
         }
+        std::string answer = self->currentAnswer();
+        for (auto &cb : cbs)
+          cb(answer);
       });
 
   // Set remote description (offer) — triggers answer generation + ICE gathering
   pc_->setRemoteDescription(rtc::Description(sdp_offer, "offer"));
 
-  // Wait for ICE gathering to complete (up to 10s)
-  if (gathering_future.wait_for(std::chrono::seconds(10)) ==
-      std::future_status::timeout) {
-    throw std::runtime_error("Timeout waiting for ICE gathering");
-  }
+  std::string answer_sdp = currentAnswer();
+  std::cout << "[WebRTC] Answer SDP:\n" << answer_sdp << "\n";
+  return answer_sdp;
+}
+
+void WebRTCSession::setSink(PacketSink sink, bool accepts_hevc) {
+  sink_ = std::move(sink);
+  h265_pt_ = accepts_hevc ? 97 : -1;
+  rtp_config_ = std::make_shared<rtc::RtpPacketizationConfig>(
+      42, "rtsp2webrtc", payload_type_,
+      rtc::H264RtpPacketizer::defaultClockRate);
+  start_ts_ = rtp_config_->startTimestamp;
+}
 
-  // Now local description contains all ICE candidates
+std::string WebRTCSession::currentAnswer() const {
   auto desc = pc_->localDescription();
+  if (!desc)
+    throw std::runtime_error("No local description");
 
   // If public_ip is set (e.g. FRP/NAT), add it as a high-priority candidate
-  if (!public_ip.empty()) {
+  if (!public_ip_.empty()) {
     std::string candidate_str =
-        "candidate:100 1 UDP 2130706431 " + public_ip + " 9000 typ host";
-    desc->addCandidate(rtc::Candidate(candidate_str, video_mid));
+        "candidate:100 1 UDP 2130706431 " + public_ip_ + " " +
+        std::to_string(ice_port_) + " typ host";
+    desc->addCandidate(rtc::Candidate(candidate_str, video_mid_));
   }
+  return std::string(*desc);
+}
 
-  std::string answer_sdp = std::string(*desc);
-  std::cout << "[WebRTC] Answer SDP:\n" << answer_sdp << "\n";
-  return answer_sdp;
+void WebRTCSession::onGatheringComplete(AnswerCallback cb) {
+  {
+    std::lock_guard<std::mutex> lock(ice_mtx_);
+    if (!gathering_complete_) {
+      answer_cbs_.push_back(std::move(cb));
+      return;
+    }
+  }
+  cb(currentAnswer());
 }
 
-void WebRTCSession::sendFrame(const uint8_t *data, size_t size,
-                              bool is_keyframe, int64_t pts) {
-  std::lock_guard<std::mutex> lock(send_mtx_);
-  if (!track_ || !track_->isOpen())
+std::vector<rtc::Candidate> WebRTCSession::localCandidates(size_t from,
+                                                           bool &complete) {
+  std::lock_guard<std::mutex> lock(ice_mtx_);
+  complete = gathering_complete_;
+  if (from >= local_candidates_.size())
+    return {};
+  return {local_candidates_.begin() + static_cast<long>(from),
+          local_candidates_.end()};
+}
+
+void WebRTCSession::addRemoteCandidate(const std::string &candidate,
+                                       const std::string &mid) {
+  if (pc_ && !candidate.empty())
+    pc_->addRemoteCandidate(rtc::Candidate(candidate, mid));
+}
+
+int WebRTCSession::audioPayloadType(RtpCodec codec) const {
+  switch (codec) {
+  case RtpCodec::Opus:
+    return opus_pt_;
+  case RtpCodec::PCMU:
+    return pcmu_pt_;
+  case RtpCodec::PCMA:
+    return pcma_pt_;
+  default:
+    return -1;
+  }
+}
+
+void WebRTCSession::setSender(std::shared_ptr<SenderWorker> sender) {
+  sender_ = sender;
+  has_sender_ = sender != nullptr;
+}
+
+void WebRTCSession::wakeSender() {
+  if (!has_sender_)
+    drain(queue_.capacity());
+  else if (auto sender = sender_.lock())
+    sender->wake(); // gone: the pool shut down, nothing sends any more
+}
+
+void WebRTCSession::enqueue(const RtpFramePtr &frame,
+                            const std::vector<RtpFramePtr> &gop) {
+  if (!writable())
     return;
+  media_bytes_.fetch_add(frame->bytes, std::memory_order_relaxed);
 
-  // Wait for keyframe before sending (browser decoder needs it)
+  // Start on a keyframe (browser decoder needs it): either this frame, or
+  // the cached GOP replayed ahead of it
   if (!got_keyframe_) {
-    if (!is_keyframe)
+    if (frame->is_keyframe) {
+      start_ts_ = restartTs(frame->pts, 1);
+      ts_offset_ = start_ts_ - frame->timestamp;
+      if (anchor_pts_ < 0) {
+        start_ts_anchor_ = start_ts_;
+        anchor_pts_ = frame->pts;
+      }
+      std::cout << "[WebRTC] First keyframe, starting send\n";
+    } else if (!gop.empty() && gop.front()->is_keyframe &&
+               gop.size() < queue_.capacity()) {
+      // Fast-forward: cached frames get timestamps 1 tick apart ending at
+      // the last cached frame, so the decoder catches up at once and live
+      // frames continue on the normal timeline right after it
+      start_ts_ = restartTs(gop.back()->pts, gop.size());
+      ts_offset_ = start_ts_ - gop.back()->timestamp;
+      if (anchor_pts_ < 0) {
+        start_ts_anchor_ = start_ts_;
+        anchor_pts_ = gop.back()->pts;
+      }
+      uint32_t ts = start_ts_ - static_cast<uint32_t>(gop.size() - 1);
+      for (const auto &cached : gop)
+        queue_.push({cached, ts++, true});
+      last_ts_ = ts - 1;
+      std::cout << "[WebRTC] Replayed GOP: " << gop.size() << " frames\n";
+    } else {
       return;
+    }
     got_keyframe_ = true;
-    if (pts >= 0)
-      first_pts_ = pts;
-    std::cout << "[WebRTC] First keyframe, starting send\n";
   }
 
-  // 更加健壮的增量计算，防止回绕和突变
-  if (pts >= 0) {
-    if (last_rtsp_pts_ == -1) {
-      // 第一帧
-      last_rtsp_pts_ = pts;
-      timestamp_ = 0;
-    } else {
-      // 计算与上一帧的差值 (90kHz)
-      int64_t delta = pts - last_rtsp_pts_;
-
-      // 异常处理：如果差值是负数（乱序）或过大（突变 > 5秒），则回退到估算值
-      if (delta < 0 || delta > 90000 * 5) {
-        std::cout << "[WebRTC] Timestamp jump detected! delta=" << delta
-                  << "\n";
-        delta = 3000; // 假设 30fps 的默认增量
-      }
+  // Congested: keyframes only. On the way out wait for the next keyframe,
+  // the skipped deltas are missing references.
+  if (keyframes_only_.load(std::memory_order_relaxed)) {
+    skipping_ = true;
+  } else if (skipping_) {
+    skipping_ = false;
+    dropping_ = true;
+  }
+  if (skipping_ && !frame->is_keyframe) {
+    dropped_->add();
+    return;
+  }
 
-      timestamp_ += static_cast<uint32_t>(delta);
-      last_rtsp_pts_ = pts;
+  // Drop-to-next-keyframe: deltas after a gap would not decode anyway
+  if (dropping_ && !frame->is_keyframe) {
+    dropped_->add();
+    return;
+  }
+  uint32_t ts = frame->timestamp + ts_offset_;
+  if (!queue_.push({frame, ts})) {
+    if (!dropping_)
+      std::cerr << "[WebRTC] Session " << id_
+                << " queue full, dropping to next keyframe\n";
+    dropping_ = true;
+    dropped_->add();
+    return;
+  }
+  dropping_ = false;
+  last_ts_ = ts;
+  queue_depth_->set(static_cast<double>(queue_.size()));
+
+  wakeSender();
+}
+
+void WebRTCSession::enqueueAudio(const RtpFramePtr &frame) {
+  int64_t anchor = anchor_pts_.load();
+  if (!audio_track_ || anchor < 0 || frame->pts < 0 || !writable())
+    return;
+  // Video started at audio_start_ts_ on this track's clock; the source PTS
+  // (90kHz, both streams) says how far from that this frame plays
+  int64_t clock = frame->codec == RtpCodec::Opus ? 48000 : 8000;
+  uint32_t ts = audio_start_ts_ +
+                static_cast<uint32_t>((frame->pts - anchor) * clock / 90000);
+  if (!audio_queue_.push({frame, ts})) {
+    dropped_->add();
+    return;
+  }
+  wakeSender();
+}
+
+void WebRTCSession::resync() {
+  if (!got_keyframe_)
+    return;
+  // Fallback for frames without a PTS: one frame interval after the last
+  // queued frame. restartTs() places the others on the anchored timeline.
+  start_ts_ = last_ts_ + 3000;
+  got_keyframe_ = false;
+  dropping_ = false;
+}
+
+uint32_t WebRTCSession::restartTs(int64_t pts, size_t frames) const {
+  int64_t anchor = anchor_pts_.load();
+  if (anchor < 0 || pts < 0)
+    return start_ts_; // first start, or nothing to place it by
+  // Same anchor as the audio track (both 90kHz here): however long the
+  // restart waited for a keyframe, the tracks stay in step
+  uint32_t ts = start_ts_anchor_ + static_cast<uint32_t>(pts - anchor);
+  // A replayed GOP ends at ts and must still follow what was sent
+  uint32_t first = ts - static_cast<uint32_t>(frames);
+  if (static_cast<int32_t>(first - last_ts_) < 0)
+    ts = last_ts_ + static_cast<uint32_t>(frames);
+  return ts;
+}
+
+void WebRTCSession::setRenditionPolicy(std::vector<int> ladder_kbps,
+                                       RenditionCallback cb) {
+  std::lock_guard<std::mutex> lock(feedback_mtx_);
+  ladder_kbps_ = std::move(ladder_kbps);
+  rendition_cb_ = std::move(cb);
+}
+
+void WebRTCSession::setAutoRendition(bool enabled) {
+  std::lock_guard<std::mutex> lock(feedback_mtx_);
+  auto_rendition_ = enabled;
+}
+
+void WebRTCSession::onEstimate(EstimateCallback cb) {
+  std::lock_guard<std::mutex> lock(feedback_mtx_);
+  estimate_cb_ = std::move(cb);
+}
+
+void WebRTCSession::onKeyframeRequest(KeyframeCallback cb) {
+  std::lock_guard<std::mutex> lock(feedback_mtx_);
+  keyframe_cb_ = std::move(cb);
+}
+
+void WebRTCSession::onReport(const RtcpFeedbackHandler::ReportBlock &rb) {
+  loss_metric_->set(rb.fraction_lost);
+  jitter_metric_->set(rb.jitter / 90000.0);
+  double rtt = RtcpFeedbackHandler::roundTripSeconds(rb);
+  if (rtt >= 0)
+    rtt_metric_->set(rtt);
+
+  std::unique_lock<std::mutex> lock(feedback_mtx_);
+  // Rate of the stream offered to this viewer, sampled per report
+  auto now = std::chrono::steady_clock::now();
+  uint64_t bytes = media_bytes_.load(std::memory_order_relaxed);
+  if (last_report_.time_since_epoch().count() > 0) {
+    double secs = std::chrono::duration<double>(now - last_report_).count();
+    if (secs > 0.05) {
+      double kbps = (bytes - last_media_bytes_) * 8 / 1000.0 / secs;
+      media_kbps_ = media_kbps_ > 0 ? media_kbps_ * 0.7 + kbps * 0.3 : kbps;
     }
-  } else {
-    timestamp_ += 3000;
   }
-  rtp_config_->timestamp = timestamp_;
+  last_report_ = now;
+  last_media_bytes_ = bytes;
 
-  // Data is already Annex-B (start codes included)
-  // H264RtpPacketizer will split NALs and use same timestamp
-  std::vector<std::byte> frame(size);
-  std::memcpy(frame.data(), data, size);
+  estimator_.onLoss(rb.fraction_lost, static_cast<int>(media_kbps_));
+  adapt(lock);
+}
 
-  try {
-    sr_reporter_->setNeedsToReport();
-    bool ok = track_->send(frame);
+void WebRTCSession::onRemb(uint64_t bitrate) {
+  std::unique_lock<std::mutex> lock(feedback_mtx_);
+  estimator_.onRemb(static_cast<int>(std::min<uint64_t>(bitrate / 1000,
+                                                        INT32_MAX)));
+  adapt(lock);
+}
+
+void WebRTCSession::adapt(std::unique_lock<std::mutex> &lock) {
+  // Going down is immediate, going up waits a few seconds after the last
+  // switch so a fluctuating estimate does not flap between renditions
+  static constexpr auto kUpHold = std::chrono::seconds(5);
+  int kbps = estimator_.estimateKbps();
+  int previous = estimate_kbps_.exchange(kbps);
+  estimate_metric_->set(kbps * 1000.0);
+  double loss = estimator_.loss();
+
+  // 1. Rendition: highest one that fits with 15% headroom
+  RenditionCallback switch_cb;
+  size_t current = rendition_;
+  size_t want = current;
+  bool can_switch =
+      auto_rendition_ && rendition_cb_ && ladder_kbps_.size() >= 2;
+  if (can_switch) {
+    want = ladder_kbps_.size() - 1;
+    for (size_t i = 0; i < ladder_kbps_.size(); i++) {
+      if (ladder_kbps_[i] > 0 && ladder_kbps_[i] <= kbps * 0.85) {
+        want = i;
+        break;
+      }
+    }
+    auto now = std::chrono::steady_clock::now();
+    if (want != current &&
+        !(want < current && now - last_switch_ < kUpHold)) {
+      last_switch_ = now;
+      switch_cb = rendition_cb_;
+    } else {
+      want = current;
+    }
+  }
+
+  // 2. Nothing lower to switch to: fall back to keyframes only while the
+  // link cannot carry the stream, with hysteresis
+  bool lowest = !can_switch || want == ladder_kbps_.size() - 1;
+  bool kf_only = keyframes_only_;
+  if (!kf_only && lowest && media_kbps_ > 0 &&
+      (kbps < media_kbps_ * 0.5 || loss > 0.25))
+    kf_only = true;
+  else if (kf_only && (!lowest || (kbps > media_kbps_ * 0.8 && loss < 0.10)))
+    kf_only = false;
+  if (kf_only != keyframes_only_.exchange(kf_only))
+    std::cout << "[WebRTC] Session " << id_ << " keyframes only: " << kf_only
+              << " (estimate " << kbps << " kbps, media "
+              << static_cast<int>(media_kbps_) << " kbps, loss "
+              << static_cast<int>(loss * 100) << "%)\n";
+
+  // 3. Shared encoder retargeting is up to the listener
+  EstimateCallback estimate_cb = kbps != previous ? estimate_cb_ : nullptr;
+  lock.unlock();
+
+  if (switch_cb) {
+    std::cout << "[WebRTC] Estimate " << kbps << " kbps, rendition "
+              << current << " -> " << want << "\n";
+    switch_cb(want);
+  }
+  if (estimate_cb)
+    estimate_cb();
+}
+
+bool WebRTCSession::drain(size_t max_frames) {
+  std::lock_guard<std::mutex> lock(send_mtx_);
+  QueuedFrame item;
+  // Audio first: a few small packets that must not wait behind a keyframe
+  while (audio_queue_.pop(item)) {
+    if (audio_track_->isOpen())
+      sendAudio(*item.frame, item.ts);
+  }
+  for (size_t n = 0; n < max_frames; n++) {
+    if (!queue_.pop(item)) {
+      queue_depth_->set(0);
+      return false;
+    }
+    if (!writable())
+      continue; // discard, keep the ring moving
+
+    // Sampled frames: this viewer's own copy of the trace from here on
+    TracePtr trace;
+    if (item.frame->trace && !item.replayed) {
+      trace = item.frame->trace->fork(id_);
+      trace->mark(TraceStage::Dequeued);
+    }
+    auto start = std::chrono::steady_clock::now();
+    bool ok = sendPackets(*item.frame, item.ts);
+    send_time_->recordSince(start);
+    if (trace) {
+      trace->mark(TraceStage::Sent);
+      Tracer::global().record(std::move(trace));
+    }
+    frames_sent_->add();
     frame_count_++;
     if (frame_count_ <= 3 || frame_count_ % 100 == 0)
-      std::cout << "[WebRTC] send #" << frame_count_ << " size=" << size
-                << " ts=" << timestamp_ << " kf=" << is_keyframe << " ok=" << ok
-                << "\n";
+      std::cout << "[WebRTC] send #" << frame_count_
+                << " pkts=" << item.frame->count() << " ts=" << item.ts
+                << " kf=" << item.frame->is_keyframe << " ok=" << ok
+                << " dropped=" << dropped_->value()
+                << " nacked=" << nacked_->value()
+                << " kbps=" << estimate_kbps_ << "\n";
+  }
+  queue_depth_->set(static_cast<double>(queue_.size()));
+  return queue_.size() > 0;
+}
+
+bool WebRTCSession::sendPackets(const RtpFrame &frame, uint32_t ts) {
+  rtp_config_->timestamp = ts;
+  uint16_t seq = rtp_config_->sequenceNumber;
+  uint32_t ssrc = rtp_config_->ssrc;
+  // Passthrough frames go out under the negotiated H.265 payload type
+  uint8_t pt = frame.codec == RtpCodec::H265 && h265_pt_ > 0
+                   ? static_cast<uint8_t>(h265_pt_)
+                   : payload_type_;
+
+  // Rewrite fixed RTP header fields, payload is shared as-is; the whole
+  // frame is laid out in one buffer before anything is sent
+  batch_.clear();
+  for (size_t i = 0; i < frame.count(); i++) {
+    if (frame.packetSize(i) < 12)
+      continue;
+    auto *h = batch_.append(frame.packet(i), frame.packetSize(i));
+    h[1] = static_cast<uint8_t>((h[1] & 0x80) | (pt & 0x7F));
+    h[2] = static_cast<uint8_t>(seq >> 8);
+    h[3] = static_cast<uint8_t>(seq);
+    h[4] = static_cast<uint8_t>(ts >> 24);
+    h[5] = static_cast<uint8_t>(ts >> 16);
+    h[6] = static_cast<uint8_t>(ts >> 8);
+    h[7] = static_cast<uint8_t>(ts);
+    h[8] = static_cast<uint8_t>(ssrc >> 24);
+    h[9] = static_cast<uint8_t>(ssrc >> 16);
+    h[10] = static_cast<uint8_t>(ssrc >> 8);
+    h[11] = static_cast<uint8_t>(ssrc);
+    seq++;
+  }
+  rtp_config_->sequenceNumber = seq;
+
+  // A sink takes the frame in one call; the track encrypts and sends
+  // packet by packet (libdatachannel owns SRTP and the socket)
+  uint64_t sent = 0, sent_bytes = 0;
+  try {
+    if (sr_reporter_)
+      sr_reporter_->setNeedsToReport();
+    if (sink_) {
+      // Sinks send a prefix of the batch
+      sent = std::min(sink_(batch_), batch_.count());
+      for (size_t i = 0; i < sent; i++)
+        sent_bytes += batch_.size(i);
+    } else {
+      for (size_t i = 0; i < batch_.count(); i++) {
+        if (track_->send(reinterpret_cast<const std::byte *>(batch_.data(i)),
+                         batch_.size(i))) {
+          sent++;
+          sent_bytes += batch_.size(i);
+        }
+      }
+    }
   } catch (const std::exception &e) {
     std::cerr << "[WebRTC] Send error: " << e.what() << "\n";
   }
+  uint64_t failed = batch_.count() - sent;
+  // Once per frame, not per packet
+  packets_sent_->add(sent);
+  bytes_sent_->add(sent_bytes);
+  if (failed)
+    send_failures_->add(failed);
+  return failed == 0;
 }
 
-void WebRTCSession::sendNal(const uint8_t *data, size_t size,
-                            bool is_keyframe) {
-  std::lock_guard<std::mutex> lock(send_mtx_);
-  if (!track_ || !track_->isOpen())
+void WebRTCSession::sendAudio(const RtpFrame &frame, uint32_t ts) {
+  int pt = audioPayloadType(frame.codec);
+  if (pt < 0)
     return;
+  // Config and sender reports on the clock of the codec actually sent;
+  // rebuilt should the camera come back with another one
+  uint32_t clock = frame.codec == RtpCodec::Opus ? 48000 : 8000;
+  if (!audio_rtp_config_ || audio_rtp_config_->clockRate != clock) {
+    auto config = std::make_shared<rtc::RtpPacketizationConfig>(
+        43, "rtsp2webrtc", static_cast<uint8_t>(pt), clock);
+    config->startTimestamp = audio_start_ts_;
+    if (audio_rtp_config_)
+      config->sequenceNumber = audio_rtp_config_->sequenceNumber;
+    audio_rtp_config_ = config;
+    audio_sr_reporter_ = std::make_shared<rtc::RtcpSrReporter>(config);
+    audio_track_->setMediaHandler(audio_sr_reporter_);
+  }
+  audio_rtp_config_->timestamp = ts;
+  uint16_t seq = audio_rtp_config_->sequenceNumber;
+  uint32_t ssrc = audio_rtp_config_->ssrc;
+  // Audio frames are single packets; headers rewritten in the batch like
+  // video, under the audio track's SSRC and sequence
+  batch_.clear();
+  for (size_t i = 0; i < frame.count(); i++) {
+    if (frame.packetSize(i) < 12)
+      continue;
+    auto *h = batch_.append(frame.packet(i), frame.packetSize(i));
+    h[1] = static_cast<uint8_t>((h[1] & 0x80) | (pt & 0x7F));
+    h[2] = static_cast<uint8_t>(seq >> 8);
+    h[3] = static_cast<uint8_t>(seq);
+    h[4] = static_cast<uint8_t>(ts >> 24);
+    h[5] = static_cast<uint8_t>(ts >> 16);
+    h[6] = static_cast<uint8_t>(ts >> 8);
+    h[7] = static_cast<uint8_t>(ts);
+    h[8] = static_cast<uint8_t>(ssrc >> 24);
+    h[9] = static_cast<uint8_t>(ssrc >> 16);
+    h[10] = static_cast<uint8_t>(ssrc >> 8);
+    h[11] = static_cast<uint8_t>(ssrc);
+    seq++;
+  }
+  audio_rtp_config_->sequenceNumber = seq;
 
-  // Increment timestamp (3000 = 90kHz / 30fps)
-  timestamp_ += 3000;
+  uint64_t sent = 0;
+  try {
+    audio_sr_reporter_->setNeedsToReport();
+    for (size_t i = 0; i < batch_.count(); i++) {
+      if (audio_track_->send(
+              reinterpret_cast<const std::byte *>(batch_.data(i)),
+              batch_.size(i)))
+        sent++;
+    }
+  } catch (const std::exception &e) {
+    std::cerr << "[WebRTC] Audio send error: " << e.what() << "\n";
+  }
+  audio_packets_sent_->add(sent);
+  if (sent < batch_.count())
+    send_failures_->add(batch_.count() - sent);
+}
 
-  rtp_config_->timestamp = timestamp_;
+bool WebRTCSession::writable() const {
+  return sink_ || (track_ && track_->isOpen());
+}
 
-  // Send as Annex-B with start code (packetizer expects it)
-  std::vector<std::byte> nal_with_sc(4 + size);
-  nal_with_sc[0] = std::byte{0x00};
-  nal_with_sc[1] = std::byte{0x00};
-  nal_with_sc[2] = std::byte{0x00};
-  nal_with_sc[3] = std::byte{0x01};
-  std::memcpy(nal_with_sc.data() + 4, data, size);
+void WebRTCSession::onClosed(ClosedCallback cb) {
+  std::unique_lock<std::mutex> lock(ice_mtx_);
+  if (!closed_) {
+    closed_cb_ = std::move(cb);
+    return;
+  }
+  lock.unlock();
+  if (cb)
+    cb();
+}
 
-  try {
-    track_->send(nal_with_sc);
-  } catch (const std::exception &e) {
-    std::cerr << "[WebRTC] Send error: " << e.what() << "\n";
+void WebRTCSession::notifyClosed() {
+  ClosedCallback cb;
+  {
+    std::lock_guard<std::mutex> lock(ice_mtx_);
+    if (closed_)
+      return;
+    closed_ = true;
+    cb = std::move(closed_cb_);
   }
+  if (cb)
+    cb();
 }
 
 bool WebRTCSession::isOpen() const {
+  if (sink_)
+    return true;
   return pc_ && pc_->state() == rtc::PeerConnection::State::Connected;
 }
 
-std::string WebRTCSession::id() const {
-  if (pc_)
-    return pc_->localDescription()->typeString();
-  return "";
-}
+const std::string &WebRTCSession::id() const { return id_; }
@@ -1,5 +1,8 @@
 #pragma once
+#include <atomic>
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <mutex>
 #include <string>
@@ -7,35 +10,223 @@
 
 #include <rtc/rtc.hpp>
 
-class WebRTCSession {
+#include "bandwidth_estimator.h"
+#include "egress.h"
+#include "metrics.h"
+#include "rtcp_feedback.h"
+#include "rtp_frame.h"
+#include "sender_pool.h"
+#include "spsc_ring.h"
+
+class WebRTCSession : public std::enable_shared_from_this<WebRTCSession> {
 public:
+    using AnswerCallback = std::function<void(const std::string &answer)>;
+    using RenditionCallback = std::function<void(size_t rendition)>;
+    using EstimateCallback = std::function<void()>;
+    using KeyframeCallback = std::function<void()>;
+    using ClosedCallback = std::function<void()>;
+    // Receives one frame's rewritten RTP packets at once (e.g. UdpEgress);
+    // returns how many it sent, the rest count as send failures
+    using PacketSink = std::function<size_t(const PacketBatch &batch)>;
+
     WebRTCSession();
     ~WebRTCSession();
 
-    // Process SDP offer, return SDP answer
+    // Synthetic viewer (benchmarks): no PeerConnection, packets go to sink
+    // instead of a track. Use instead of handleOffer(). accepts_hevc: act
+    // like a browser that offered H.265.
+    void setSink(PacketSink sink, bool accepts_hevc = false);
+
+    // Process SDP offer, return SDP answer without waiting for ICE
+    // gathering. Later candidates come from localCandidates() (trickle) or
+    // the full answer from onGatheringComplete(). Must be owned by shared_ptr.
     // public_ip: optional external IP for ICE candidates (e.g. FRP server)
+    // ice_port: local UDP port for ICE. udp_mux: share that port's socket
+    // with every other session on it (libjuice demultiplexes by ICE ufrag /
+    // remote address) instead of binding one socket per session
     std::string handleOffer(const std::string &sdp_offer,
                             const std::string &public_ip = "",
-                            const std::string &profile_level_id = "");
+                            uint16_t ice_port = 9000, bool udp_mux = false);
+
+    // cb gets the answer with all candidates once gathering completes
+    // (called right away if it already has, else on a libdatachannel thread)
+    void onGatheringComplete(AnswerCallback cb);
+
+    // Trickle ICE: local candidates from index `from` on
+    std::vector<rtc::Candidate> localCandidates(size_t from, bool &complete);
+    void addRemoteCandidate(const std::string &candidate,
+                            const std::string &mid);
+
+    // Producer side (source thread): queue a frame packetized by the
+    // source's RtpFanout. gop: cached frames since the last keyframe
+    // (excluding frame); if this session has not started yet they are
+    // queued first, fast-forwarded. On overflow this viewer drops frames
+    // until the next keyframe fits, without affecting other viewers.
+    void enqueue(const RtpFramePtr &frame,
+                 const std::vector<RtpFramePtr> &gop = {});
+
+    // Producer side (the source's pacer thread): queue one audio frame from
+    // the source's AudioFanout. Dropped until video has started: audio RTP
+    // timestamps derive from the PTS of the first video frame sent, so
+    // both tracks run on the source's one clock.
+    void enqueueAudio(const RtpFramePtr &frame);
+
+    // Consumer side (sender worker): send queued audio, then up to
+    // max_frames queued video frames. Only SSRC, sequence number,
+    // timestamp and payload type are rewritten per session. Returns true
+    // if frames remain.
+    bool drain(size_t max_frames);
+
+    // Without a sender, enqueue() drains inline on the producer thread.
+    // The pool owns the worker; the session only refers to it, so its last
+    // reference is never dropped on the worker's own thread.
+    void setSender(std::shared_ptr<SenderWorker> sender);
+
+    // The offer listed H.265: HEVC sources can skip the transcoder
+    bool acceptsHevc() const { return h265_pt_ > 0; }
+    // The offer had an audio section with Opus, PCMU or PCMA
+    bool hasAudio() const { return audio_track_ != nullptr; }
+    // Negotiated payload type for an audio codec, -1 if not offered
+    int audioPayloadType(RtpCodec codec) const;
+
+    // Rendition this session is attached to (index into the ladder), or
+    // kPassthrough for the untranscoded H.265 stream
+    static constexpr size_t kPassthrough = static_cast<size_t>(-1);
+    size_t rendition() const { return rendition_; }
+    void setRendition(size_t index) {
+        rendition_ = index;
+        rendition_metric_->set(
+            index == kPassthrough ? -1.0 : static_cast<double>(index));
+    }
+    // Restart on the next keyframe (or cached GOP) without a timestamp
+    // jump. Only while detached from every fanout.
+    void resync();
 
-    // Send H.264 Annex-B frame (one or more NALs with start codes)
-    // pts: 90kHz timestamp from RTSP, or -1 for auto-increment
-    void sendNal(const uint8_t *data, size_t size, bool is_keyframe);
-    void sendFrame(const uint8_t *data, size_t size, bool is_keyframe,
-                   int64_t pts = -1);
+    // Automatic rendition choice from the bandwidth estimate: ladder_kbps
+    // holds each rendition's bitrate (highest first, 0 = unknown, never
+    // picked), cb performs the switch. Disabled while the viewer pinned a
+    // rendition.
+    void setRenditionPolicy(std::vector<int> ladder_kbps,
+                            RenditionCallback cb);
+    void setAutoRendition(bool enabled);
+
+    // Per-viewer bandwidth estimate from RTCP receiver reports and REMB.
+    // cb fires (on a libdatachannel thread) after every update, e.g. to
+    // retarget a shared encoder.
+    void onEstimate(EstimateCallback cb);
+    int estimateKbps() const { return estimate_kbps_; }
+    // cb fires (on a libdatachannel thread) for every PLI/FIR: the
+    // viewer's decoder lost a reference picture and waits for an IDR
+    void onKeyframeRequest(KeyframeCallback cb);
+    // Congested beyond the lowest rendition: only keyframes are sent
+    bool keyframesOnly() const { return keyframes_only_; }
+
+    // cb fires once, on a libdatachannel thread, when the PeerConnection
+    // fails or closes; right away if it already has. Never for sinks.
+    void onClosed(ClosedCallback cb);
 
     bool isOpen() const;
-    std::string id() const;
+    const std::string &id() const;
 
 private:
+    void notifyClosed();
+    bool writable() const;
+    bool sendPackets(const RtpFrame &frame, uint32_t ts);
+    void sendAudio(const RtpFrame &frame, uint32_t ts);
+    void wakeSender();
+    // Video ts to (re)start on for a frame of this PTS; frames: how many
+    // are queued ending at it (replayed GOP)
+    uint32_t restartTs(int64_t pts, size_t frames) const;
+    std::string currentAnswer() const;
+    void onReport(const RtcpFeedbackHandler::ReportBlock &rb);
+    void onRemb(uint64_t bitrate);
+    void adapt(std::unique_lock<std::mutex> &lock);
+
+    std::string id_;
+    std::string public_ip_;
+    uint16_t ice_port_ = 9000;
+    std::string video_mid_;
     std::shared_ptr<rtc::PeerConnection> pc_;
     std::shared_ptr<rtc::Track> track_;
     std::shared_ptr<rtc::RtpPacketizationConfig> rtp_config_;
     std::shared_ptr<rtc::RtcpSrReporter> sr_reporter_;
-    uint32_t timestamp_ = 0;
-    int64_t first_pts_ = -1;
-    uint64_t frame_count_ = 0;
+    uint8_t payload_type_ = 96;
+    int h265_pt_ = -1; // negotiated H.265 payload type, -1: not offered
+    PacketSink sink_;
+
+    // Audio track (SSRC 43), only if the offer had a usable audio section
+    std::shared_ptr<rtc::Track> audio_track_;
+    // Created on the first frame sent, at that codec's clock; consumer side
+    std::shared_ptr<rtc::RtpPacketizationConfig> audio_rtp_config_;
+    std::shared_ptr<rtc::RtcpSrReporter> audio_sr_reporter_;
+    int opus_pt_ = -1, pcmu_pt_ = -1, pcma_pt_ = -1;
+    uint32_t audio_start_ts_ = 0;
+
+    // Producer-side state
+    struct QueuedFrame {
+        RtpFramePtr frame;
+        uint32_t ts = 0; // session RTP timestamp
+        bool replayed = false; // from the GOP cache, not traced
+    };
+    SpscRing<QueuedFrame> queue_{512};
+    SpscRing<QueuedFrame> audio_queue_{128}; // ~2.5s of 20ms frames
+    // PTS of the frame video first started on, -1 before. Set by the video
+    // producer, read by the audio producer; both tracks' timestamps, and
+    // video restarts after resync(), are PTS deltas from it.
+    std::atomic<int64_t> anchor_pts_{-1};
+    uint32_t start_ts_anchor_ = 0; // video ts at anchor_pts_
+    std::weak_ptr<SenderWorker> sender_;
+    bool has_sender_ = false;
+    uint32_t ts_offset_ = 0; // session RTP ts = source RTP ts + offset
+    uint32_t start_ts_ = 0;  // ts of the first frame after (re)start
+    uint32_t last_ts_ = 0;   // ts of the last queued frame
     bool got_keyframe_ = false;
+    bool dropping_ = false; // queue overflowed, waiting for a keyframe
+    bool skipping_ = false; // in keyframes-only mode
+    std::atomic<uint64_t> media_bytes_{0}; // offered to this viewer
+
+    // Consumer-side state
+    uint64_t frame_count_ = 0;
+    PacketBatch batch_; // reused per frame: rewritten packets
     std::mutex send_mtx_;
-    int64_t last_rtsp_pts_ = -1;
+
+    // Feedback state (libdatachannel threads)
+    std::atomic<size_t> rendition_{0};
+    std::vector<int> ladder_kbps_;
+    RenditionCallback rendition_cb_;
+    EstimateCallback estimate_cb_;
+    KeyframeCallback keyframe_cb_;
+    bool auto_rendition_ = true;
+    std::chrono::steady_clock::time_point last_switch_;
+    BandwidthEstimator estimator_;
+    std::atomic<int> estimate_kbps_{0};
+    std::atomic<bool> keyframes_only_{false};
+    double media_kbps_ = 0; // smoothed rate of the stream offered
+    uint64_t last_media_bytes_ = 0;
+    std::chrono::steady_clock::time_point last_report_;
+    std::mutex feedback_mtx_;
+
+    // Metrics, labelled with the session id
+    std::shared_ptr<Counter> frames_sent_;
+    std::shared_ptr<Counter> packets_sent_;
+    std::shared_ptr<Counter> bytes_sent_;
+    std::shared_ptr<Counter> send_failures_;     // packets the track refused
+    std::shared_ptr<Counter> dropped_;           // frames never queued
+    std::shared_ptr<Counter> nacked_;            // packets NACKed
+    std::shared_ptr<Counter> keyframe_requests_; // PLI + FIR
+    std::shared_ptr<Counter> audio_packets_sent_;
+    std::shared_ptr<Histogram> send_time_;
+    std::shared_ptr<Gauge> queue_depth_;
+    std::shared_ptr<Gauge> rendition_metric_;
+    std::shared_ptr<Gauge> estimate_metric_;
+    std::shared_ptr<Gauge> loss_metric_;
+    std::shared_ptr<Gauge> rtt_metric_;
+    std::shared_ptr<Gauge> jitter_metric_;
+
+    std::vector<rtc::Candidate> local_candidates_;
+    std::vector<AnswerCallback> answer_cbs_;
+    bool gathering_complete_ = false;
+    ClosedCallback closed_cb_;
+    bool closed_ = false;
+    std::mutex ice_mtx_;
 };